@@ -1,7 +1,14 @@
 #version 330 core
+#ifdef SHADOW_CUBE_ARRAY
+#extension GL_ARB_texture_cube_map_array : require
+#endif
 
 // Inputs from vertex shader.
+#ifdef LIGHT_VOLUME
+vec2 texUV; // Set from gl_FragCoord.
+#else
 in vec2 texUV;
+#endif
 
 // Output.
 layout(location = 0) out vec3 colour;
@@ -17,23 +24,74 @@ uniform sampler2D depthTexture;
 uniform sampler2DShadow shadowMap;
 uniform samplerCubeShadow shadowMapCube;
 uniform sampler2D ssaoNoiseTexture;
-
-uniform vec3 lightPositionWorldspace;
-uniform vec3 lightDirectionWorldspace;
-uniform int lightType; // 0 = directional, 1 = spot, 2 = point.
-uniform vec3 lightColour;
+uniform usampler2D tileLightMasks; // Bit i of a tile's RG is set if light i reaches it.
+uniform sampler2D shadowMoments; // Mean and mean square of occluder distance, for variance shadows.
+#ifdef SHADOW_CUBE_ARRAY
+uniform samplerCubeArrayShadow shadowMapCubeArray; // Layer LightData.falloff.w of each shadowed point light.
+#endif
+
+layout(std140) uniform ViewBlock {
+  mat4 V;
+  mat4 P;
+  mat4 VP;
+  mat4 invV;
+  mat4 invP;
+};
+
+struct LightData {
+  vec4 positionType; // w: 0 = directional, 1 = spot, 2 = point.
+  vec4 directionSpread; // w: spread in degrees.
+  vec4 colour;
+  vec4 ambience;
+  vec4 falloff; // w: layer in shadowMapCubeArray, -1 for none.
+};
+
+// Size must match MAX_LIGHTS.
+layout(std140) uniform LightBlock {
+  LightData lights[64];
+};
+uniform int lightIndex;
+
+// Values of LightData.positionType.w.
+#define LIGHT_DIRECTIONAL 0
+#define LIGHT_SPOT 1
+#define LIGHT_POINT 2
+
+// Must match LIGHT_TILE_SIZE.
+#define TILE_SIZE 16
+// Must match SHADOW_CASCADES.
+#define NUM_CASCADES 3
+
+// Summed ambient colour of all enabled lights, for the base pass.
 uniform vec3 lightAmbience;
-uniform vec3 lightFalloff;
-uniform float lightSpreadDegrees;
 
-uniform mat4 P;
-uniform mat4 V;
 uniform mat4 shadowmapDepthBiasVP;
+// x, y, width, height of the light's maps in shadowMap, in texture coordinates:
+// a spot map, both halves of a dual-paraboloid map or the row of cascades.
+uniform vec4 shadowAtlasRegion;
+// Directional lights: world space to shadowMap coordinates for each cascade,
+// and the view space distance each one reaches.
+uniform mat4 shadowCascadeVP[NUM_CASCADES];
+uniform vec4 shadowCascadeEnds;
+
+// Permutation defines: USE_DIFFUSE, USE_SPECULAR, USE_SHADOW, USE_SSAO,
+// PARABOLOID_SHADOW (point light shadows are dual-paraboloid maps),
+// VARIANCE_SHADOW (spot light shadows are read from shadowMoments),
+// SHADOW_CUBE_ARRAY (tiled point lights with a layer are shadowed) and
+// one of:
+//   BASE_PASS: emissive and ambient, once per frame. The only pass using USE_SSAO.
+//   TILED_LIGHTS: direct light from every light in the pixel's tile mask.
+//   DIRECTIONAL_LIGHT, SPOT_LIGHT, POINT_LIGHT: direct light from lightIndex.
+// Other shadows are only supported for a single light. LIGHT_VOLUME draws a
+// single light over its volume mesh instead of a full screen quad.
+#if defined(DIRECTIONAL_LIGHT)
+#define LIGHT_TYPE LIGHT_DIRECTIONAL
+#elif defined(SPOT_LIGHT)
+#define LIGHT_TYPE LIGHT_SPOT
+#elif defined(POINT_LIGHT)
+#define LIGHT_TYPE LIGHT_POINT
+#endif
 
-uniform bool useDiffuse = true;
-uniform bool useSpecular = true;
-uniform bool useShadow = true;
-uniform bool useSSAO = true;
 uniform vec3 ssaoKernel[4];
 
 // Pre-computed poisson disk.
@@ -87,117 +145,141 @@ float SSAO(mat3 kernelBasis, vec3 originPos, float cmpDepth, float radius) {
   return occlusion / 4.0;
 }
 
-void main(){
+// Keeps a shadowMap lookup half a texel inside region, so linear filtering,
+// sample offsets and coordinates past the map's edge never read its neighbours
+// in the atlas.
+vec2 clampToAtlasRegion(vec2 uv, vec4 region) {
+  vec2 halfTexel = 0.5 / vec2(textureSize(shadowMap, 0));
+  return clamp(uv, region.xy + halfTexel, region.xy + region.zw - halfTexel);
+}
 
-  // Material properties
-  vec3 material_kd;
-  if (useDiffuse) {
-    material_kd = texture2D(diffuseTexture, texUV).rgb;
+// Dual-paraboloid lookup. shadowmapDepthBiasVP takes world space to light
+// space, scaled so the far distance is 1. The hemisphere facing -Z is the left
+// half of the map, the one facing +Z the right half.
+float paraboloidShadow(vec4 positionWorldspace, float bias) {
+  vec3 p = (shadowmapDepthBiasVP * positionWorldspace).xyz;
+  float dist = length(p);
+  vec3 d = p / dist;
+
+  vec2 uv;
+  float side;
+  if (d.z <= 0.0) {
+    uv = d.xy / (1.0 - d.z);
+    side = 0.0;
   } else {
-    material_kd = vec3(0, 0, 0);
+    // The back hemisphere is rendered turned around the Y axis.
+    uv = vec2(-d.x, d.y) / (1.0 + d.z);
+    side = 1.0;
   }
-  vec3 material_emissive = texture2D(emissiveTexture, texUV).rgb;
+  vec4 region = vec4(shadowAtlasRegion.x + side * shadowAtlasRegion.z * 0.5, shadowAtlasRegion.y, shadowAtlasRegion.z * 0.5, shadowAtlasRegion.w);
+  uv = region.xy + (uv * 0.5 + 0.5) * region.zw;
+  return texture(shadowMap, vec3(clampToAtlasRegion(uv, region), dist - bias));
+}
 
-  // Don't write pixels that weren't actually drawn onto this texture.
-  /*
-  if (material_kd == vec3(0, 0, 0) && material_emissive == vec3(0, 0, 0)) {
-    colour = vec3(0, 0, 0);
-    return;
-  }
-  */
+// Cube map depth of a point v away from the light, as the cube depth pass
+// writes it for the face v points at.
+float cubeShadowDepth(vec3 v) {
+  float lzc = max(abs(v.x), max(abs(v.y), abs(v.z)));
+  float f = 500;
+  float n = 1.0;
+  float nzc = (f+n)/(f-n) - (2*f*n)/(f-n)/lzc;
+  return (nzc + 1.0) * 0.5;
+}
 
-  vec3 material_ks;
-  float material_shininess;
-  if (useSpecular) {
-    vec4 material_ks_shininess = texture2D(specularTexture, texUV).rgba;
-    material_ks = material_ks_shininess.rgb;
-    material_shininess = material_ks_shininess.a * 200.0;
-  } else {
-    material_ks = vec3(0, 0, 0);
-    material_shininess = 0;
+// Chebyshev upper bound on the fraction of light reaching shadowCoord, from
+// the filtered moments around it. Their depth is shadowCoord's w. Callers
+// may be in non-uniform control flow, so the screen space derivatives of the
+// moments coordinates are passed in to pick the mip level.
+float varianceShadow(vec4 shadowCoord, vec2 uvDx, vec2 uvDy) {
+  vec2 moments = textureGrad(shadowMoments, shadowCoord.xy / shadowCoord.w, uvDx, uvDy).xy;
+  float depth = shadowCoord.w;
+  if (depth <= moments.x) {
+    return 1.0;
   }
+  float variance = max(moments.y - moments.x * moments.x, 0.0001);
+  float d = depth - moments.x;
+  float pMax = variance / (variance + d * d);
+  // Cut off the low end of the bound, where light leaks through overlapping occluders.
+  return clamp((pMax - 0.2) / 0.8, 0.0, 1.0);
+}
 
-  vec3 lightFalloffModified = lightFalloff;
-  vec3 material_ka = lightAmbience * material_kd;
+// G-buffer values at this pixel.
+struct Surface {
+  vec3 kd;
+  vec3 ks;
+  float shininess;
+  vec3 n; // Camera space.
+  vec3 E; // Towards the camera, camera space.
+  vec4 positionCameraspace;
+  vec4 positionWorldspace;
+};
+
+// Light from one light reaching the eye off this surface, without the ambient term.
+// type is a constant for single light variants, so the branches fold away.
+vec3 directLight(LightData light, int type, Surface s) {
+  vec3 lightPositionWorldspace = light.positionType.xyz;
+  vec3 lightDirectionWorldspace = light.directionSpread.xyz;
+  float lightSpreadDegrees = light.directionSpread.w;
+  vec3 lightColour = light.colour.rgb;
+  vec3 lightFalloff = light.falloff.xyz;
 
+  vec3 lightFalloffModified = lightFalloff;
   float directLightToEyeIntensity = 0;
 
-  float x = texUV.x;
-  float y = texUV.y;
-  float z = texture2D(depthTexture, texUV).r;
-
-  vec4 vertexPositionScreenspace = vec4(vec3(x, y, z) * 2.0 - 1.0, 1); // Clip space.
-  vec4 vertexPositionCameraspace = inverse(P) * vertexPositionScreenspace;
-  vertexPositionCameraspace = vertexPositionCameraspace / vertexPositionCameraspace.w;
-
-  vec4 vertexPositionWorldspace = inverse(V) * vertexPositionCameraspace;
-  //vertexPositionWorldspace = vertexPositionWorldspace / vertexPositionWorldspace.w;
-
-  // Vector that goes from the vertex to the camera, in camera space.
-  vec3 eyeDirectionCameraspace = -vertexPositionCameraspace.xyz / vertexPositionCameraspace.w;
-
+  vec4 vertexPositionCameraspace = s.positionCameraspace;
+  vec4 vertexPositionWorldspace = s.positionWorldspace;
   vec3 lightPositionCameraspace = (V * vec4(lightPositionWorldspace, 1.0)).xyz;
   vec3 vertexPositionToLightPositionWorldspace = lightPositionWorldspace - vertexPositionWorldspace.xyz;
 
   // Vector in the direction light is facing, in camera space
   vec3 lightDirectionCameraspace = (V * vec4(lightDirectionWorldspace, 0)).xyz;
-  // Normal of the computed fragment, in camera space.
-  vec3 n = texture2D(normalTexture, texUV).rgb * 2.0 - 1.0;
+  vec3 n = s.n;
   vec3 l = vec3(0, 0, 0); // Direction of the light (from the fragment to the light) in camera space;
-
-  // Eye vector (towards the camera)
-  vec3 E = normalize(eyeDirectionCameraspace);
+  vec3 E = s.E;
   float lightSpreadRadians = radians(lightSpreadDegrees);
 
-  switch (lightType) {
-    case 0:
-      // For directional light just reverse light direction.
-      l = -normalize(lightDirectionCameraspace);
-      break;
-    case 1:
-      // For spot light and point light use point's position.
-      // This is wrong!: l = normalize((V * vec4(vertexPositionToLightPositionWorldspace, 1.0)).xyz);
-      l = normalize(lightPositionCameraspace - vertexPositionCameraspace.xyz);
-
-
-//dot(normalize(vertexPositionToLightPositionWorldspace), normalize(lightDirectionWorldspace))
-
-      float dotVertexLightPos = dot(normalize(vertexPositionCameraspace.xyz), normalize(lightPositionCameraspace));
-
-      float coneAngleFactor =
-        clamp(normalize(lightDirectionCameraspace).z, 0, 1)
-        *
-        clamp(-normalize(lightPositionCameraspace).z, 0, 1)
-        *
-        clamp(dotVertexLightPos, 0, 1);
-/*
-        clamp(dot(vec3(0, 0, -1), normalize(-lightDirectionCameraspace)), 0, 1)
-        *
-        clamp(dot(vec3(0, 0, -1), normalize(lightPositionCameraspace)), 0, 1)
-        *
-        clamp(dot(normalize(vertexPositionCameraspace.xyz), normalize(lightPositionCameraspace)), 0, 1);
-*/
-
-// TODO: Visibility check with cone - intersect ray with cone and compare depth with fragment depth.
-      directLightToEyeIntensity =
-        //step(acos(dot(normalize(vertexPositionWorldspace.xyz - lightPositionWorldspace), normalize(lightDirectionWorldspace))), lightSpreadRadians) *
-        pow(coneAngleFactor, 8); // TODO: Factor in spread angle?
-
-      break;
-    case 2:
-      // For spot light and point light use point's position.
-      // This is wrong!: l = normalize((V * vec4(vertexPositionToLightPositionWorldspace, 1.0)).xyz);
-      l = normalize(lightPositionCameraspace - vertexPositionCameraspace.xyz);
-
-      directLightToEyeIntensity =
-        step(vertexPositionCameraspace.z, lightPositionCameraspace.z - 0.3)
-        * (
-          //0.2*dot(normalize(lightPositionCameraspace), -E)
-          //+
-          1.2*pow(clamp(dot(normalize(vertexPositionCameraspace.xyz), normalize(lightPositionCameraspace)), 0, 1), 1000)
-        );
-
-      break;
+  if (type == LIGHT_DIRECTIONAL) {
+    // For directional light just reverse light direction.
+    l = -normalize(lightDirectionCameraspace);
+  } else if (type == LIGHT_SPOT) {
+    // For spot light and point light use point's position.
+    // This is wrong!: l = normalize((V * vec4(vertexPositionToLightPositionWorldspace, 1.0)).xyz);
+    l = normalize(lightPositionCameraspace - vertexPositionCameraspace.xyz);
+
+    //dot(normalize(vertexPositionToLightPositionWorldspace), normalize(lightDirectionWorldspace))
+
+    float dotVertexLightPos = dot(normalize(vertexPositionCameraspace.xyz), normalize(lightPositionCameraspace));
+
+    float coneAngleFactor =
+      clamp(normalize(lightDirectionCameraspace).z, 0, 1)
+      *
+      clamp(-normalize(lightPositionCameraspace).z, 0, 1)
+      *
+      clamp(dotVertexLightPos, 0, 1);
+    /*
+      clamp(dot(vec3(0, 0, -1), normalize(-lightDirectionCameraspace)), 0, 1)
+      *
+      clamp(dot(vec3(0, 0, -1), normalize(lightPositionCameraspace)), 0, 1)
+      *
+      clamp(dot(normalize(vertexPositionCameraspace.xyz), normalize(lightPositionCameraspace)), 0, 1);
+    */
+
+    // TODO: Visibility check with cone - intersect ray with cone and compare depth with fragment depth.
+    directLightToEyeIntensity =
+      //step(acos(dot(normalize(vertexPositionWorldspace.xyz - lightPositionWorldspace), normalize(lightDirectionWorldspace))), lightSpreadRadians) *
+      pow(coneAngleFactor, 8); // TODO: Factor in spread angle?
+  } else {
+    // For spot light and point light use point's position.
+    // This is wrong!: l = normalize((V * vec4(vertexPositionToLightPositionWorldspace, 1.0)).xyz);
+    l = normalize(lightPositionCameraspace - vertexPositionCameraspace.xyz);
+
+    directLightToEyeIntensity =
+      step(vertexPositionCameraspace.z, lightPositionCameraspace.z - 0.3)
+      * (
+        //0.2*dot(normalize(lightPositionCameraspace), -E)
+        //+
+        1.2*pow(clamp(dot(normalize(vertexPositionCameraspace.xyz), normalize(lightPositionCameraspace)), 0, 1), 1000)
+      );
   }
 
   // Clamped Cosine of the angle between the normal and the light direction.
@@ -214,118 +296,209 @@ void main(){
 
   float visibility = 0.0;
 
-  if (!useShadow) {
-    visibility = 1.0;
-  } else {
-    vec4 shadowCoord = shadowmapDepthBiasVP * vertexPositionWorldspace;
-
-    // Variable bias (based off of gradient).
-    float bias = 0.005 * tan(acos(cosTheta));
-    bias = clamp(bias, 0, 0.01);
-
-    // Sample the shadow map n times.
-    int num_samples = 1; // TODO: Up samples for some light types.
-    for (int i = 0; i < num_samples; i++){
-      vec2 offset = vec2(0, 0);
-      if (num_samples > 1) {
-        offset = poissonDisk[i]/700.0;
+#if defined(SHADOW_CUBE_ARRAY)
+  visibility = 1.0;
+  if (type == LIGHT_POINT && light.falloff.w >= 0.0) {
+    float bias = clamp(0.005 * tan(acos(cosTheta)), 0, 0.01);
+    vec3 v = vertexPositionToLightPositionWorldspace;
+    visibility = texture(shadowMapCubeArray, vec4(-v, light.falloff.w), cubeShadowDepth(v) - bias - 0.002);
+  }
+#elif !defined(USE_SHADOW)
+  visibility = 1.0;
+#else
+  vec4 shadowCoord = shadowmapDepthBiasVP * vertexPositionWorldspace;
+#ifdef VARIANCE_SHADOW
+  // Still in uniform control flow here, unlike the fetch in the cone test below.
+  vec2 momentsDx = dFdx(shadowCoord.xy / shadowCoord.w);
+  vec2 momentsDy = dFdy(shadowCoord.xy / shadowCoord.w);
+#endif
+
+  // Variable bias (based off of gradient).
+  float bias = 0.005 * tan(acos(cosTheta));
+  bias = clamp(bias, 0, 0.01);
+
+  // Sample the shadow map n times.
+  int num_samples = 1; // TODO: Up samples for some light types.
+  for (int i = 0; i < num_samples; i++){
+    vec2 offset = vec2(0, 0);
+    if (num_samples > 1) {
+      offset = poissonDisk[i]/700.0;
+    }
+
+    if (type == LIGHT_DIRECTIONAL) {
+      // The first cascade that reaches the fragment. There are no shadows past the last.
+      float viewDepth = -(V * vertexPositionWorldspace).z;
+      int cascade = 0;
+      while (cascade < NUM_CASCADES && viewDepth > shadowCascadeEnds[cascade]) {
+        cascade++;
+      }
+      if (cascade == NUM_CASCADES) {
+        visibility += 1.0;
+      } else {
+        vec4 cascadeCoord = shadowCascadeVP[cascade] * vertexPositionWorldspace;
+        float cascadeWidth = shadowAtlasRegion.z / float(NUM_CASCADES);
+        vec4 region = vec4(shadowAtlasRegion.x + float(cascade) * cascadeWidth, shadowAtlasRegion.y, cascadeWidth, shadowAtlasRegion.w);
+        visibility += texture(shadowMap, vec3(clampToAtlasRegion(cascadeCoord.xy + offset, region), cascadeCoord.z - bias));
       }
+    } else if (type == LIGHT_SPOT) {
+      float coneAngle = acos(dot(-normalize(vertexPositionToLightPositionWorldspace), normalize(lightDirectionWorldspace)));
 
-      switch (lightType) {
-        case 0: // Directional light.
-          visibility += texture(shadowMap, vec3(shadowCoord.xy + offset, (shadowCoord.z - bias)/shadowCoord.w));
-          break;
-
-        case 1: // Spot light.
-          float coneAngle = acos(dot(-normalize(vertexPositionToLightPositionWorldspace), normalize(lightDirectionWorldspace)));
-
-          /*
-          // Hard circle.
-          if (coneAngle <= lightSpreadRadians) {
-            visibility += texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w, (shadowCoord.z - bias)/shadowCoord.w));
-          }
-          */
-
-          // Quadratic falloff by angle.
-          float distFrac = coneAngle/lightSpreadRadians;
-          if (distFrac <= 1.0) {
-            visibility += /*step(-1.0, -distFrac) * */ (1 - distFrac/2.5) * (1 - distFrac) * texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w + offset, (shadowCoord.z - bias)/shadowCoord.w));
-          }
-
-          // Exponential light decay by angle.
-          //visibility += (2 - pow(2, coneAngle/lightSpreadRadians)) * texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w, (shadowCoord.z - bias)/shadowCoord.w));
-
-          // Staged falloff.
-          /*
-          float distFrac = coneAngle/lightSpreadRadians;
-          if (distFrac <= 1.0) {
-            visibility += texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w, (shadowCoord.z - bias)/shadowCoord.w));;
-            if (distFrac < 0.3) {
-              // Nothing extra.
-            } else if (distFrac < 0.7) {
-              lightFalloffModified.x += 1.0;
-              //lightFalloffModified.y += 1.0;
-              //lightFalloffModified.z += 1.0;
-            } else {
-              lightFalloffModified.x += 2.0;
-              //lightFalloffModified.y += 2.0;
-              //lightFalloffModified.z += 3.0;
-            }
-          }
-          */
-          break;
-
-        case 2: // Point light.
-          // Turn world space vector to depth value to compare with shadow map ortho depth.
-          vec3 absvec = abs(vertexPositionToLightPositionWorldspace);
-          vec3 v = vertexPositionToLightPositionWorldspace;
-          float lzc = max(abs(v.x), max(abs(v.y), abs(v.z)));
-          float f = 500;
-          float n = 1.0;
-          float nzc = (f+n)/(f-n) - (2*f*n)/(f-n)/lzc;
-          float v2dv = (nzc + 1.0) * 0.5;
-
-          visibility += texture(shadowMapCube, vec4(shadowCoord.xyz/shadowCoord.w + vec3(offset, offset.x), v2dv - bias - 0.002));
-
-          break;
+      /*
+      // Hard circle.
+      if (coneAngle <= lightSpreadRadians) {
+        visibility += texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w, (shadowCoord.z - bias)/shadowCoord.w));
+      }
+      */
+
+      // Quadratic falloff by angle.
+      float distFrac = coneAngle/lightSpreadRadians;
+      if (distFrac <= 1.0) {
+#ifdef VARIANCE_SHADOW
+        // Already filtered, one fetch is the soft shadow.
+        float lit = varianceShadow(shadowCoord, momentsDx, momentsDy);
+#else
+        float lit = texture(shadowMap, vec3(clampToAtlasRegion(shadowCoord.xy/shadowCoord.w + offset, shadowAtlasRegion), (shadowCoord.z - bias)/shadowCoord.w));
+#endif
+        visibility += /*step(-1.0, -distFrac) * */ (1 - distFrac/2.5) * (1 - distFrac) * lit;
       }
-    }
 
-    visibility = visibility / num_samples;
+      // Exponential light decay by angle.
+      //visibility += (2 - pow(2, coneAngle/lightSpreadRadians)) * texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w, (shadowCoord.z - bias)/shadowCoord.w));
+
+      // Staged falloff.
+      /*
+      float distFrac = coneAngle/lightSpreadRadians;
+      if (distFrac <= 1.0) {
+        visibility += texture(shadowMap, vec3(shadowCoord.xy/shadowCoord.w, (shadowCoord.z - bias)/shadowCoord.w));;
+        if (distFrac < 0.3) {
+          // Nothing extra.
+        } else if (distFrac < 0.7) {
+          lightFalloffModified.x += 1.0;
+          //lightFalloffModified.y += 1.0;
+          //lightFalloffModified.z += 1.0;
+        } else {
+          lightFalloffModified.x += 2.0;
+          //lightFalloffModified.y += 2.0;
+          //lightFalloffModified.z += 3.0;
+        }
+      }
+      */
+    } else {
+#ifdef PARABOLOID_SHADOW
+      // Its depth is linear in distance, so it needs less bias than perspective depth.
+      visibility += paraboloidShadow(vertexPositionWorldspace, bias * 0.1);
+#else
+      // Turn world space vector to depth value to compare with shadow map ortho depth.
+      float v2dv = cubeShadowDepth(vertexPositionToLightPositionWorldspace);
+
+      visibility += texture(shadowMapCube, vec4(shadowCoord.xyz/shadowCoord.w + vec3(offset, offset.x), v2dv - bias - 0.002));
+#endif
+    }
   }
 
+  visibility = visibility / num_samples;
+#endif
+
   float lightDist = length(vertexPositionToLightPositionWorldspace);
   float attenuation = 1.0 / dot(lightFalloffModified, vec3(1, lightDist, lightDist*lightDist));
 
+  return lightColour * attenuation
+    * (
+       visibility
+       * (
+         s.kd * cosTheta                 // Diffuse.
+       + s.ks * pow(cosAlpha, s.shininess) // Specular.
+       )
+   + directLightToEyeIntensity // Direct light.
+   );
+}
 
+void main(){
+#ifdef LIGHT_VOLUME
+  texUV = gl_FragCoord.xy / vec2(textureSize(depthTexture, 0));
+#endif
 
-  // SSAO.
-  float ambientOcclusion = 0.0;
-  if (useSSAO) {
-    vec2 noiseTexCoords = texUV * vec2(textureSize(depthTexture, 0)) / vec2(4.0, 4.0);
-    // Kernel basis matrix.
-    vec3 rvec = texture(ssaoNoiseTexture, noiseTexCoords).rgb * 2.0 - 1.0;
+  Surface s;
 
-    // Gram-Schmidt.
-    vec3 tangent = normalize(rvec - n * dot(rvec, n));
-    vec3 bitangent = cross(tangent, n);
-    mat3 kernelBasis = mat3(tangent, bitangent, n);
+  // Material properties
+#ifdef USE_DIFFUSE
+  s.kd = texture2D(diffuseTexture, texUV).rgb;
+#else
+  s.kd = vec3(0, 0, 0);
+#endif
+  vec3 material_emissive = texture2D(emissiveTexture, texUV).rgb;
 
-    ambientOcclusion = SSAO(kernelBasis, vertexPositionCameraspace.xyz, z, 1.5);
+  // Don't write pixels that weren't actually drawn onto this texture.
+  /*
+  if (s.kd == vec3(0, 0, 0) && material_emissive == vec3(0, 0, 0)) {
+    colour = vec3(0, 0, 0);
+    return;
   }
+  */
 
-  colour = material_emissive                 // Emissive.
-    + material_ka * (1.0 - ambientOcclusion) // Ambient.
-    + lightColour * attenuation
-    * (
-       visibility
-       * (
-         material_kd * cosTheta                 // Diffuse.
-       + material_ks * pow(cosAlpha, material_shininess) // Specular.
-       )
-   + directLightToEyeIntensity // Direct light.
-   )
-  ;
+#ifdef USE_SPECULAR
+  vec4 material_ks_shininess = texture2D(specularTexture, texUV).rgba;
+  s.ks = material_ks_shininess.rgb;
+  s.shininess = material_ks_shininess.a * 200.0;
+#else
+  s.ks = vec3(0, 0, 0);
+  s.shininess = 0;
+#endif
+
+  float x = texUV.x;
+  float y = texUV.y;
+  float z = texture2D(depthTexture, texUV).r;
+
+  vec4 vertexPositionScreenspace = vec4(vec3(x, y, z) * 2.0 - 1.0, 1); // Clip space.
+  s.positionCameraspace = invP * vertexPositionScreenspace;
+  s.positionCameraspace = s.positionCameraspace / s.positionCameraspace.w;
+
+  s.positionWorldspace = invV * s.positionCameraspace;
+  //s.positionWorldspace = s.positionWorldspace / s.positionWorldspace.w;
+
+  // Vector that goes from the vertex to the camera, in camera space.
+  vec3 eyeDirectionCameraspace = -s.positionCameraspace.xyz / s.positionCameraspace.w;
+
+  // Normal of the computed fragment, in camera space.
+  s.n = texture2D(normalTexture, texUV).rgb * 2.0 - 1.0;
+
+  // Eye vector (towards the camera)
+  s.E = normalize(eyeDirectionCameraspace);
+
+  // SSAO.
+  float ambientOcclusion = 0.0;
+#ifdef USE_SSAO
+  vec2 noiseTexCoords = texUV * vec2(textureSize(depthTexture, 0)) / vec2(4.0, 4.0);
+  // Kernel basis matrix.
+  vec3 rvec = texture(ssaoNoiseTexture, noiseTexCoords).rgb * 2.0 - 1.0;
+
+  // Gram-Schmidt.
+  vec3 tangent = normalize(rvec - s.n * dot(rvec, s.n));
+  vec3 bitangent = cross(tangent, s.n);
+  mat3 kernelBasis = mat3(tangent, bitangent, s.n);
+
+  ambientOcclusion = SSAO(kernelBasis, s.positionCameraspace.xyz, z, 1.5);
+#endif
+
+#if defined(BASE_PASS)
+  colour = material_emissive                            // Emissive.
+    + lightAmbience * s.kd * (1.0 - ambientOcclusion); // Ambient.
+#elif defined(TILED_LIGHTS)
+  colour = vec3(0, 0, 0);
+  uvec2 mask = texelFetch(tileLightMasks, ivec2(gl_FragCoord.xy) / TILE_SIZE, 0).rg;
+  for (int word = 0; word < 2; word++) {
+    uint bits = mask[word];
+    for (int bit = 0; bit < 32 && bits != 0u; bit++) {
+      if ((bits & 1u) != 0u) {
+        LightData light = lights[word * 32 + bit];
+        colour += directLight(light, int(light.positionType.w), s);
+      }
+      bits >>= 1u;
+    }
+  }
+#else
+  colour = directLight(lights[lightIndex], LIGHT_TYPE, s);
+#endif
 
   // Visualize normals in camera space.
   //colour = n * 0.5 + 0.5;
@@ -6,8 +6,17 @@ layout(location = 0) in vec3 quadPositionModelspace;
 // Interpolated outputs.
 out vec2 texUV;
 
+#ifdef LIGHT_VOLUME
+// Sphere or cone around the light, texUV is then found from the fragment position.
+uniform mat4 lightVolumeMVP;
+#endif
+
 void main(){
+#ifdef LIGHT_VOLUME
+  gl_Position = lightVolumeMVP * vec4(quadPositionModelspace, 1);
+  texUV = vec2(0, 0);
+#else
   gl_Position = vec4(quadPositionModelspace, 1);
   texUV = (quadPositionModelspace.xy + 1.0) / 2.0;
+#endif
 }
-
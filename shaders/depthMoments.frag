@@ -0,0 +1,13 @@
+#version 330 core
+
+layout(location = 0) out vec2 moments;
+
+void main(){
+  // Distance along the light's axis, which the lookup gets as the shadow coordinate's w.
+  float depth = 1.0 / gl_FragCoord.w;
+
+  // Adding the variance of the depth over the texel keeps sloped surfaces from shadowing themselves.
+  float dx = dFdx(depth);
+  float dy = dFdy(depth);
+  moments = vec2(depth, depth * depth + 0.25 * (dx * dx + dy * dy));
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// Input vertex data, different for all executions of this shader.
+layout(location = 0) in vec3 vertexPositionModelspace;
+
+// Model to light space, scaled so the far distance is 1. The hemisphere
+// rendered is the one facing -Z.
+uniform mat4 depthMVP;
+// Casters closer to the light than this, in the same units, are clipped.
+uniform float paraboloidNear;
+
+out float gl_ClipDistance[2];
+
+void main(){
+  vec3 p = (depthMVP * vec4(vertexPositionModelspace, 1)).xyz;
+  float dist = length(p);
+  vec3 d = p / dist;
+
+  // Clip the other hemisphere and anything around the light itself.
+  gl_ClipDistance[0] = -d.z;
+  gl_ClipDistance[1] = dist - paraboloidNear;
+
+  gl_Position = vec4(d.xy / max(1.0 - d.z, 1e-5), dist * 2.0 - 1.0, 1.0);
+}
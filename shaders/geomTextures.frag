@@ -20,12 +20,19 @@ out float gl_FragDepth;
 uniform sampler2D diffuseTexture;
 uniform sampler2D normalTexture;
 
-uniform bool useDiffuseTexture;
-uniform bool useNormalTexture;
-uniform vec3 material_kd;
-uniform vec3 material_ks;
-uniform float material_shininess;
-uniform vec3 material_emissive;
+// Permutation defines: USE_DIFFUSE_TEXTURE, USE_NORMAL_TEXTURE.
+
+struct MaterialData {
+  vec4 diffuseShininess;
+  vec4 specular;
+  vec4 emissive;
+};
+
+// Size must match MAX_MATERIALS.
+layout(std140) uniform MaterialBlock {
+  MaterialData materials[256];
+};
+uniform int materialIndex;
 
 uniform vec3 halfspacePoint; // Model space.
 uniform vec3 halfspaceNormal; // (0, 0, 0) means don't do test.
@@ -39,6 +46,8 @@ void main() {
     discard;
   }
 
+  MaterialData material = materials[materialIndex];
+
   vec2 UV;
   // TODO: Make this uncessary by un-perspective dividing on CPU?
   if (useNoPerspectiveUVs) {
@@ -48,30 +57,30 @@ void main() {
   }
 
   // Output Diffuse colour.
-  if (useDiffuseTexture) {
-    outDiffuse = texture2D(diffuseTexture, UV).rgb;
-  } else {
-    outDiffuse = material_kd;
-  }
+#ifdef USE_DIFFUSE_TEXTURE
+  outDiffuse = texture2D(diffuseTexture, UV).rgb;
+#else
+  outDiffuse = material.diffuseShininess.rgb;
+#endif
 
-  outSpecular = vec4(material_ks, material_shininess/200.0);
-  outEmissive = material_emissive;
+  outSpecular = vec4(material.specular.rgb, material.diffuseShininess.w/200.0);
+  outEmissive = material.emissive.rgb;
 
   //vec3 normalCameraspace2 = (normalize(normalCameraspace) + 1.0) / 2.0; // Shift normal to be positive.
 
-  if (useNormalTexture) {
-    // Gram-Schmidt, in camera space.
-    vec3 tangent = normalize(tangentCameraspace); //normalize(tangentCameraspace - normalCameraspace * dot(normalCameraspace, tangentCameraspace));
-    // TODO: Why does negative improve this?
-    vec3 bitangent = -normalize(bitangentCameraspace); //cross(normalCameraspace, tangent);
+#ifdef USE_NORMAL_TEXTURE
+  // Gram-Schmidt, in camera space.
+  vec3 tangent = normalize(tangentCameraspace); //normalize(tangentCameraspace - normalCameraspace * dot(normalCameraspace, tangentCameraspace));
+  // TODO: Why does negative improve this?
+  vec3 bitangent = -normalize(bitangentCameraspace); //cross(normalCameraspace, tangent);
 
-    // Represents tangent space -> camera space.
-    mat3 tbn = mat3(tangent, bitangent, normalize(normalCameraspace));
+  // Represents tangent space -> camera space.
+  mat3 tbn = mat3(tangent, bitangent, normalize(normalCameraspace));
 
-    outNormal = tbn * (texture2D(normalTexture, UV).xyz * 2.0 - 1.0);
-  } else {
-    outNormal = normalize(normalCameraspace);
-  }
+  outNormal = tbn * (texture2D(normalTexture, UV).xyz * 2.0 - 1.0);
+#else
+  outNormal = normalize(normalCameraspace);
+#endif
   outNormal = (outNormal + 1.0)/2.0; // Shift to fit into texture colour.
 
   outPicking = meshId/65536.0;
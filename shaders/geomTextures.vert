@@ -17,14 +17,19 @@ out vec3 bitangentCameraspace;
 out vec3 eyeDirectionCameraspace;
 
 // Constant inputs.
-uniform mat4 MVP;
-uniform mat4 V;
+layout(std140) uniform ViewBlock {
+  mat4 V;
+  mat4 P;
+  mat4 VP;
+  mat4 invV;
+  mat4 invP;
+};
 uniform mat4 M;
 // TODO: lerp two states.
 //uniform float vertexMixer; // 0 - fully first, 1 - fully second.
 
 void main(){
-  gl_Position = MVP * vec4(vertexPositionModelspace, 1);
+  gl_Position = VP * M * vec4(vertexPositionModelspace, 1);
   positionModelspace = vertexPositionModelspace;
 
   // Normal of the the vertex, in camera space.
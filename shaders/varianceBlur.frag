@@ -0,0 +1,21 @@
+#version 330 core
+
+layout(location = 0) out vec2 blurredMoments;
+
+uniform sampler2D moments;
+// Texture coordinate offset between taps: one texel of the output along the blur direction.
+uniform vec2 blurStep;
+// Fraction of moments in use, from its bottom left corner.
+uniform float uvScale;
+
+in vec2 UV;
+
+void main(){
+  vec2 uv = UV * uvScale;
+  // Binomial weights. Taps at a half-resolution output filter 2x2 input texels each.
+  blurredMoments = (texture(moments, uv - 2.0 * blurStep).xy
+                    + 4.0 * texture(moments, uv - blurStep).xy
+                    + 6.0 * texture(moments, uv).xy
+                    + 4.0 * texture(moments, uv + blurStep).xy
+                    + texture(moments, uv + 2.0 * blurStep).xy) / 16.0;
+}
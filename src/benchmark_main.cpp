@@ -0,0 +1,33 @@
+/*
+ * Headless benchmark of the renderer's own CPU cost. GL calls go to the null
+ * backend, so no window or driver is involved.
+ *
+ * Usage: benchmark [frames]
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include "gl_backend.hpp"
+#include "viewer.hpp"
+
+int main(int argc, char* argv[]) {
+  int numFrames = 100;
+  if (argc > 1) {
+    numFrames = atoi(argv[1]);
+  }
+  if (numFrames <= 0) {
+    std::cerr << "Frame count must be positive" << std::endl;
+    return 1;
+  }
+
+  gl::NullBackend backend;
+  gl::setBackend(&backend);
+
+  Viewer viewer(true);
+  if (!viewer.initialize()) {
+    return 1;
+  }
+  viewer.runBenchmark(&backend, numFrames);
+
+  return 0;
+}
@@ -0,0 +1,133 @@
+
+#include "gl_backend.hpp"
+
+namespace gl {
+
+static OpenGLBackend openGLBackend;
+Backend* backend = &openGLBackend;
+
+static const char* functionNames[] = {
+#define GL_BACKEND_NAME(ret, name, params, args) "gl" #name,
+  GL_BACKEND_FUNCTIONS(GL_BACKEND_NAME)
+  GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_NAME)
+#undef GL_BACKEND_NAME
+};
+
+const char* getFunctionName(Function function) {
+  return functionNames[function];
+}
+
+Backend* getBackend() {
+  return backend;
+}
+
+void setBackend(Backend* newBackend) {
+  backend = newBackend;
+}
+
+
+#define GL_BACKEND_FORWARD(ret, name, params, args) ret OpenGLBackend::name params { return gl##name args; }
+GL_BACKEND_FUNCTIONS(GL_BACKEND_FORWARD)
+GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_FORWARD)
+#undef GL_BACKEND_FORWARD
+
+
+NullBackend::NullBackend(): nextName(1), nextUniformLocation(0) {
+  resetCounters();
+}
+
+// The generated bodies don't look at their arguments.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#define GL_BACKEND_COUNT(ret, name, params, args) ret NullBackend::name params { calls[FUNCTION_##name]++; return ret(); }
+GL_BACKEND_FUNCTIONS(GL_BACKEND_COUNT)
+#undef GL_BACKEND_COUNT
+#pragma GCC diagnostic pop
+
+GLenum NullBackend::CheckFramebufferStatus(GLenum) {
+  calls[FUNCTION_CheckFramebufferStatus]++;
+  return GL_FRAMEBUFFER_COMPLETE;
+}
+
+GLuint NullBackend::CreateProgram() {
+  calls[FUNCTION_CreateProgram]++;
+  return nextName++;
+}
+
+GLuint NullBackend::CreateShader(GLenum) {
+  calls[FUNCTION_CreateShader]++;
+  return nextName++;
+}
+
+void NullBackend::GenBuffers(GLsizei n, GLuint* buffers) {
+  calls[FUNCTION_GenBuffers]++;
+  genNames(n, buffers);
+}
+
+void NullBackend::GenFramebuffers(GLsizei n, GLuint* framebuffers) {
+  calls[FUNCTION_GenFramebuffers]++;
+  genNames(n, framebuffers);
+}
+
+void NullBackend::GenRenderbuffers(GLsizei n, GLuint* renderbuffers) {
+  calls[FUNCTION_GenRenderbuffers]++;
+  genNames(n, renderbuffers);
+}
+
+void NullBackend::GenTextures(GLsizei n, GLuint* textures) {
+  calls[FUNCTION_GenTextures]++;
+  genNames(n, textures);
+}
+
+void NullBackend::GenVertexArrays(GLsizei n, GLuint* arrays) {
+  calls[FUNCTION_GenVertexArrays]++;
+  genNames(n, arrays);
+}
+
+void NullBackend::GetIntegerv(GLenum pname, GLint* data) {
+  calls[FUNCTION_GetIntegerv]++;
+  // Enough for any limit checked at startup. Zero program binary formats disables the cache.
+  *data = pname == GL_NUM_PROGRAM_BINARY_FORMATS ? 0 : 16;
+}
+
+void NullBackend::GetProgramiv(GLuint, GLenum pname, GLint* params) {
+  calls[FUNCTION_GetProgramiv]++;
+  *params = (pname == GL_LINK_STATUS || pname == GL_COMPLETION_STATUS_KHR) ? GL_TRUE : 0;
+}
+
+void NullBackend::GetShaderiv(GLuint, GLenum pname, GLint* params) {
+  calls[FUNCTION_GetShaderiv]++;
+  *params = (pname == GL_COMPILE_STATUS || pname == GL_COMPLETION_STATUS_KHR) ? GL_TRUE : 0;
+}
+
+const GLubyte* NullBackend::GetString(GLenum) {
+  calls[FUNCTION_GetString]++;
+  return reinterpret_cast<const GLubyte*>("null");
+}
+
+GLint NullBackend::GetUniformLocation(GLuint, const GLchar*) {
+  calls[FUNCTION_GetUniformLocation]++;
+  return nextUniformLocation++;
+}
+
+unsigned long NullBackend::getTotalCalls() {
+  unsigned long total = 0;
+  for (int i = 0; i < NUM_FUNCTIONS; i++) {
+    total += calls[i];
+  }
+  return total;
+}
+
+void NullBackend::resetCounters() {
+  for (int i = 0; i < NUM_FUNCTIONS; i++) {
+    calls[i] = 0;
+  }
+}
+
+void NullBackend::genNames(GLsizei n, GLuint* names) {
+  for (GLsizei i = 0; i < n; i++) {
+    names[i] = nextName++;
+  }
+}
+
+} // namespace gl
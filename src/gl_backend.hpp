@@ -0,0 +1,174 @@
+#ifndef GL_BACKEND_H
+#define GL_BACKEND_H
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+/**
+ * Every GL entry point the engine calls goes through gl::Backend, so the
+ * frame can run against something other than a real driver. Call sites use
+ * gl::BindTexture(...) and friends in place of glBindTexture(...).
+ *
+ * F(returnType, name, parameters, arguments) for each function. The null
+ * backend ignores these and returns a default value.
+ */
+#define GL_BACKEND_FUNCTIONS(F) \
+  F(void, ActiveTexture, (GLenum texture), (texture)) \
+  F(void, AttachShader, (GLuint program, GLuint shader), (program, shader)) \
+  F(void, BindBuffer, (GLenum target, GLuint buffer), (target, buffer)) \
+  F(void, BindBufferBase, (GLenum target, GLuint index, GLuint buffer), (target, index, buffer)) \
+  F(void, BindFramebuffer, (GLenum target, GLuint framebuffer), (target, framebuffer)) \
+  F(void, BindRenderbuffer, (GLenum target, GLuint renderbuffer), (target, renderbuffer)) \
+  F(void, BindTexture, (GLenum target, GLuint texture), (target, texture)) \
+  F(void, BindVertexArray, (GLuint array), (array)) \
+  F(void, BlitFramebuffer, (GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter), (srcX0, srcY0, srcX1, srcY1, dstX0, dstY0, dstX1, dstY1, mask, filter)) \
+  F(void, BlendFunc, (GLenum sfactor, GLenum dfactor), (sfactor, dfactor)) \
+  F(void, BufferData, (GLenum target, GLsizeiptr size, const void* data, GLenum usage), (target, size, data, usage)) \
+  F(void, BufferSubData, (GLenum target, GLintptr offset, GLsizeiptr size, const void* data), (target, offset, size, data)) \
+  F(void, Clear, (GLbitfield mask), (mask)) \
+  F(void, ClearColor, (GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha), (red, green, blue, alpha)) \
+  F(void, CompileShader, (GLuint shader), (shader)) \
+  F(void, CullFace, (GLenum mode), (mode)) \
+  F(void, DeleteBuffers, (GLsizei n, const GLuint* buffers), (n, buffers)) \
+  F(void, DeleteFramebuffers, (GLsizei n, const GLuint* framebuffers), (n, framebuffers)) \
+  F(void, DeleteProgram, (GLuint program), (program)) \
+  F(void, DeleteRenderbuffers, (GLsizei n, const GLuint* renderbuffers), (n, renderbuffers)) \
+  F(void, DeleteShader, (GLuint shader), (shader)) \
+  F(void, DeleteTextures, (GLsizei n, const GLuint* textures), (n, textures)) \
+  F(void, DeleteVertexArrays, (GLsizei n, const GLuint* arrays), (n, arrays)) \
+  F(void, DepthMask, (GLboolean flag), (flag)) \
+  F(void, Disable, (GLenum cap), (cap)) \
+  F(void, DisableVertexAttribArray, (GLuint index), (index)) \
+  F(void, DrawArrays, (GLenum mode, GLint first, GLsizei count), (mode, first, count)) \
+  F(void, DrawBuffers, (GLsizei n, const GLenum* bufs), (n, bufs)) \
+  F(void, DrawElements, (GLenum mode, GLsizei count, GLenum type, const void* indices), (mode, count, type, indices)) \
+  F(void, Enable, (GLenum cap), (cap)) \
+  F(void, EnableVertexAttribArray, (GLuint index), (index)) \
+  F(void, FramebufferRenderbuffer, (GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer), (target, attachment, renderbuffertarget, renderbuffer)) \
+  F(void, FramebufferTexture, (GLenum target, GLenum attachment, GLuint texture, GLint level), (target, attachment, texture, level)) \
+  F(void, FramebufferTextureLayer, (GLenum target, GLenum attachment, GLuint texture, GLint level, GLint layer), (target, attachment, texture, level, layer)) \
+  F(void, FramebufferTexture2D, (GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level), (target, attachment, textarget, texture, level)) \
+  F(void, GenerateMipmap, (GLenum target), (target)) \
+  F(GLenum, GetError, (), ()) \
+  F(void, GetProgramBinary, (GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary), (program, bufSize, length, binaryFormat, binary)) \
+  F(void, GetProgramInfoLog, (GLuint program, GLsizei bufSize, GLsizei* length, GLchar* infoLog), (program, bufSize, length, infoLog)) \
+  F(void, GetShaderInfoLog, (GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* infoLog), (shader, bufSize, length, infoLog)) \
+  F(GLuint, GetUniformBlockIndex, (GLuint program, const GLchar* uniformBlockName), (program, uniformBlockName)) \
+  F(void, LinkProgram, (GLuint program), (program)) \
+  F(void, MaxShaderCompilerThreadsKHR, (GLuint count), (count)) \
+  F(void, ProgramBinary, (GLuint program, GLenum binaryFormat, const void* binary, GLsizei length), (program, binaryFormat, binary, length)) \
+  F(void, ProgramParameteri, (GLuint program, GLenum pname, GLint value), (program, pname, value)) \
+  F(void, ReadBuffer, (GLenum src), (src)) \
+  F(void, ReadPixels, (GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void* pixels), (x, y, width, height, format, type, pixels)) \
+  F(void, RenderbufferStorage, (GLenum target, GLenum internalformat, GLsizei width, GLsizei height), (target, internalformat, width, height)) \
+  F(void, Scissor, (GLint x, GLint y, GLsizei width, GLsizei height), (x, y, width, height)) \
+  F(void, ShaderSource, (GLuint shader, GLsizei count, const GLchar** string, const GLint* length), (shader, count, string, length)) \
+  F(void, StencilFunc, (GLenum func, GLint ref, GLuint mask), (func, ref, mask)) \
+  F(void, StencilOpSeparate, (GLenum face, GLenum sfail, GLenum dpfail, GLenum dppass), (face, sfail, dpfail, dppass)) \
+  F(void, TexImage2D, (GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void* data), (target, level, internalformat, width, height, border, format, type, data)) \
+  F(void, TexImage3D, (GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void* data), (target, level, internalformat, width, height, depth, border, format, type, data)) \
+  F(void, TexParameteri, (GLenum target, GLenum pname, GLint param), (target, pname, param)) \
+  F(void, TexSubImage2D, (GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void* pixels), (target, level, xoffset, yoffset, width, height, format, type, pixels)) \
+  F(void, Uniform1f, (GLint location, GLfloat v0), (location, v0)) \
+  F(void, Uniform1i, (GLint location, GLint v0), (location, v0)) \
+  F(void, Uniform2fv, (GLint location, GLsizei count, const GLfloat* value), (location, count, value)) \
+  F(void, Uniform3fv, (GLint location, GLsizei count, const GLfloat* value), (location, count, value)) \
+  F(void, Uniform4fv, (GLint location, GLsizei count, const GLfloat* value), (location, count, value)) \
+  F(void, UniformBlockBinding, (GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding), (program, uniformBlockIndex, uniformBlockBinding)) \
+  F(void, UniformMatrix4fv, (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value), (location, count, transpose, value)) \
+  F(void, UseProgram, (GLuint program), (program)) \
+  F(void, VertexAttribPointer, (GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer), (index, size, type, normalized, stride, pointer)) \
+  F(void, Viewport, (GLint x, GLint y, GLsizei width, GLsizei height), (x, y, width, height))
+
+// Functions whose results the engine depends on, so the null backend has to fake them.
+#define GL_BACKEND_QUERY_FUNCTIONS(F) \
+  F(GLenum, CheckFramebufferStatus, (GLenum target), (target)) \
+  F(GLuint, CreateProgram, (), ()) \
+  F(GLuint, CreateShader, (GLenum type), (type)) \
+  F(void, GenBuffers, (GLsizei n, GLuint* buffers), (n, buffers)) \
+  F(void, GenFramebuffers, (GLsizei n, GLuint* framebuffers), (n, framebuffers)) \
+  F(void, GenRenderbuffers, (GLsizei n, GLuint* renderbuffers), (n, renderbuffers)) \
+  F(void, GenTextures, (GLsizei n, GLuint* textures), (n, textures)) \
+  F(void, GenVertexArrays, (GLsizei n, GLuint* arrays), (n, arrays)) \
+  F(void, GetIntegerv, (GLenum pname, GLint* data), (pname, data)) \
+  F(void, GetProgramiv, (GLuint program, GLenum pname, GLint* params), (program, pname, params)) \
+  F(void, GetShaderiv, (GLuint shader, GLenum pname, GLint* params), (shader, pname, params)) \
+  F(const GLubyte*, GetString, (GLenum name), (name)) \
+  F(GLint, GetUniformLocation, (GLuint program, const GLchar* name), (program, name))
+
+namespace gl {
+
+enum Function {
+#define GL_BACKEND_ENUM(ret, name, params, args) FUNCTION_##name,
+  GL_BACKEND_FUNCTIONS(GL_BACKEND_ENUM)
+  GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_ENUM)
+#undef GL_BACKEND_ENUM
+  NUM_FUNCTIONS
+};
+
+const char* getFunctionName(Function function);
+
+class Backend {
+public:
+  virtual ~Backend() {}
+
+#define GL_BACKEND_DECLARE(ret, name, params, args) virtual ret name params = 0;
+  GL_BACKEND_FUNCTIONS(GL_BACKEND_DECLARE)
+  GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_DECLARE)
+#undef GL_BACKEND_DECLARE
+};
+
+// Calls straight through to the driver.
+class OpenGLBackend: public Backend {
+public:
+#define GL_BACKEND_DECLARE(ret, name, params, args) ret name params;
+  GL_BACKEND_FUNCTIONS(GL_BACKEND_DECLARE)
+  GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_DECLARE)
+#undef GL_BACKEND_DECLARE
+};
+
+/**
+ * Counts calls without executing them, for measuring the engine's own CPU
+ * cost. Objects get fresh nonzero names, and compiles, links and
+ * framebuffers always succeed. Needs no GL context.
+ */
+class NullBackend: public Backend {
+public:
+  NullBackend();
+
+#define GL_BACKEND_DECLARE(ret, name, params, args) ret name params;
+  GL_BACKEND_FUNCTIONS(GL_BACKEND_DECLARE)
+  GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_DECLARE)
+#undef GL_BACKEND_DECLARE
+
+  unsigned long getCalls(Function function) {
+    return calls[function];
+  }
+  unsigned long getTotalCalls();
+  unsigned long getDrawCalls() {
+    return calls[FUNCTION_DrawArrays] + calls[FUNCTION_DrawElements];
+  }
+  void resetCounters();
+
+private:
+  void genNames(GLsizei n, GLuint* names);
+
+  unsigned long calls[NUM_FUNCTIONS];
+  GLuint nextName;
+  GLint nextUniformLocation;
+};
+
+// The OpenGL backend unless replaced. Not owned.
+Backend* getBackend();
+void setBackend(Backend* backend);
+
+extern Backend* backend;
+
+#define GL_BACKEND_CALL(ret, name, params, args) inline ret name params { return backend->name args; }
+  GL_BACKEND_FUNCTIONS(GL_BACKEND_CALL)
+  GL_BACKEND_QUERY_FUNCTIONS(GL_BACKEND_CALL)
+#undef GL_BACKEND_CALL
+
+} // namespace gl
+
+#endif
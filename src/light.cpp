@@ -1,8 +1,12 @@
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #include "light.hpp"
 
 Light::Light(LightType type, const glm::vec3& colour, const glm::vec3& position, const glm::vec3& direction, float spread)
-  : type(type), colour(colour), ambientColour(0, 0, 0), position(position), direction(direction), falloff(1, 0, 0), spread(spread), enabled(true) {}
+  : type(type), colour(colour), ambientColour(0, 0, 0), position(position), direction(direction), falloff(1, 0, 0), spread(spread), enabled(true), castsShadows(true), shadowMapSize(DEFAULT_SHADOW_MAP_SIZE), shadowMode(CUBE_SHADOW), shadowFilter(COMPARE_SHADOW_FILTER) {}
 
 Light* Light::directionalLight(const glm::vec3& colour, const glm::vec3& direction) {
   return new Light(DIRECTIONAL, colour, glm::vec3(0, 0, 0), direction, 0);
@@ -16,3 +20,20 @@ Light* Light::pointLight(const glm::vec3& colour, const glm::vec3& position) {
   return new Light(POINT, colour, position, glm::vec3(0, 0, 0), 0);
 }
 
+
+float Light::getInfluenceRadius() {
+  if (type == DIRECTIONAL || (falloff.y <= 0 && falloff.z <= 0)) {
+    return std::numeric_limits<float>::infinity();
+  }
+
+  // Solve c / (k + l*d + q*d^2) = cutoff for d.
+  float brightest = std::max(colour.x, std::max(colour.y, colour.z));
+  float k = falloff.x - brightest / LIGHT_CUTOFF;
+  if (k >= 0) {
+    return 0;
+  }
+  if (falloff.z <= 0) {
+    return -k / falloff.y;
+  }
+  return (-falloff.y + std::sqrt(falloff.y * falloff.y - 4 * falloff.z * k)) / (2 * falloff.z);
+}
@@ -3,6 +3,11 @@
 
 #include <glm/glm.hpp>
 
+// Intensity below which a light's contribution is treated as zero.
+#define LIGHT_CUTOFF (1.0f / 256.0f)
+// Shadow map texels per side, per cube face for point lights.
+#define DEFAULT_SHADOW_MAP_SIZE 1024
+
 class Light {
 public:
   enum LightType {
@@ -11,6 +16,25 @@ public:
     POINT = 2
   };
 
+  /**
+   * How a point light's shadow map is stored. Dual-paraboloid maps take two
+   * renders and a third of the texels of a cube map, at lower quality.
+   */
+  enum ShadowMode {
+    CUBE_SHADOW = 0,
+    DUAL_PARABOLOID_SHADOW = 1
+  };
+
+  /**
+   * How a spot light's shadow map is filtered. Variance shadow maps store
+   * depth moments, which can be blurred and mipmapped, so soft shadows take
+   * one filtered fetch. They can leak light where occluders overlap.
+   */
+  enum ShadowFilter {
+    COMPARE_SHADOW_FILTER = 0,
+    VARIANCE_SHADOW_FILTER = 1
+  };
+
   static Light* directionalLight(const glm::vec3& colour, const glm::vec3& direction);
   static Light* spotLight(const glm::vec3& colour, const glm::vec3& position, const glm::vec3& direction, float spread);
   static Light* pointLight(const glm::vec3& colour, const glm::vec3& position);
@@ -43,6 +67,36 @@ public:
   void setEnabled(bool e) {
     enabled = e;
   }
+  bool getCastsShadows() {
+    return castsShadows;
+  }
+  void setCastsShadows(bool c) {
+    castsShadows = c;
+  }
+  int getShadowMapSize() {
+    return shadowMapSize;
+  }
+  void setShadowMapSize(int size) {
+    shadowMapSize = size;
+  }
+  ShadowMode getShadowMode() {
+    return shadowMode;
+  }
+  void setShadowMode(ShadowMode mode) {
+    shadowMode = mode;
+  }
+  ShadowFilter getShadowFilter() {
+    return shadowFilter;
+  }
+  void setShadowFilter(ShadowFilter filter) {
+    shadowFilter = filter;
+  }
+
+  /**
+   * Distance at which the attenuated colour drops below LIGHT_CUTOFF.
+   * Infinite for directional lights and lights without distance falloff.
+   */
+  float getInfluenceRadius();
 
 private:
   Light(LightType type, const glm::vec3& colour, const glm::vec3& position, const glm::vec3& direction, float spread);
@@ -55,6 +109,10 @@ private:
   glm::vec3 falloff;
   float spread;
   bool enabled;
+  bool castsShadows;
+  int shadowMapSize;
+  ShadowMode shadowMode;
+  ShadowFilter shadowFilter;
 };
 
 #endif
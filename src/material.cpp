@@ -0,0 +1,13 @@
+
+#include "material.hpp"
+
+std::vector<Material*> Material::allMaterials;
+
+Material::Material(const glm::vec3& ka, const glm::vec3& kd, const glm::vec3& ks, const glm::vec3& ke, float shininess)
+  : id(allMaterials.size()), ka(ka), kd(kd), ks(ks), ke(ke), shininess(shininess), diffuseTexture(nullptr), normalTexture(nullptr) {
+  allMaterials.push_back(this);
+}
+
+Material::~Material() {
+  allMaterials[id] = NULL;
+}
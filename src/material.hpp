@@ -1,16 +1,29 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <vector>
 #include <glm/glm.hpp>
 
 #include "texture.hpp"
 
 class Material {
 public:
-  Material(const glm::vec3& ka, const glm::vec3& kd, const glm::vec3& ks, const glm::vec3& ke, float shininess)
-    : ka(ka), kd(kd), ks(ks), ke(ke), shininess(shininess), diffuseTexture(nullptr), normalTexture(nullptr) {}
+  Material(const glm::vec3& ka, const glm::vec3& kd, const glm::vec3& ks, const glm::vec3& ke, float shininess);
 
-  ~Material() {}
+  virtual ~Material();
+
+  /**
+   * Index of this material in the material table shaders read from. Ids are
+   * assigned in creation order and not reused.
+   */
+  unsigned int getId() {
+    return id;
+  }
+
+  // Indexed by id. Destroyed materials leave a NULL entry.
+  static const std::vector<Material*>& getAllMaterials() {
+    return allMaterials;
+  }
 
   void setDiffuseTexture(Texture* texture) {
     diffuseTexture = texture;
@@ -41,7 +54,7 @@ public:
   }
 
   bool hasDiffuseTexture() {
-    return diffuseTexture != nullptr;
+    return diffuseTexture != nullptr && diffuseTexture->isValid();
   }
 
   Texture* getDiffuseTexture() {
@@ -49,7 +62,7 @@ public:
   }
 
   bool hasNormalTexture() {
-    return normalTexture != nullptr;
+    return normalTexture != nullptr && normalTexture->isValid();
   }
 
   Texture* getNormalTexture() {
@@ -61,6 +74,9 @@ public:
   virtual bool isMirror() { return false; }
 
 protected:
+  static std::vector<Material*> allMaterials;
+
+  unsigned int id;
   glm::vec3 ka, kd, ks, ke;
   float shininess;
   Texture* diffuseTexture;
@@ -3,19 +3,32 @@
 #include <glm/glm.hpp>
 #include <iostream>
 #include <list>
+#include <map>
+#include <cmath>
+#include <algorithm>
 
+#include "gl_backend.hpp"
 #include "mirror.hpp"
 #include "texture.hpp"
 #include "shader.hpp"
 
 uint32_t Mesh::meshIdCounter = 1;
 
+// Orders positions by x, then y, then z, so identical ones can be merged.
+struct PositionLess {
+  bool operator()(const glm::vec3& a, const glm::vec3& b) const {
+    if (a.x != b.x) return a.x < b.x;
+    if (a.y != b.y) return a.y < b.y;
+    return a.z < b.z;
+  }
+};
+
 Mesh::Mesh(
     std::vector<glm::vec3>& vertices,
     std::vector<glm::vec2>& uvs,
     std::vector<glm::vec3>& normals,
     std::vector<unsigned short>& indices,
-    Material* material): name(""), material(material) {
+    Material* material): name(""), material(material), dynamic(false) {
 
   meshId = meshIdCounter++;
 
@@ -26,16 +39,16 @@ Mesh::Mesh(
   }
 
   // Load scene data into VBOs.
-  glGenBuffers(NUM_BUFS, buffers);
+  gl::GenBuffers(NUM_BUFS, buffers);
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[VERTEX_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[NORMAL_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), &normals[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[NORMAL_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), &normals[0], GL_STATIC_DRAW);
 
   // Construct tangents.
   std::vector<glm::vec3> tangents(vertices.size(), glm::vec3(0, 0, 0));
@@ -103,32 +116,91 @@ Mesh::Mesh(
 
   }
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[TANGENT_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(glm::vec3), &tangents[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[TANGENT_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(glm::vec3), &tangents[0], GL_STATIC_DRAW);
 
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[BITANGENT_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, bitangents.size() * sizeof(glm::vec3), &bitangents[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[BITANGENT_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, bitangents.size() * sizeof(glm::vec3), &bitangents[0], GL_STATIC_DRAW);
 
 
   numIndices = indices.size();
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[ELEMENT_BUF]);
+  gl::BufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+
+  // Vertices split only by their UVs or normals are one vertex to a depth pass.
+  std::map<glm::vec3, unsigned short, PositionLess> positionIndex;
+  std::vector<glm::vec3> positions;
+  std::vector<unsigned short> remap(vertices.size());
+  for (unsigned int i = 0; i < vertices.size(); i++) {
+    std::map<glm::vec3, unsigned short, PositionLess>::iterator found = positionIndex.find(vertices[i]);
+    if (found == positionIndex.end()) {
+      found = positionIndex.insert(std::make_pair(vertices[i], (unsigned short) positions.size())).first;
+      positions.push_back(vertices[i]);
+    }
+    remap[i] = found->second;
+  }
+  std::vector<unsigned short> positionIndices(indices.size());
+  for (unsigned int i = 0; i < indices.size(); i++) {
+    positionIndices[i] = remap[indices[i]];
+  }
+
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[POSITION_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[POSITION_ELEMENT_BUF]);
+  gl::BufferData(GL_ELEMENT_ARRAY_BUFFER, positionIndices.size() * sizeof(unsigned short), &positionIndices[0], GL_STATIC_DRAW);
 
   // For mirrors.
   for (unsigned int i = 0; i < 4 && i < vertices.size(); i++) {
     firstFourVertices[i] = vertices[i];
   }
   firstNormal = normals[0];
+
+  // Bounding sphere around the centre of the bounding box.
+  glm::vec3 boundsMin = vertices[0];
+  glm::vec3 boundsMax = vertices[0];
+  for (unsigned int i = 1; i < vertices.size(); i++) {
+    boundsMin = glm::min(boundsMin, vertices[i]);
+    boundsMax = glm::max(boundsMax, vertices[i]);
+  }
+  boundingSphereCenter = (boundsMin + boundsMax) * 0.5f;
+  boundingSphereRadius = 0;
+  for (unsigned int i = 0; i < vertices.size(); i++) {
+    boundingSphereRadius = std::max(boundingSphereRadius, glm::length(vertices[i] - boundingSphereCenter));
+  }
+
+  // Texel density, for picking mip levels.
+  uvWorldScale = 0;
+  if (uvs.size() >= vertices.size()) {
+    float worldArea = 0;
+    float uvArea = 0;
+    for (unsigned int face = 0; face*3 + 2 < indices.size(); face++) {
+      const unsigned short* p = &indices[face*3];
+      worldArea += 0.5f * glm::length(glm::cross(vertices[p[1]] - vertices[p[0]], vertices[p[2]] - vertices[p[0]]));
+      glm::vec2 deltaUV1 = uvs[p[1]] - uvs[p[0]];
+      glm::vec2 deltaUV2 = uvs[p[2]] - uvs[p[0]];
+      uvArea += 0.5f * std::abs(deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
+    }
+    if (uvArea > 0) {
+      uvWorldScale = std::sqrt(worldArea / uvArea);
+    }
+  }
+}
+
+void Mesh::getWorldBoundingSphere(glm::vec3& center, float& radius) {
+  center = glm::vec3(modelMatrix * glm::vec4(boundingSphereCenter, 1));
+  float maxScale = std::max(glm::length(glm::vec3(modelMatrix[0])),
+    std::max(glm::length(glm::vec3(modelMatrix[1])), glm::length(glm::vec3(modelMatrix[2]))));
+  radius = boundingSphereRadius * maxScale;
 }
 
 Mesh::~Mesh() {
-  glDeleteBuffers(NUM_BUFS, buffers);
+  gl::DeleteBuffers(NUM_BUFS, buffers);
 }
 
 void Mesh::setUVs(std::vector<glm::vec2>& uvs) {
   // TODO: Update Tangents and Bitangents!
-  glBindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
-  glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
+  gl::BindBuffer(GL_ARRAY_BUFFER, buffers[UV_BUF]);
+  gl::BufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
 }
 
 bool loadTexture(aiTextureType aiType, const aiMaterial* m, Material *material) {
@@ -24,7 +24,10 @@ public:
     TANGENT_BUF = 3,
     BITANGENT_BUF = 3,
     ELEMENT_BUF = 4,
-    NUM_BUFS = 5
+    // Positions with duplicates merged, and the triangles indexing them, for depth only passes.
+    POSITION_BUF = 5,
+    POSITION_ELEMENT_BUF = 6,
+    NUM_BUFS = 7
   };
 
   Mesh(
@@ -59,6 +62,7 @@ public:
     return material;
   }
 
+  // Of both ELEMENT_BUF and POSITION_ELEMENT_BUF.
   int getNumIndices() {
     return numIndices;
   }
@@ -75,8 +79,37 @@ public:
     return firstNormal;
   }
 
+  // Bounding sphere in model space.
+  glm::vec3& getBoundingSphereCenter() {
+    return boundingSphereCenter;
+  }
+
+  float getBoundingSphereRadius() {
+    return boundingSphereRadius;
+  }
+
+  // Bounding sphere transformed by the model matrix.
+  void getWorldBoundingSphere(glm::vec3& center, float& radius);
+
+  /**
+   * Average model space distance covered by one unit of UV, from the ratio of
+   * triangle areas. 0 if the mesh has no UVs.
+   */
+  float getUVWorldScale() {
+    return uvWorldScale;
+  }
+
   void setUVs(std::vector<glm::vec2>& uvs);
 
+  // Dynamic meshes may move or disappear, so cached static shadows don't include them.
+  bool isDynamic() {
+    return dynamic;
+  }
+
+  void setDynamic(bool dynamic) {
+    this->dynamic = dynamic;
+  }
+
 private:
   static uint32_t meshIdCounter;
 
@@ -89,6 +122,11 @@ private:
 
   glm::vec3 firstFourVertices[4];
   glm::vec3 firstNormal;
+
+  glm::vec3 boundingSphereCenter;
+  float boundingSphereRadius;
+  float uvWorldScale;
+  bool dynamic;
 };
 
 std::vector<Mesh*> loadScene(std::string fileName, bool invertNormals = false);
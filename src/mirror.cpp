@@ -1,6 +1,8 @@
 
 #include <iostream>
+#include "gl_backend.hpp"
 #include "mirror.hpp"
+#include "render_state.hpp"
 
 #include "viewer.hpp" // For DEFAULT_*
 
@@ -8,32 +10,32 @@ Mirror::Mirror(const glm::vec3& ka, const glm::vec3& kd, const glm::vec3& ks, co
   : Material(ka, kd, ks, ke, shininess), reflective(true) {
 
   mirrorFBO = 0;
-  glGenFramebuffers(1, &mirrorFBO);
-  glBindFramebuffer(GL_FRAMEBUFFER, mirrorFBO);
+  gl::GenFramebuffers(1, &mirrorFBO);
+  gl::BindFramebuffer(GL_FRAMEBUFFER, mirrorFBO);
 
   GLuint diffuseTextureId = 0;
-  glGenTextures(1, &diffuseTextureId);
-  glBindTexture(GL_TEXTURE_2D, diffuseTextureId);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, DEFAULT_WIDTH, DEFAULT_HEIGHT, 0, GL_RGB, GL_FLOAT, 0);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::GenTextures(1, &diffuseTextureId);
+  gl::BindTexture(GL_TEXTURE_2D, diffuseTextureId);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, DEFAULT_WIDTH, DEFAULT_HEIGHT, 0, GL_RGB, GL_FLOAT, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   // Don't bind this texture to fbo.
   diffuseTexture = new Texture(diffuseTextureId, DEFAULT_WIDTH, DEFAULT_HEIGHT);
 
   GLuint mirrorTextureId = 0;
-  glGenTextures(1, &mirrorTextureId);
-  glBindTexture(GL_TEXTURE_2D, mirrorTextureId);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, DEFAULT_WIDTH, DEFAULT_HEIGHT, 0, GL_RGB, GL_FLOAT, 0);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::GenTextures(1, &mirrorTextureId);
+  gl::BindTexture(GL_TEXTURE_2D, mirrorTextureId);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, DEFAULT_WIDTH, DEFAULT_HEIGHT, 0, GL_RGB, GL_FLOAT, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   mirrorTexture = new Texture(mirrorTextureId, DEFAULT_WIDTH, DEFAULT_HEIGHT);
 
-  glGenRenderbuffers(1, &mirrorRBO);
-  glBindRenderbuffer(GL_RENDERBUFFER, mirrorRBO);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, DEFAULT_WIDTH, DEFAULT_HEIGHT);
+  gl::GenRenderbuffers(1, &mirrorRBO);
+  gl::BindRenderbuffer(GL_RENDERBUFFER, mirrorRBO);
+  gl::RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, DEFAULT_WIDTH, DEFAULT_HEIGHT);
 
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, mirrorRBO);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mirrorTexture->getTextureId(), 0);
+  gl::FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, mirrorRBO);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mirrorTexture->getTextureId(), 0);
 
   checkGLFramebuffer();
   checkGLErrors("mirror");
@@ -45,14 +47,14 @@ Mirror::~Mirror() {
 }
 
 void Mirror::updateSize(int width, int height) {
-  glBindTexture(GL_TEXTURE_2D, diffuseTexture->getTextureId());
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, diffuseTexture->getTextureId());
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
 
-  glBindTexture(GL_TEXTURE_2D, mirrorTexture->getTextureId());
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, mirrorTexture->getTextureId());
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
 
-  glBindRenderbuffer(GL_RENDERBUFFER, mirrorRBO);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+  gl::BindRenderbuffer(GL_RENDERBUFFER, mirrorRBO);
+  gl::RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
 }
 
 void Mirror::update() {
@@ -61,7 +63,7 @@ void Mirror::update() {
   mirrorTexture = diffuseTexture;
   diffuseTexture = temp;
 
-  glBindFramebuffer(GL_FRAMEBUFFER, mirrorFBO);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mirrorTexture->getTextureId(), 0);
+  RenderStateTracker::bindFramebuffer(mirrorFBO);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mirrorTexture->getTextureId(), 0);
 }
 
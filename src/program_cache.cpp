@@ -0,0 +1,133 @@
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <iterator>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "gl_backend.hpp"
+#include "program_cache.hpp"
+
+// Written at the start of every cache file, followed by the binary format and data.
+#define PROGRAM_CACHE_MAGIC 0x43505247
+
+namespace shaders {
+
+std::string ProgramCache::directory = DEFAULT_PROGRAM_CACHE_DIRECTORY;
+
+static void hashBytes(unsigned long long& hash, const char* data, size_t size) {
+  // FNV-1a.
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+}
+
+static void hashString(unsigned long long& hash, const char* str) {
+  if (str == NULL) {
+    str = "";
+  }
+  // Include the terminator so concatenations can't collide.
+  hashBytes(hash, str, strlen(str) + 1);
+}
+
+bool ProgramCache::isSupported() {
+  if (!GLEW_ARB_get_program_binary) {
+    return false;
+  }
+  GLint numFormats = 0;
+  gl::GetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+  return numFormats > 0;
+}
+
+void ProgramCache::setDirectory(const std::string& directory) {
+  ProgramCache::directory = directory;
+}
+
+std::string ProgramCache::makeKey(const std::string& vertSource, const std::string& fragSource) {
+  unsigned long long hash = 14695981039346656037ULL;
+  hashString(hash, (const char*) gl::GetString(GL_VENDOR));
+  hashString(hash, (const char*) gl::GetString(GL_RENDERER));
+  hashString(hash, (const char*) gl::GetString(GL_VERSION));
+  hashString(hash, vertSource.c_str());
+  hashString(hash, fragSource.c_str());
+
+  std::stringstream key;
+  key << std::hex << std::setfill('0') << std::setw(16) << hash;
+  return key.str();
+}
+
+std::string ProgramCache::getPath(const std::string& key) {
+  return directory + "/" + key + ".bin";
+}
+
+GLuint ProgramCache::load(const std::string& key) {
+  if (!isSupported()) {
+    return 0;
+  }
+
+  std::ifstream file(getPath(key).c_str(), std::ios::in | std::ios::binary);
+  if (!file.is_open()) {
+    return 0;
+  }
+  unsigned int magic = 0;
+  GLenum format = 0;
+  file.read((char*) &magic, sizeof(magic));
+  file.read((char*) &format, sizeof(format));
+  bool headerRead = file.good();
+  // Reading through the buffer leaves the stream's state alone, so only the header can be checked.
+  std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (!headerRead || magic != PROGRAM_CACHE_MAGIC || binary.empty()) {
+    std::cerr << "Ignoring corrupt program cache entry " << getPath(key) << std::endl;
+    return 0;
+  }
+
+  GLuint programId = gl::CreateProgram();
+  gl::ProgramBinary(programId, format, &binary[0], binary.size());
+  GLint result = GL_FALSE;
+  gl::GetProgramiv(programId, GL_LINK_STATUS, &result);
+  if (result != GL_TRUE) {
+    // Typically a driver change the key didn't catch, recompile.
+    gl::DeleteProgram(programId);
+    return 0;
+  }
+  return programId;
+}
+
+void ProgramCache::store(const std::string& key, GLuint programId) {
+  if (!isSupported()) {
+    return;
+  }
+
+  GLint length = 0;
+  gl::GetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) {
+    return;
+  }
+  std::vector<char> binary(length);
+  GLenum format = 0;
+  gl::GetProgramBinary(programId, length, &length, &format, &binary[0]);
+
+  mkdir(directory.c_str(), 0755);
+  std::ofstream file(getPath(key).c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "Could not write program cache entry " << getPath(key) << std::endl;
+    return;
+  }
+  unsigned int magic = PROGRAM_CACHE_MAGIC;
+  file.write((const char*) &magic, sizeof(magic));
+  file.write((const char*) &format, sizeof(format));
+  file.write(&binary[0], length);
+}
+
+void ProgramCache::prepareLink(GLuint programId) {
+  if (isSupported()) {
+    gl::ProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+}
+
+} // namespace shaders
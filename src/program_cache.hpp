@@ -0,0 +1,41 @@
+#ifndef PROGRAM_CACHE_HPP
+#define PROGRAM_CACHE_HPP
+
+#include <string>
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+// Directory linked program binaries are kept in, relative to the working directory.
+#define DEFAULT_PROGRAM_CACHE_DIRECTORY "shadercache"
+
+namespace shaders {
+
+/**
+ * On-disk cache of linked program binaries. Entries are keyed by a hash of
+ * the full shader sources (so permutation defines are included) and the GL
+ * vendor, renderer and version, so a driver update invalidates them. Does
+ * nothing when the driver doesn't support program binaries.
+ */
+class ProgramCache {
+public:
+  static bool isSupported();
+  static void setDirectory(const std::string& directory);
+
+  static std::string makeKey(const std::string& vertSource, const std::string& fragSource);
+
+  // Returns a linked program, or 0 on a miss or if the driver rejects the binary.
+  static GLuint load(const std::string& key);
+  static void store(const std::string& key, GLuint programId);
+
+  // Call between attaching shaders and linking.
+  static void prepareLink(GLuint programId);
+
+private:
+  static std::string getPath(const std::string& key);
+
+  static std::string directory;
+};
+
+} // namespace shaders
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Stores a program binary in the program cache and loads it back, against
+ * a null backend that pretends to support program binaries.
+ *
+ * Usage: program_cache_test
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include "gl_backend.hpp"
+#include "program_cache.hpp"
+
+#define TEST_CACHE_DIRECTORY "program_cache_test.tmp"
+#define TEST_BINARY_FORMAT 0x1234
+
+static const char testBinary[] = "linked program";
+
+class ProgramBinaryBackend: public gl::NullBackend {
+public:
+  ProgramBinaryBackend(): loadedFormat(0) {}
+
+  void GetIntegerv(GLenum pname, GLint* data) {
+    if (pname == GL_NUM_PROGRAM_BINARY_FORMATS) {
+      *data = 1;
+      return;
+    }
+    gl::NullBackend::GetIntegerv(pname, data);
+  }
+
+  void GetProgramiv(GLuint program, GLenum pname, GLint* params) {
+    if (pname == GL_PROGRAM_BINARY_LENGTH) {
+      *params = sizeof(testBinary);
+      return;
+    }
+    gl::NullBackend::GetProgramiv(program, pname, params);
+  }
+
+  void GetProgramBinary(GLuint, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary) {
+    *length = std::min((GLsizei) sizeof(testBinary), bufSize);
+    *binaryFormat = TEST_BINARY_FORMAT;
+    memcpy(binary, testBinary, *length);
+  }
+
+  void ProgramBinary(GLuint, GLenum binaryFormat, const void* binary, GLsizei length) {
+    loadedFormat = binaryFormat;
+    loadedBinary.assign((const char*) binary, length);
+  }
+
+  GLenum loadedFormat;
+  std::string loadedBinary;
+};
+
+int main() {
+  ProgramBinaryBackend backend;
+  gl::setBackend(&backend);
+  // GLEW only fills in its extension flags from a real context.
+  __GLEW_ARB_get_program_binary = GL_TRUE;
+
+  shaders::ProgramCache::setDirectory(TEST_CACHE_DIRECTORY);
+  std::string key = shaders::ProgramCache::makeKey("vertex source", "fragment source");
+  shaders::ProgramCache::store(key, 1);
+  GLuint programId = shaders::ProgramCache::load(key);
+
+  remove((std::string(TEST_CACHE_DIRECTORY) + "/" + key + ".bin").c_str());
+  rmdir(TEST_CACHE_DIRECTORY);
+
+  if (programId == 0) {
+    std::cerr << "FAIL: stored program missed the cache" << std::endl;
+    return 1;
+  }
+  if (backend.loadedFormat != TEST_BINARY_FORMAT || backend.loadedBinary != std::string(testBinary, sizeof(testBinary))) {
+    std::cerr << "FAIL: loaded binary differs from the stored one" << std::endl;
+    return 1;
+  }
+  std::cout << "PASS" << std::endl;
+  return 0;
+}
@@ -0,0 +1,304 @@
+
+#include <cstring>
+#include <algorithm>
+
+#include "gl_backend.hpp"
+#include "render_state.hpp"
+
+RenderState::RenderState(GLuint framebuffer, int width, int height)
+  : framebuffer(framebuffer), numDrawBuffers(1), scissorTest(false), depthTest(false), depthWrite(true), stencilTest(false), stencilFunc(GL_ALWAYS), stencilRef(0), blend(false), blendSrc(GL_ONE), blendDst(GL_ZERO), cullFace(false), cullMode(GL_BACK), clipDistances(0) {
+  drawBuffers[0] = framebuffer == 0 ? GL_FRONT_LEFT : GL_COLOR_ATTACHMENT0;
+  viewport[0] = 0;
+  viewport[1] = 0;
+  viewport[2] = width;
+  viewport[3] = height;
+  memcpy(scissor, viewport, sizeof(scissor));
+  for (int face = 0; face < 2; face++) {
+    for (int op = 0; op < 3; op++) {
+      stencilOps[face][op] = GL_KEEP;
+    }
+  }
+}
+
+RenderState RenderState::withDrawBuffer(GLenum buffer) const {
+  RenderState state(*this);
+  state.drawBuffers[0] = buffer;
+  state.numDrawBuffers = 1;
+  return state;
+}
+
+RenderState RenderState::withDrawBuffers(const std::vector<GLenum>& buffers) const {
+  RenderState state(*this);
+  state.numDrawBuffers = 0;
+  for (unsigned int i = 0; i < buffers.size() && i < MAX_DRAW_BUFFERS; i++) {
+    state.drawBuffers[state.numDrawBuffers++] = buffers[i];
+  }
+  if (state.numDrawBuffers == 0) {
+    state.drawBuffers[state.numDrawBuffers++] = GL_NONE;
+  }
+  return state;
+}
+
+RenderState RenderState::withViewport(int x, int y, int width, int height) const {
+  RenderState state(*this);
+  state.viewport[0] = x;
+  state.viewport[1] = y;
+  state.viewport[2] = width;
+  state.viewport[3] = height;
+  return state;
+}
+
+RenderState RenderState::withScissor(int x, int y, int width, int height) const {
+  RenderState state(*this);
+  state.scissorTest = true;
+  state.scissor[0] = x;
+  state.scissor[1] = y;
+  state.scissor[2] = width;
+  state.scissor[3] = height;
+  return state;
+}
+
+RenderState RenderState::withDepthTest(bool enabled) const {
+  RenderState state(*this);
+  state.depthTest = enabled;
+  return state;
+}
+
+RenderState RenderState::withDepthWrite(bool enabled) const {
+  RenderState state(*this);
+  state.depthWrite = enabled;
+  return state;
+}
+
+RenderState RenderState::withStencilTest(GLenum func, GLint ref) const {
+  RenderState state(*this);
+  state.stencilTest = true;
+  state.stencilFunc = func;
+  state.stencilRef = ref;
+  return state;
+}
+
+RenderState RenderState::withStencilOp(GLenum face, GLenum stencilFail, GLenum depthFail, GLenum depthPass) const {
+  RenderState state(*this);
+  GLenum ops[3] = {stencilFail, depthFail, depthPass};
+  if (face != GL_BACK) {
+    memcpy(state.stencilOps[0], ops, sizeof(ops));
+  }
+  if (face != GL_FRONT) {
+    memcpy(state.stencilOps[1], ops, sizeof(ops));
+  }
+  return state;
+}
+
+RenderState RenderState::withBlend(GLenum src, GLenum dst) const {
+  RenderState state(*this);
+  state.blend = true;
+  state.blendSrc = src;
+  state.blendDst = dst;
+  return state;
+}
+
+RenderState RenderState::withCullFace(GLenum mode) const {
+  RenderState state(*this);
+  state.cullFace = true;
+  state.cullMode = mode;
+  return state;
+}
+
+RenderState RenderState::withClipDistances(unsigned int count) const {
+  RenderState state(*this);
+  state.clipDistances = std::min(count, (unsigned int) MAX_CLIP_DISTANCES);
+  return state;
+}
+
+
+bool RenderStateTracker::framebufferValid = false;
+bool RenderStateTracker::stateValid = false;
+GLuint RenderStateTracker::framebuffer = 0;
+std::map<GLuint, RenderStateTracker::DrawBuffers> RenderStateTracker::drawBuffers;
+GLint RenderStateTracker::viewport[4];
+bool RenderStateTracker::scissorTest = false;
+bool RenderStateTracker::scissorValid = false;
+GLint RenderStateTracker::scissor[4];
+bool RenderStateTracker::depthTest = false;
+bool RenderStateTracker::depthWrite = true;
+bool RenderStateTracker::stencilTest = false;
+bool RenderStateTracker::stencilFuncValid = false;
+GLenum RenderStateTracker::stencilFunc = GL_ALWAYS;
+GLint RenderStateTracker::stencilRef = 0;
+bool RenderStateTracker::stencilOpsValid = false;
+GLenum RenderStateTracker::stencilOps[2][3];
+bool RenderStateTracker::blend = false;
+bool RenderStateTracker::blendFuncValid = false;
+GLenum RenderStateTracker::blendSrc = GL_ONE;
+GLenum RenderStateTracker::blendDst = GL_ZERO;
+bool RenderStateTracker::cullFace = false;
+bool RenderStateTracker::cullModeValid = false;
+GLenum RenderStateTracker::cullMode = GL_BACK;
+unsigned int RenderStateTracker::clipDistances = 0;
+unsigned long RenderStateTracker::issuedChanges = 0;
+unsigned long RenderStateTracker::skippedChanges = 0;
+
+void RenderStateTracker::apply(const RenderState& state) {
+  bindFramebuffer(state.framebuffer);
+
+  std::map<GLuint, DrawBuffers>::iterator it = drawBuffers.find(state.framebuffer);
+  if (it != drawBuffers.end() && it->second.count == state.numDrawBuffers &&
+      memcmp(it->second.buffers, state.drawBuffers, state.numDrawBuffers * sizeof(GLenum)) == 0) {
+    skippedChanges++;
+  } else {
+    gl::DrawBuffers(state.numDrawBuffers, state.drawBuffers);
+    DrawBuffers& current = drawBuffers[state.framebuffer];
+    memcpy(current.buffers, state.drawBuffers, sizeof(current.buffers));
+    current.count = state.numDrawBuffers;
+    issuedChanges++;
+  }
+
+  if (stateValid && memcmp(viewport, state.viewport, sizeof(viewport)) == 0) {
+    skippedChanges++;
+  } else {
+    gl::Viewport(state.viewport[0], state.viewport[1], state.viewport[2], state.viewport[3]);
+    memcpy(viewport, state.viewport, sizeof(viewport));
+    issuedChanges++;
+  }
+
+  // Capabilities are only trusted once the tracker has set them itself.
+  if (!stateValid) {
+    scissorTest = !state.scissorTest;
+    depthTest = !state.depthTest;
+    depthWrite = !state.depthWrite;
+    stencilTest = !state.stencilTest;
+    blend = !state.blend;
+    cullFace = !state.cullFace;
+  }
+  setCapability(GL_SCISSOR_TEST, state.scissorTest, scissorTest);
+  if (state.scissorTest) {
+    if (scissorValid && memcmp(scissor, state.scissor, sizeof(scissor)) == 0) {
+      skippedChanges++;
+    } else {
+      gl::Scissor(state.scissor[0], state.scissor[1], state.scissor[2], state.scissor[3]);
+      memcpy(scissor, state.scissor, sizeof(scissor));
+      scissorValid = true;
+      issuedChanges++;
+    }
+  }
+
+  setCapability(GL_DEPTH_TEST, state.depthTest, depthTest);
+
+  if (depthWrite == state.depthWrite) {
+    skippedChanges++;
+  } else {
+    gl::DepthMask(state.depthWrite ? GL_TRUE : GL_FALSE);
+    depthWrite = state.depthWrite;
+    issuedChanges++;
+  }
+
+  setCapability(GL_STENCIL_TEST, state.stencilTest, stencilTest);
+  if (state.stencilTest) {
+    if (stencilFuncValid && stencilFunc == state.stencilFunc && stencilRef == state.stencilRef) {
+      skippedChanges++;
+    } else {
+      gl::StencilFunc(state.stencilFunc, state.stencilRef, 0xFF);
+      stencilFunc = state.stencilFunc;
+      stencilRef = state.stencilRef;
+      stencilFuncValid = true;
+      issuedChanges++;
+    }
+    if (!stencilOpsValid) {
+      // Force both faces to be set.
+      stencilOps[0][0] = stencilOps[1][0] = GL_NONE;
+      stencilOpsValid = true;
+    }
+    setStencilOp(GL_FRONT, state.stencilOps[0], stencilOps[0]);
+    setStencilOp(GL_BACK, state.stencilOps[1], stencilOps[1]);
+  }
+
+  setCapability(GL_BLEND, state.blend, blend);
+  if (state.blend) {
+    if (blendFuncValid && blendSrc == state.blendSrc && blendDst == state.blendDst) {
+      skippedChanges++;
+    } else {
+      gl::BlendFunc(state.blendSrc, state.blendDst);
+      blendSrc = state.blendSrc;
+      blendDst = state.blendDst;
+      blendFuncValid = true;
+      issuedChanges++;
+    }
+  }
+
+  setCapability(GL_CULL_FACE, state.cullFace, cullFace);
+  if (state.cullFace) {
+    if (cullModeValid && cullMode == state.cullMode) {
+      skippedChanges++;
+    } else {
+      gl::CullFace(state.cullMode);
+      cullMode = state.cullMode;
+      cullModeValid = true;
+      issuedChanges++;
+    }
+  }
+
+  if (stateValid && clipDistances == state.clipDistances) {
+    skippedChanges++;
+  } else {
+    for (unsigned int i = 0; i < MAX_CLIP_DISTANCES; i++) {
+      bool enabled = i < state.clipDistances;
+      // Only the distances between the old and new count change, unless GL's state is unknown.
+      if (stateValid && enabled == (i < clipDistances)) continue;
+      if (enabled) {
+        gl::Enable(GL_CLIP_DISTANCE0 + i);
+      } else {
+        gl::Disable(GL_CLIP_DISTANCE0 + i);
+      }
+    }
+    clipDistances = state.clipDistances;
+    issuedChanges++;
+  }
+  stateValid = true;
+}
+
+void RenderStateTracker::bindFramebuffer(GLuint framebuffer) {
+  if (framebufferValid && RenderStateTracker::framebuffer == framebuffer) {
+    skippedChanges++;
+    return;
+  }
+  gl::BindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  RenderStateTracker::framebuffer = framebuffer;
+  framebufferValid = true;
+  issuedChanges++;
+}
+
+void RenderStateTracker::invalidate() {
+  framebufferValid = false;
+  stateValid = false;
+  drawBuffers.clear();
+  scissorValid = false;
+  stencilFuncValid = false;
+  stencilOpsValid = false;
+  blendFuncValid = false;
+  cullModeValid = false;
+}
+
+void RenderStateTracker::setCapability(GLenum capability, bool enabled, bool& current) {
+  if (current == enabled) {
+    skippedChanges++;
+    return;
+  }
+  if (enabled) {
+    gl::Enable(capability);
+  } else {
+    gl::Disable(capability);
+  }
+  current = enabled;
+  issuedChanges++;
+}
+
+void RenderStateTracker::setStencilOp(GLenum face, const GLenum* ops, GLenum* current) {
+  if (memcmp(ops, current, 3 * sizeof(GLenum)) == 0) {
+    skippedChanges++;
+    return;
+  }
+  gl::StencilOpSeparate(face, ops[0], ops[1], ops[2]);
+  memcpy(current, ops, 3 * sizeof(GLenum));
+  issuedChanges++;
+}
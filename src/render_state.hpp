@@ -0,0 +1,128 @@
+#ifndef RENDER_STATE_H
+#define RENDER_STATE_H
+
+#include <map>
+#include <vector>
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+// Most draw buffers a RenderState can enable at once.
+#define MAX_DRAW_BUFFERS 8
+// Clip distances every GL 3.3 implementation supports.
+#define MAX_CLIP_DISTANCES 8
+
+/**
+ * Fixed-function state a pass renders with: target framebuffer and its draw
+ * buffers, viewport, scissor, depth test and writes, stencil test, blending,
+ * face culling and clip distances. Immutable, the with*() functions return a
+ * modified copy.
+ */
+class RenderState {
+public:
+  /**
+   * Scissor, depth test, stencil test, blending, culling and clip distances off, depth writes on.
+   * Draws to GL_COLOR_ATTACHMENT0, or GL_FRONT_LEFT for framebuffer 0, over
+   * the whole width x height target.
+   */
+  RenderState(GLuint framebuffer, int width, int height);
+
+  RenderState withDrawBuffer(GLenum buffer) const;
+  RenderState withDrawBuffers(const std::vector<GLenum>& buffers) const;
+  RenderState withViewport(int x, int y, int width, int height) const;
+  RenderState withScissor(int x, int y, int width, int height) const;
+  RenderState withDepthTest(bool enabled) const;
+  RenderState withDepthWrite(bool enabled) const;
+  // Enables the stencil test. Operations are GL_KEEP unless set with withStencilOp().
+  RenderState withStencilTest(GLenum func, GLint ref) const;
+  RenderState withStencilOp(GLenum face, GLenum stencilFail, GLenum depthFail, GLenum depthPass) const;
+  RenderState withBlend(GLenum src, GLenum dst) const;
+  RenderState withCullFace(GLenum mode) const;
+  // Enables GL_CLIP_DISTANCE0 up to count - 1, for shaders that write gl_ClipDistance.
+  RenderState withClipDistances(unsigned int count) const;
+
+  GLuint getFramebuffer() const {
+    return framebuffer;
+  }
+
+private:
+  friend class RenderStateTracker;
+
+  GLuint framebuffer;
+  GLenum drawBuffers[MAX_DRAW_BUFFERS];
+  unsigned int numDrawBuffers;
+  GLint viewport[4];
+  bool scissorTest;
+  GLint scissor[4];
+  bool depthTest;
+  bool depthWrite;
+  bool stencilTest;
+  GLenum stencilFunc;
+  GLint stencilRef;
+  GLenum stencilOps[2][3]; // Front and back: stencil fail, depth fail, depth pass.
+  bool blend;
+  GLenum blendSrc;
+  GLenum blendDst;
+  bool cullFace;
+  GLenum cullMode;
+  unsigned int clipDistances;
+};
+
+/**
+ * Remembers the state last set in GL and applies only what differs. Call
+ * invalidate() after changing any of it directly, and use bindFramebuffer()
+ * to bind a framebuffer just for attaching or reading.
+ */
+class RenderStateTracker {
+public:
+  static void apply(const RenderState& state);
+  static void bindFramebuffer(GLuint framebuffer);
+  static void invalidate();
+
+  // State changes issued vs skipped as redundant.
+  static unsigned long getIssuedChanges() { return issuedChanges; }
+  static unsigned long getSkippedChanges() { return skippedChanges; }
+  static void resetCounters() {
+    issuedChanges = 0;
+    skippedChanges = 0;
+  }
+
+private:
+  struct DrawBuffers {
+    GLenum buffers[MAX_DRAW_BUFFERS];
+    unsigned int count;
+  };
+
+  static void setCapability(GLenum capability, bool enabled, bool& current);
+  static void setStencilOp(GLenum face, const GLenum* ops, GLenum* current);
+
+  static bool framebufferValid;
+  static bool stateValid;
+  static GLuint framebuffer;
+  // Draw buffers are framebuffer state, so they're remembered per framebuffer.
+  static std::map<GLuint, DrawBuffers> drawBuffers;
+  static GLint viewport[4];
+  static bool scissorTest;
+  static bool scissorValid;
+  static GLint scissor[4];
+  static bool depthTest;
+  static bool depthWrite;
+  static bool stencilTest;
+  static bool stencilFuncValid;
+  static GLenum stencilFunc;
+  static GLint stencilRef;
+  static bool stencilOpsValid;
+  static GLenum stencilOps[2][3];
+  static bool blend;
+  static bool blendFuncValid;
+  static GLenum blendSrc;
+  static GLenum blendDst;
+  static bool cullFace;
+  static bool cullModeValid;
+  static GLenum cullMode;
+  static unsigned int clipDistances;
+
+  static unsigned long issuedChanges;
+  static unsigned long skippedChanges;
+};
+
+#endif
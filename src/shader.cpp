@@ -13,8 +13,74 @@
 
 namespace shaders {
 
-bool Shader::loadShader() {
-  shaderId = glCreateShader(getShaderType());
+unsigned long Shader::issuedCalls = 0;
+unsigned long Shader::skippedCalls = 0;
+GLuint Shader::boundTextures[MAX_TEXTURE_UNITS];
+GLenum Shader::boundTextureTargets[MAX_TEXTURE_UNITS];
+GLint Shader::activeTextureUnit = -1;
+bool Shader::parallelCompile = false;
+
+std::vector<ShaderField> NoGeometryShader::shaderFields;
+
+void Shader::bindTexture(unsigned int unit, GLenum target, GLuint tex) {
+  if (unit < MAX_TEXTURE_UNITS && boundTextureTargets[unit] == target && boundTextures[unit] == tex) {
+    skippedCalls++;
+    return;
+  }
+  if (activeTextureUnit != (GLint) unit) {
+    gl::ActiveTexture(GL_TEXTURE0 + unit);
+    activeTextureUnit = unit;
+    issuedCalls++;
+  }
+  gl::BindTexture(target, tex);
+  issuedCalls++;
+  if (unit < MAX_TEXTURE_UNITS) {
+    boundTextures[unit] = tex;
+    boundTextureTargets[unit] = target;
+  }
+}
+
+void Shader::invalidateTextureBindings() {
+  for (int i = 0; i < MAX_TEXTURE_UNITS; i++) {
+    boundTextureTargets[i] = GL_NONE;
+    boundTextures[i] = 0;
+  }
+  activeTextureUnit = -1;
+}
+
+bool Shader::resolveFields(GLuint programId, const std::vector<ShaderField>& fields) {
+  const char* stage = getShaderType() == GL_VERTEX_SHADER ? "Vertex" : getShaderType() == GL_GEOMETRY_SHADER ? "Geometry" : "Fragment";
+  for (unsigned int i = 0; i < fields.size(); i++) {
+    const ShaderField& field = fields[i];
+    if (field.blockBinding >= 0) {
+      GLuint blockIndex = gl::GetUniformBlockIndex(programId, field.name);
+      if (blockIndex == GL_INVALID_INDEX && optionalFields) {
+        uniformLocations[i] = -1;
+        continue;
+      }
+      if (blockIndex == GL_INVALID_INDEX) {
+        std::cerr << stage << " Shader Error: No uniform block " << field.name << " for shader "
+                  << filename << std::endl;
+        return false;
+      }
+      gl::UniformBlockBinding(programId, blockIndex, field.blockBinding);
+      // Blocks are set through their buffer, not a location.
+      uniformLocations[i] = -1;
+      continue;
+    }
+
+    GLint id = gl::GetUniformLocation(programId, field.name);
+    if (id == -1 && !optionalFields) {
+      std::cerr << stage << " Shader Error: No uniform field " << field.name << " for shader "
+                << filename << std::endl;
+      return false;
+    }
+    uniformLocations[i] = id;
+  }
+  return true;
+}
+
+bool Shader::readSource(std::string& source) {
   std::ifstream fileStream(filename, std::ios::in);
   std::stringstream shaderStream;
   if (fileStream.is_open()) {
@@ -28,23 +94,37 @@ bool Shader::loadShader() {
     return false;
   }
 
-  GLint result = GL_FALSE;
-  int infoLogLength;
+  source = shaderStream.str();
+  if (!defines.empty()) {
+    // Defines have to follow #version. #line keeps error line numbers matching the file.
+    size_t versionEnd = source.compare(0, 8, "#version") == 0 ? source.find('\n') + 1 : 0;
+    source.insert(versionEnd, defines + (versionEnd > 0 ? "#line 2\n" : "#line 1\n"));
+  }
+  return true;
+}
+
+void Shader::submitCompile(const std::string& source) {
+  shaderId = gl::CreateShader(getShaderType());
 
-  // Compile Shader.
+  // Compile Shader. The status isn't queried here, so the driver can keep
+  // compiling while other shaders are submitted.
   std::cout << "Compiling shader: " << filename << std::endl;
-  const std::string shaderSource = shaderStream.str();
-  const char* shaderSourceCStr = shaderSource.c_str();
-  glShaderSource(shaderId, 1, &shaderSourceCStr, NULL);
-  glCompileShader(shaderId);
+  const char* shaderSourceCStr = source.c_str();
+  gl::ShaderSource(shaderId, 1, &shaderSourceCStr, NULL);
+  gl::CompileShader(shaderId);
+}
+
+bool Shader::checkCompile() {
+  GLint result = GL_FALSE;
+  int infoLogLength;
 
   // Check Shader.
   std::cout << "Checking shader: " << filename << std::endl;
-  glGetShaderiv(shaderId, GL_COMPILE_STATUS, &result);
-  glGetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &infoLogLength);
+  gl::GetShaderiv(shaderId, GL_COMPILE_STATUS, &result);
+  gl::GetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &infoLogLength);
   if (result != GL_TRUE) {
     std::vector<char> errorMessage(infoLogLength + 1);
-    glGetShaderInfoLog(shaderId, infoLogLength, NULL, &errorMessage[0]);
+    gl::GetShaderInfoLog(shaderId, infoLogLength, NULL, &errorMessage[0]);
     std::cerr << "Shader error: " << &errorMessage[0] << std::endl;
     return false;
   }
@@ -52,13 +132,22 @@ bool Shader::loadShader() {
   return true;
 }
 
+void Shader::initializeCompiler() {
+  parallelCompile = GLEW_KHR_parallel_shader_compile;
+  if (parallelCompile) {
+    // Let the driver pick how many compiler threads to use.
+    gl::MaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+  }
+  std::cout << "Parallel shader compile " << (parallelCompile ? "enabled" : "not supported") << std::endl;
+}
+
 
 // TODO: delete this.
 GLuint loadShaders(const char* vertex_file_path, const char* fragment_file_path) {
 
   // Create the shaders
-  GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-  GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+  GLuint VertexShaderID = gl::CreateShader(GL_VERTEX_SHADER);
+  GLuint FragmentShaderID = gl::CreateShader(GL_FRAGMENT_SHADER);
 
   // Read the Vertex Shader code from the file
   std::string VertexShaderCode;
@@ -89,51 +178,51 @@ GLuint loadShaders(const char* vertex_file_path, const char* fragment_file_path)
   // Compile Vertex Shader.
   std::cout << "Compiling shader: " << vertex_file_path << std::endl;
   char const * VertexSourcePointer = VertexShaderCode.c_str();
-  glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-  glCompileShader(VertexShaderID);
+  gl::ShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
+  gl::CompileShader(VertexShaderID);
 
   // Check Vertex Shader
-  glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-  glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
+  gl::GetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
+  gl::GetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
   if ( infoLogLength > 0 ){
     std::vector<char> VertexShaderErrorMessage(infoLogLength+1);
-    glGetShaderInfoLog(VertexShaderID, infoLogLength, NULL, &VertexShaderErrorMessage[0]);
+    gl::GetShaderInfoLog(VertexShaderID, infoLogLength, NULL, &VertexShaderErrorMessage[0]);
     std::cerr << &VertexShaderErrorMessage[0] << std::endl;
   }
 
   // Compile Fragment Shader
   std::cout << "Compiling shader: " << fragment_file_path << std::endl;
   char const* FragmentSourcePointer = FragmentShaderCode.c_str();
-  glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-  glCompileShader(FragmentShaderID);
+  gl::ShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
+  gl::CompileShader(FragmentShaderID);
 
   // Check Fragment Shader
-  glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-  glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
+  gl::GetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
+  gl::GetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
   if ( infoLogLength > 0 ){
     std::vector<char> FragmentShaderErrorMessage(infoLogLength+1);
-    glGetShaderInfoLog(FragmentShaderID, infoLogLength, NULL, &FragmentShaderErrorMessage[0]);
+    gl::GetShaderInfoLog(FragmentShaderID, infoLogLength, NULL, &FragmentShaderErrorMessage[0]);
     std::cerr << &FragmentShaderErrorMessage[0] << std::endl;
   }
 
   // Link the program
   std::cout << "Linking program" << std::endl;
-  GLuint programId = glCreateProgram();
-  glAttachShader(programId, VertexShaderID);
-  glAttachShader(programId, FragmentShaderID);
-  glLinkProgram(programId);
+  GLuint programId = gl::CreateProgram();
+  gl::AttachShader(programId, VertexShaderID);
+  gl::AttachShader(programId, FragmentShaderID);
+  gl::LinkProgram(programId);
 
   // Check the program
-  glGetProgramiv(programId, GL_LINK_STATUS, &Result);
-  glGetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
+  gl::GetProgramiv(programId, GL_LINK_STATUS, &Result);
+  gl::GetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
   if (infoLogLength > 0){
     std::vector<char> ProgramErrorMessage(infoLogLength+1);
-    glGetProgramInfoLog(programId, infoLogLength, NULL, &ProgramErrorMessage[0]);
+    gl::GetProgramInfoLog(programId, infoLogLength, NULL, &ProgramErrorMessage[0]);
     std::cerr << &ProgramErrorMessage[0] << std::endl;
   }
 
-  glDeleteShader(VertexShaderID);
-  glDeleteShader(FragmentShaderID);
+  gl::DeleteShader(VertexShaderID);
+  gl::DeleteShader(FragmentShaderID);
 
   return programId;
 }
@@ -2,77 +2,116 @@
 #define SHADER_HPP
 
 #include <map>
+#include <deque>
 #include <vector>
 #include <string>
+#include <cstring>
 #include <iostream>
 #include <glm/glm.hpp>
 #include <GL/glew.h>
 #include <GL/gl.h>
 
+#include "gl_backend.hpp"
+#include "program_cache.hpp"
+
 namespace shaders {
 
+struct ShaderField {
+  const GLchar* name;
+  GLint blockBinding; // -1 for plain uniforms.
+};
+
 GLuint loadShaders(const char* vertex_file_path, const char* fragment_file_path);
 
-//#define SHADER_MEMBERS static std::vector<const GLchar*> shaderFieldNames;
+// Maximum uniforms a single shader stage may declare.
+#define MAX_SHADER_UNIFORMS 32
+
+// Must come first in every shader class. Uniforms declared after it are
+// numbered at compile time, counting from this base.
+#define SHADER_MEMBERS() \
+  static std::vector<ShaderField> shaderFields; \
+  enum { shaderFieldBase = __COUNTER__ }
 
-#define SHADER_UNIFORM_GENERIC(name, type, cmd) void set_##name (type n) { \
-  GLint id = shaderFieldMap[#name]; \
-  if (id == -1) {                                                        \
-    std::cerr << "Shader Runtime Error: No uniform field " #name " for shader " \
-              << filename << std::endl; \
-  }                                                                      \
-  cmd;                         \
-}                                                                        \
+// Maximum texture units tracked by the bind cache.
+#define MAX_TEXTURE_UNITS 16
+
+#define SHADER_FIELD(name, blockBinding) \
+enum { field_##name = __COUNTER__ - shaderFieldBase - 1 }; \
+static_assert(field_##name < MAX_SHADER_UNIFORMS, "Too many uniforms, raise MAX_SHADER_UNIFORMS"); \
 struct Field##name { \
   Field##name() { \
-    shaderFieldNames.push_back(#name); \
+    registerField(shaderFields, field_##name, #name, blockBinding); \
   } \
 } _field_##name
 
-#define SHADER_UNIFORM_MAT4(name) SHADER_UNIFORM_GENERIC(name, const glm::mat4&, glUniformMatrix4fv(id, 1, GL_FALSE, &n[0][0]))
-#define SHADER_UNIFORM_VEC3(name) SHADER_UNIFORM_GENERIC(name, const glm::vec3&, glUniform3fv(id, 1, &n[0]))
-#define SHADER_UNIFORM_VEC3_ARRAY(name) SHADER_UNIFORM_GENERIC(name, const glm::vec3*, glUniform3fv(id, sizeof(n), (float*)n))
-#define SHADER_UNIFORM_INT(name) SHADER_UNIFORM_GENERIC(name, int, glUniform1i(id, n))
-#define SHADER_UNIFORM_BOOL(name) SHADER_UNIFORM_GENERIC(name, bool, glUniform1i(id, n))
-#define SHADER_UNIFORM_FLOAT(name) SHADER_UNIFORM_GENERIC(name, float, glUniform1f(id, n))
+// Skips the GL call when value (valueSize bytes at valuePtr) matches what was last sent.
+#define SHADER_UNIFORM_GENERIC(name, type, valuePtr, valueSize, cmd) \
+SHADER_FIELD(name, -1); \
+void set_##name (type n) { \
+  GLint id = uniformLocations[field_##name]; \
+  if (uniformUnchanged(field_##name, valuePtr, valueSize)) return; \
+  cmd; \
+}
+
+#define SHADER_UNIFORM_MAT4(name) SHADER_UNIFORM_GENERIC(name, const glm::mat4&, &n[0][0], sizeof(glm::mat4), gl::UniformMatrix4fv(id, 1, GL_FALSE, &n[0][0]))
+#define SHADER_UNIFORM_MAT4_ARRAY(name, count) SHADER_UNIFORM_GENERIC(name, const glm::mat4*, &n[0][0][0], count * sizeof(glm::mat4), gl::UniformMatrix4fv(id, count, GL_FALSE, &n[0][0][0]))
+#define SHADER_UNIFORM_VEC2(name) SHADER_UNIFORM_GENERIC(name, const glm::vec2&, &n[0], sizeof(glm::vec2), gl::Uniform2fv(id, 1, &n[0]))
+#define SHADER_UNIFORM_VEC3(name) SHADER_UNIFORM_GENERIC(name, const glm::vec3&, &n[0], sizeof(glm::vec3), gl::Uniform3fv(id, 1, &n[0]))
+#define SHADER_UNIFORM_VEC4(name) SHADER_UNIFORM_GENERIC(name, const glm::vec4&, &n[0], sizeof(glm::vec4), gl::Uniform4fv(id, 1, &n[0]))
+#define SHADER_UNIFORM_VEC3_ARRAY(name, count) SHADER_UNIFORM_GENERIC(name, const glm::vec3*, n, count * sizeof(glm::vec3), gl::Uniform3fv(id, count, (float*)n))
+#define SHADER_UNIFORM_INT(name) SHADER_UNIFORM_GENERIC(name, int, &n, sizeof(int), gl::Uniform1i(id, n))
+#define SHADER_UNIFORM_BOOL(name) SHADER_UNIFORM_GENERIC(name, bool, &n, sizeof(bool), gl::Uniform1i(id, n))
+#define SHADER_UNIFORM_FLOAT(name) SHADER_UNIFORM_GENERIC(name, float, &n, sizeof(float), gl::Uniform1f(id, n))
+
+// Texture unit bindings are shared by all programs, so they go through the global bind cache.
 // TODO: Make this take Texture*.
-#define SHADER_UNIFORM_SAMPLER2D(name, slot) SHADER_UNIFORM_GENERIC(name, GLuint, {glActiveTexture(GL_TEXTURE0 + slot); glBindTexture(GL_TEXTURE_2D, n); glUniform1i(id, slot);})
-#define SHADER_UNIFORM_SAMPLER_CUBE(name, slot) SHADER_UNIFORM_GENERIC(name, GLuint, {glActiveTexture(GL_TEXTURE0 + slot); glBindTexture(GL_TEXTURE_CUBE_MAP, n); glUniform1i(id, slot);})
+#define SHADER_UNIFORM_SAMPLER(name, slot, target) \
+SHADER_FIELD(name, -1); \
+void set_##name (GLuint n) { \
+  if (uniformLocations[field_##name] == -1) return; \
+  bindTexture(slot, target, n); \
+  const int s = slot; \
+  if (uniformUnchanged(field_##name, &s, sizeof(int))) return; \
+  gl::Uniform1i(uniformLocations[field_##name], slot); \
+}
+#define SHADER_UNIFORM_SAMPLER2D(name, slot) SHADER_UNIFORM_SAMPLER(name, slot, GL_TEXTURE_2D)
+#define SHADER_UNIFORM_SAMPLER_CUBE(name, slot) SHADER_UNIFORM_SAMPLER(name, slot, GL_TEXTURE_CUBE_MAP)
+#define SHADER_UNIFORM_SAMPLER_CUBE_ARRAY(name, slot) SHADER_UNIFORM_SAMPLER(name, slot, GL_TEXTURE_CUBE_MAP_ARRAY)
+
+// std140 uniform block, linked to a binding point shared with a UniformBuffer.
+#define SHADER_UNIFORM_BLOCK(name, binding) SHADER_FIELD(name, binding)
 
 // TODO: Check names and locations during validation.
 #define SHADER_IN_VBO(name, location, size) void vbo_##name(GLuint vboId) { \
-  glEnableVertexAttribArray(location); \
+  gl::EnableVertexAttribArray(location); \
   enabledVertexAttribPointers[location] = true; \
-  glBindBuffer(GL_ARRAY_BUFFER, vboId); \
-  glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, 0, (void*)0); \
+  gl::BindBuffer(GL_ARRAY_BUFFER, vboId); \
+  gl::VertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, 0, (void*)0); \
 }
 #define SHADER_IN_VBO_VEC3(name, location) SHADER_IN_VBO(name, location, 3)
 #define SHADER_IN_VBO_VEC2(name, location) SHADER_IN_VBO(name, location, 2)
 
 #define SHADER_DRAW_TRIANGLE_ELEMENTS() void drawTriangleElements(GLuint elem_buf, GLuint num_triangles) { \
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elem_buf); \
-  prepareDraw(); \
-  glDrawElements(GL_TRIANGLES, num_triangles, GL_UNSIGNED_SHORT, (void*)0); \
+  gl::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, elem_buf); \
+  gl::DrawElements(GL_TRIANGLES, num_triangles, GL_UNSIGNED_SHORT, (void*)0); \
   arrayBufferSet = true; \
   cleanupDraw(); \
 }
 #define SHADER_DRAW_TRIANGLE_ARRAYS() void drawTriangles(GLuint num_triangles) { \
-  prepareDraw(); \
-  glDrawArrays(GL_TRIANGLES, 0, num_triangles); \
+  gl::DrawArrays(GL_TRIANGLES, 0, num_triangles); \
   cleanupDraw(); \
 }
 
 
 #define SHADER_OUT_COLOR_ATTACHMENT(name, slot) void attach_##name(GLuint texture) { \
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + slot, GL_TEXTURE_2D, texture, 0); \
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + slot, GL_TEXTURE_2D, texture, 0); \
   enabledColorAttachements[slot] = true; \
-  drawBuffersSetUp = false; \
 }
 #define SHADER_OUT_DEPTH_ATTACHMENT(name) void attach_##name(GLuint texture) { \
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0); \
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0); \
 }
 #define SHADER_OUT_DEPTH_CUBE_ATTACHMENT(name, slot) void attach_##name(GLuint texture) { \
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_CUBE_MAP_POSITIVE_X + slot, texture, 0); \
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_CUBE_MAP_POSITIVE_X + slot, texture, 0); \
 }
 
 // TODO: Make typesafe VBOs wrapper.
@@ -80,56 +119,131 @@ struct Field##name { \
 
 class Shader {
 public:
-  Shader(const char* filename): filename(filename), shaderId(0), enabledColorAttachements(20, false), enabledVertexAttribPointers(10, false), arrayBufferSet(false), drawBuffersSetUp(false) {
+  Shader(const char* filename): filename(filename), shaderId(0), optionalFields(false), enabledColorAttachements(20, false), enabledVertexAttribPointers(10, false), arrayBufferSet(false) {
+    for (int i = 0; i < MAX_SHADER_UNIFORMS; i++) {
+      uniformLocations[i] = -1;
+    }
+    invalidateUniformCache();
   }
 
-  ~Shader() {
-    glDeleteShader(shaderId);
+  virtual ~Shader() {
+    gl::DeleteShader(shaderId);
   }
 
-  bool loadShader();
+  // Read the source file, with defines inserted.
+  bool readSource(std::string& source);
+  // Start compiling without waiting for the result.
+  void submitCompile(const std::string& source);
+  // Blocks until the compile is done. Prints the log on failure.
+  bool checkCompile();
+
+  /**
+   * Call once after GL is initialized. Enables GL_KHR_parallel_shader_compile
+   * if present, so submitted programs compile on driver threads.
+   */
+  static void initializeCompiler();
+  static bool isParallelCompileSupported() { return parallelCompile; }
+
+  // Lines inserted after the #version line of the source, for compiling permutations.
+  void setDefines(const std::string& defines) {
+    this->defines = defines;
+  }
+
+  // Allow fields to be missing from the program, for permutations that compile some out.
+  void setOptionalFields(bool optional) {
+    optionalFields = optional;
+  }
 
   virtual GLuint getProgramId() = 0;
   virtual GLuint getShaderType() = 0;
   GLuint getShaderId() { return shaderId; }
 
-  void setupDrawBuffers() {
-    if (drawBuffersSetUp) {
-      return;
-    }
-    std::vector<GLuint> drawBuffers;
+  // Draw buffers for the color attachments made with attach_*(), to render into with a RenderState.
+  std::vector<GLenum> getDrawBuffers() {
+    std::vector<GLenum> drawBuffers;
     for (uint i = 0; i < enabledColorAttachements.size(); ++i) {
       if (enabledColorAttachements[i]) {
         drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + i);
       }
     }
-    if (drawBuffers.size() > 0) {
-      glDrawBuffers(drawBuffers.size(), &drawBuffers[0]);
+    return drawBuffers;
+  }
+
+  void cleanupDraw() {
+    unbindVertexAttribPointers();
+  }
+
+  /**
+   * Bind tex to a texture unit, unless the bind cache says it already is.
+   * Call invalidateTextureBindings() after binding or deleting textures any other way.
+   */
+  static void bindTexture(unsigned int unit, GLenum target, GLuint tex);
+  static void invalidateTextureBindings();
+
+  // GL calls issued vs skipped as redundant, over all shaders.
+  static unsigned long getIssuedCalls() { return issuedCalls; }
+  static unsigned long getSkippedCalls() { return skippedCalls; }
+  static void resetCallCounters() {
+    issuedCalls = 0;
+    skippedCalls = 0;
+  }
+
+  void invalidateUniformCache() {
+    for (int i = 0; i < MAX_SHADER_UNIFORMS; i++) {
+      uniformCache[i].valid = false;
+      uniformCache[i].cacheable = true;
     }
-    drawBuffersSetUp = true;
   }
 
-  void prepareDraw() {
-    setupDrawBuffers();
+  // Uniforms that share a location with another stage's uniform must always be sent.
+  void disableUniformCache(unsigned int index) {
+    uniformCache[index].cacheable = false;
   }
 
-  void cleanupDraw() {
-    unbindVertexAttribPointers();
-    for (uint i = 0; i < enabledColorAttachements.size(); ++i) {
-      enabledColorAttachements[i] = false;
+  /**
+   * Returns true if value is what was last sent for this uniform, otherwise
+   * records it so the caller can send it.
+   */
+  bool uniformUnchanged(unsigned int index, const void* value, size_t size) {
+    UniformCacheEntry& entry = uniformCache[index];
+    if (!entry.cacheable || size > sizeof(entry.data)) {
+      issuedCalls++;
+      return false;
+    }
+    if (entry.valid && memcmp(entry.data, value, size) == 0) {
+      skippedCalls++;
+      return true;
+    }
+    memcpy(entry.data, value, size);
+    entry.valid = true;
+    issuedCalls++;
+    return false;
+  }
+
+  static void registerField(std::vector<ShaderField>& fields, unsigned int index, const GLchar* name, GLint blockBinding) {
+    if (fields.size() <= index) {
+      ShaderField unset = {NULL, -1};
+      fields.resize(index + 1, unset);
     }
-    drawBuffersSetUp = false;
+    fields[index].name = name;
+    fields[index].blockBinding = blockBinding;
   }
 
+  /**
+   * Look up uniform locations and link uniform blocks to their binding points.
+   * Returns false if any field is missing from the program.
+   */
+  bool resolveFields(GLuint programId, const std::vector<ShaderField>& fields);
+
   void unbindVertexAttribPointers() {
     for (uint i = 0; i < enabledVertexAttribPointers.size(); ++i) {
       if (enabledVertexAttribPointers[i]) {
-        glDisableVertexAttribArray(i);
+        gl::DisableVertexAttribArray(i);
         enabledVertexAttribPointers[i] = false;
       }
     }
     if (arrayBufferSet) {
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      gl::BindBuffer(GL_ARRAY_BUFFER, 0);
       arrayBufferSet = false;
     }
   }
@@ -137,11 +251,27 @@ public:
 protected:
   const char* filename;
   GLuint shaderId;
-  std::map<std::string, GLint> shaderFieldMap;
+  std::string defines;
+  bool optionalFields;
+  struct UniformCacheEntry {
+    bool valid;
+    bool cacheable;
+    GLfloat data[16]; // Big enough for a mat4.
+  };
+
+  static unsigned long issuedCalls;
+  static unsigned long skippedCalls;
+  static GLuint boundTextures[MAX_TEXTURE_UNITS];
+  static GLenum boundTextureTargets[MAX_TEXTURE_UNITS];
+  static GLint activeTextureUnit;
+  static bool parallelCompile;
+
+  // Indexed by the field_* enums of the derived shader.
+  GLint uniformLocations[MAX_SHADER_UNIFORMS];
+  UniformCacheEntry uniformCache[MAX_SHADER_UNIFORMS];
   std::vector<bool> enabledColorAttachements;
   std::vector<bool> enabledVertexAttribPointers;
   bool arrayBufferSet;
-  bool drawBuffersSetUp;
 };
 
 class VertexShader: public Shader {
@@ -156,67 +286,172 @@ protected:
   GLuint getShaderType() { return GL_FRAGMENT_SHADER; }
 };
 
-template<class VERT, class FRAG>
-class ShaderProgram: public VERT, public FRAG {
+class GeometryShader: public Shader {
+protected:
+  GeometryShader(const char* filename): Shader(filename) {}
+  GLuint getShaderType() { return GL_GEOMETRY_SHADER; }
+};
+
+// Stands in for the geometry stage of programs that don't have one.
+class NoGeometryShader: public GeometryShader {
 public:
-  ShaderProgram() {}
+  NoGeometryShader(): GeometryShader(NULL) {}
+  SHADER_MEMBERS();
+};
+
+template<class VERT, class FRAG, class GEOM = NoGeometryShader>
+class ShaderProgram: public VERT, public FRAG, public GEOM {
+public:
+  ShaderProgram(): loadedFromCache(false), submitted(false), finished(false), finishResult(false), programId(0) {}
+
+  ~ShaderProgram() {
+    gl::DeleteProgram(programId);
+  }
 
   GLuint getProgramId() {
     return programId;
   }
 
-  bool initialize() {
-    // Load shaders.
-    bool loaded = VERT::loadShader();
-    if (!loaded) return false;
-    loaded = FRAG::loadShader();
-    if (!loaded) return false;
+  void setDefines(const std::string& defines) {
+    VERT::setDefines(defines);
+    FRAG::setDefines(defines);
+    GEOM::setDefines(defines);
+  }
 
-    if (!linkProgram()) {
-      return false;
-    }
+  void setOptionalFields(bool optional) {
+    VERT::setOptionalFields(optional);
+    FRAG::setOptionalFields(optional);
+    GEOM::setOptionalFields(optional);
+  }
 
-    std::cerr << "Validating shader fields" << std::endl;
-    for (const GLchar* field : VERT::shaderFieldNames) {
-      GLint id = glGetUniformLocation(getProgramId(), field);
-      if (id == -1) {
-        std::cerr << "Vertex Shader Error: No uniform field " << field << " for shader "
-                  << VERT::filename << std::endl;
-        return false;
+  bool hasGeometryShader() {
+    return GEOM::filename != NULL;
+  }
+
+  /**
+   * Start compiling and linking without waiting for the driver. finish()
+   * must be called before the program is used. Returns false if the sources
+   * can't be read.
+   */
+  bool submit() {
+    std::string vertSource;
+    std::string fragSource;
+    std::string geomSource;
+    if (!VERT::readSource(vertSource)) return false;
+    if (!FRAG::readSource(fragSource)) return false;
+    if (hasGeometryShader() && !GEOM::readSource(geomSource)) return false;
+
+    // Reuse the linked binary from a previous run if the driver accepts it.
+    cacheKey = ProgramCache::makeKey(vertSource + geomSource, fragSource);
+    programId = ProgramCache::load(cacheKey);
+    if (programId != 0) {
+      std::cout << "Shader program (" << VERT::filename << ", " << FRAG::filename << ") loaded from cache with id=" << programId << std::endl;
+      loadedFromCache = true;
+    } else {
+      VERT::submitCompile(vertSource);
+      FRAG::submitCompile(fragSource);
+      if (hasGeometryShader()) {
+        GEOM::submitCompile(geomSource);
       }
-      VERT::shaderFieldMap[field] = id;
+      submitLink();
+    }
+    submitted = true;
+    return true;
+  }
+
+  // True once finish() won't block. Without parallel compile support there's no way to tell.
+  bool isReady() {
+    if (!submitted || finished || !Shader::isParallelCompileSupported()) {
+      return true;
+    }
+    GLint done = GL_FALSE;
+    gl::GetProgramiv(programId, GL_COMPLETION_STATUS_KHR, &done);
+    return done == GL_TRUE;
+  }
+
+  bool isFinished() {
+    return finished;
+  }
+
+  // Wait for the link, then validate fields. Calling it again returns the first result.
+  bool finish() {
+    if (finished) {
+      return finishResult;
+    }
+    finished = true;
+    finishResult = false;
+    if (!submitted) {
+      return false;
     }
-    for (const GLchar* field : FRAG::shaderFieldNames) {
-      GLint id = glGetUniformLocation(getProgramId(), field);
-      if (id == -1) {
-        std::cerr << "Fragment Shader Error: No uniform field " << field << " for shader "
-                  << FRAG::filename << std::endl;
+
+    if (!loadedFromCache) {
+      if (!VERT::checkCompile()) return false;
+      if (!FRAG::checkCompile()) return false;
+      if (hasGeometryShader() && !GEOM::checkCompile()) return false;
+
+      if (!checkLink()) {
         return false;
       }
-      FRAG::shaderFieldMap[field] = id;
+      ProgramCache::store(cacheKey, programId);
     }
 
+    std::cerr << "Validating shader fields" << std::endl;
+    if (!VERT::resolveFields(getProgramId(), VERT::shaderFields)) return false;
+    if (!FRAG::resolveFields(getProgramId(), FRAG::shaderFields)) return false;
+    if (!GEOM::resolveFields(getProgramId(), GEOM::shaderFields)) return false;
+
+    // Values from a previous link are gone.
+    VERT::invalidateUniformCache();
+    FRAG::invalidateUniformCache();
+    GEOM::invalidateUniformCache();
+    disableSharedUniformCaches<VERT, FRAG>();
+    disableSharedUniformCaches<VERT, GEOM>();
+    disableSharedUniformCaches<FRAG, GEOM>();
+
     // TODO: Other setup and validation.
+    finishResult = true;
     return true;
   }
 
+  bool initialize() {
+    return submit() && finish();
+  }
+
 protected:
-  bool linkProgram() {
+  template<class A, class B>
+  void disableSharedUniformCaches() {
+    for (unsigned int i = 0; i < A::shaderFields.size(); i++) {
+      for (unsigned int j = 0; j < B::shaderFields.size(); j++) {
+        if (A::uniformLocations[i] != -1 && A::uniformLocations[i] == B::uniformLocations[j]) {
+          A::disableUniformCache(i);
+          B::disableUniformCache(j);
+        }
+      }
+    }
+  }
+
+  void submitLink() {
     std::cout << "Linking program" << std::endl;
-    programId = glCreateProgram();
-    glAttachShader(programId, VERT::getShaderId());
-    glAttachShader(programId, FRAG::getShaderId());
-    glLinkProgram(programId);
+    programId = gl::CreateProgram();
+    gl::AttachShader(programId, VERT::getShaderId());
+    gl::AttachShader(programId, FRAG::getShaderId());
+    if (hasGeometryShader()) {
+      gl::AttachShader(programId, GEOM::getShaderId());
+    }
+    ProgramCache::prepareLink(programId);
+    gl::LinkProgram(programId);
+  }
 
+  bool checkLink() {
     // Check the program
     GLint result = GL_FALSE;
     int infoLogLength;
 
-    glGetProgramiv(programId, GL_LINK_STATUS, &result);
-    glGetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
+    gl::GetProgramiv(programId, GL_LINK_STATUS, &result);
+    gl::GetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
     if (result != GL_TRUE){
       std::vector<char> ProgramErrorMessage(infoLogLength+1);
-      glGetProgramInfoLog(programId, infoLogLength, NULL, &ProgramErrorMessage[0]);
+      gl::GetProgramInfoLog(programId, infoLogLength, NULL, &ProgramErrorMessage[0]);
       std::cerr << &ProgramErrorMessage[0] << std::endl;
       return false;
     }
@@ -224,9 +459,158 @@ protected:
     return true;
   }
 
+  std::string cacheKey;
+  bool loadedFromCache;
+  bool submitted;
+  bool finished;
+  bool finishResult;
   GLuint programId;
 };
 
+/**
+ * #define variants of a ShaderProgram, compiled on first use and cached.
+ * Bit i of a key defines defineNames[i] in both stages.
+ *
+ * Variants that may be needed later can be queued with prefetch(), and are
+ * compiled in the background by calling update() once per frame. Without
+ * parallel compile support they are compiled on first use instead.
+ */
+template<class PROGRAM>
+class ShaderPermutations {
+public:
+  ShaderPermutations(const char* const* defineNames, unsigned int numDefines)
+    : defineNames(defineNames), numDefines(numDefines) {}
+
+  ~ShaderPermutations() {
+    for (typename std::map<unsigned int, PROGRAM*>::iterator it = programs.begin(); it != programs.end(); it++) {
+      delete it->second;
+    }
+  }
+
+  // Returns NULL if the variant doesn't compile. Failures are cached as well.
+  PROGRAM* get(unsigned int key) {
+    PROGRAM* program = submit(key);
+    if (program != NULL && !program->isFinished()) {
+      program = finish(key);
+    }
+    return program;
+  }
+
+  // Start compiling key without waiting for it. get() finishes it when it's first needed.
+  PROGRAM* submit(unsigned int key) {
+    typename std::map<unsigned int, PROGRAM*>::iterator it = programs.find(key);
+    if (it != programs.end()) {
+      return it->second;
+    }
+
+    PROGRAM* program = new PROGRAM();
+    program->setDefines(getDefines(key));
+    // Any variant, even the one without defines, may have fields the driver strips as unused.
+    program->setOptionalFields(true);
+    if (!program->submit()) {
+      std::cerr << "Failed to read permutation sources:" << std::endl << getDefines(key);
+      delete program;
+      program = NULL;
+    }
+    programs[key] = program;
+    return program;
+  }
+
+  // Queue key to be submitted by a later update(). Does nothing if compiling would block the frame.
+  void prefetch(unsigned int key) {
+    if (Shader::isParallelCompileSupported() && programs.find(key) == programs.end()) {
+      prefetchQueue.push_back(key);
+    }
+  }
+
+  // Finish submitted variants the driver is done with, then hand all queued ones to the driver threads.
+  void update() {
+    for (typename std::map<unsigned int, PROGRAM*>::iterator it = programs.begin(); it != programs.end(); it++) {
+      if (it->second != NULL && !it->second->isFinished() && it->second->isReady()) {
+        finish(it->first);
+      }
+    }
+    while (!prefetchQueue.empty()) {
+      unsigned int key = prefetchQueue.front();
+      prefetchQueue.pop_front();
+      if (programs.find(key) != programs.end()) {
+        continue;
+      }
+      submit(key);
+    }
+  }
+
+  std::string getDefines(unsigned int key) {
+    std::string defines;
+    for (unsigned int i = 0; i < numDefines; i++) {
+      if (key & (1 << i)) {
+        defines += "#define ";
+        defines += defineNames[i];
+        defines += "\n";
+      }
+    }
+    return defines;
+  }
+
+  unsigned int getNumCompiled() {
+    return programs.size();
+  }
+
+private:
+  PROGRAM* finish(unsigned int key) {
+    PROGRAM* program = programs[key];
+    if (!program->finish()) {
+      std::cerr << "Failed to compile permutation:" << std::endl << getDefines(key);
+      delete program;
+      program = NULL;
+      programs[key] = NULL;
+    }
+    return program;
+  }
+
+  const char* const* defineNames;
+  unsigned int numDefines;
+  std::map<unsigned int, PROGRAM*> programs;
+  std::deque<unsigned int> prefetchQueue;
+};
+
+/**
+ * Buffer backing a uniform block declared with SHADER_UNIFORM_BLOCK. BLOCK
+ * must follow std140 layout: only vec4/ivec4/mat4 sized members, so the C++
+ * struct packs the same way as the GLSL block.
+ */
+template<class BLOCK>
+class UniformBuffer {
+public:
+  UniformBuffer(GLuint binding): binding(binding), bufferId(0) {}
+
+  ~UniformBuffer() {
+    gl::DeleteBuffers(1, &bufferId);
+  }
+
+  void initialize() {
+    gl::GenBuffers(1, &bufferId);
+    gl::BindBuffer(GL_UNIFORM_BUFFER, bufferId);
+    gl::BufferData(GL_UNIFORM_BUFFER, sizeof(BLOCK), NULL, GL_DYNAMIC_DRAW);
+    gl::BindBufferBase(GL_UNIFORM_BUFFER, binding, bufferId);
+  }
+
+  BLOCK& get() {
+    return data;
+  }
+
+  // Upload the first size bytes of the block, for blocks ending in a partly used array.
+  void upload(size_t size = sizeof(BLOCK)) {
+    gl::BindBuffer(GL_UNIFORM_BUFFER, bufferId);
+    gl::BufferSubData(GL_UNIFORM_BUFFER, 0, size, &data);
+  }
+
+private:
+  BLOCK data;
+  GLuint binding;
+  GLuint bufferId;
+};
+
 } // namespace shaders
 
 
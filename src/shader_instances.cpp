@@ -5,15 +5,42 @@
 
 namespace shaders {
 
-std::vector<const GLchar*> GeomTexturesVertShader::shaderFieldNames;
-std::vector<const GLchar*> GeomTexturesFragShader::shaderFieldNames;
-std::vector<const GLchar*> JustTextureFrag::shaderFieldNames;
-std::vector<const GLchar*> PassThroughVert::shaderFieldNames;
-std::vector<const GLchar*> DepthShadowVert::shaderFieldNames;
-std::vector<const GLchar*> DepthShadowFrag::shaderFieldNames;
-std::vector<const GLchar*> DeferredShadingVert::shaderFieldNames;
-std::vector<const GLchar*> DeferredShadingFrag::shaderFieldNames;
-std::vector<const GLchar*> PostProcessFrag::shaderFieldNames;
+std::vector<ShaderField> GeomTexturesVertShader::shaderFields;
+std::vector<ShaderField> GeomTexturesFragShader::shaderFields;
+std::vector<ShaderField> JustTextureFrag::shaderFields;
+std::vector<ShaderField> PassThroughVert::shaderFields;
+std::vector<ShaderField> DepthShadowVert::shaderFields;
+std::vector<ShaderField> DepthShadowFrag::shaderFields;
+std::vector<ShaderField> DepthMomentsFrag::shaderFields;
+std::vector<ShaderField> VarianceBlurFrag::shaderFields;
+std::vector<ShaderField> DepthCubeGeom::shaderFields;
+std::vector<ShaderField> DepthParaboloidVert::shaderFields;
+std::vector<ShaderField> DeferredShadingVert::shaderFields;
+std::vector<ShaderField> DeferredShadingFrag::shaderFields;
+std::vector<ShaderField> PostProcessFrag::shaderFields;
+
+const char* const geomTexturesDefines[] = {
+  "USE_DIFFUSE_TEXTURE",
+  "USE_NORMAL_TEXTURE"
+};
+const unsigned int numGeomTexturesDefines = sizeof(geomTexturesDefines) / sizeof(geomTexturesDefines[0]);
+
+const char* const deferredShadingDefines[] = {
+  "USE_DIFFUSE",
+  "USE_SPECULAR",
+  "USE_SHADOW",
+  "USE_SSAO",
+  "DIRECTIONAL_LIGHT",
+  "SPOT_LIGHT",
+  "POINT_LIGHT",
+  "TILED_LIGHTS",
+  "LIGHT_VOLUME",
+  "BASE_PASS",
+  "PARABOLOID_SHADOW",
+  "VARIANCE_SHADOW",
+  "SHADOW_CUBE_ARRAY"
+};
+const unsigned int numDeferredShadingDefines = sizeof(deferredShadingDefines) / sizeof(deferredShadingDefines[0]);
 
 } // namespace shaders
 
@@ -9,10 +9,59 @@
 
 namespace shaders {
 
+// Uniform block binding points, shared by all programs.
+enum UniformBlockBinding {
+  VIEW_BLOCK_BINDING = 0,
+  LIGHT_BLOCK_BINDING = 1,
+  MATERIAL_BLOCK_BINDING = 2
+};
+
+// Must match the array sizes in the GLSL block declarations.
+#define MAX_LIGHTS 64
+#define MAX_MATERIALS 256
+// Shadow map splits of a directional light. Must match NUM_CASCADES in
+// deferredShading.frag, at most 4 as their ends are passed in a vec4.
+#define SHADOW_CASCADES 3
+
+// Camera constants, uploaded once per rendered view.
+struct ViewBlock {
+  glm::mat4 V;
+  glm::mat4 P;
+  glm::mat4 VP;
+  glm::mat4 invV;
+  glm::mat4 invP;
+};
+
+struct LightData {
+  glm::vec4 positionType; // w is the Light::LightType.
+  glm::vec4 directionSpread; // w is the spread in degrees.
+  glm::vec4 colour;
+  glm::vec4 ambience;
+  glm::vec4 falloff; // w is the layer in the shadow cube map array, -1 for none.
+};
+
+// All lights, uploaded once per frame, indexed by position in the light list.
+struct LightBlock {
+  LightData lights[MAX_LIGHTS];
+};
+
+struct MaterialData {
+  glm::vec4 diffuseShininess; // w is the shininess.
+  glm::vec4 specular;
+  glm::vec4 emissive;
+};
+
+// All materials, indexed by Material::getId().
+struct MaterialBlock {
+  MaterialData materials[MAX_MATERIALS];
+};
+
+static_assert(sizeof(LightData) % 16 == 0 && sizeof(MaterialData) % 16 == 0, "std140 array elements are vec4 aligned");
+
 class GeomTexturesVertShader: public VertexShader {
 public:
   GeomTexturesVertShader(): VertexShader("shaders/geomTextures.vert") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
 
   SHADER_IN_VBO_VEC3(vertexPositionModelspace, 0);
   SHADER_IN_VBO_VEC2(vertexUV, 1);
@@ -22,9 +71,8 @@ public:
 
   SHADER_DRAW_TRIANGLE_ELEMENTS();
 
-  SHADER_UNIFORM_MAT4(MVP);
+  SHADER_UNIFORM_BLOCK(ViewBlock, VIEW_BLOCK_BINDING);
   SHADER_UNIFORM_MAT4(M);
-  SHADER_UNIFORM_MAT4(V);
   SHADER_UNIFORM_VEC3(halfspacePoint);
   SHADER_UNIFORM_VEC3(halfspaceNormal);
 };
@@ -33,17 +81,13 @@ public:
 class GeomTexturesFragShader: public FragmentShader {
 public:
   GeomTexturesFragShader(): FragmentShader("shaders/geomTextures.frag") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
 
   SHADER_UNIFORM_SAMPLER2D(diffuseTexture, 0);
   SHADER_UNIFORM_SAMPLER2D(normalTexture, 1);
 
-  SHADER_UNIFORM_BOOL(useDiffuseTexture);
-  SHADER_UNIFORM_BOOL(useNormalTexture);
-  SHADER_UNIFORM_VEC3(material_kd);
-  SHADER_UNIFORM_VEC3(material_ks);
-  SHADER_UNIFORM_FLOAT(material_shininess);
-  SHADER_UNIFORM_VEC3(material_emissive);
+  SHADER_UNIFORM_BLOCK(MaterialBlock, MATERIAL_BLOCK_BINDING);
+  SHADER_UNIFORM_INT(materialIndex);
 
   SHADER_UNIFORM_VEC3(halfspacePoint);
   SHADER_UNIFORM_VEC3(halfspaceNormal);
@@ -62,7 +106,7 @@ public:
 class PassThroughVert: public VertexShader {
 public:
   PassThroughVert(): VertexShader("shaders/passthrough.vert") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
 
   SHADER_IN_VBO_VEC3(vertexPositionModelspace, 0);
   SHADER_DRAW_TRIANGLE_ARRAYS();
@@ -71,7 +115,7 @@ public:
 class JustTextureFrag: public FragmentShader {
 public:
   JustTextureFrag(): FragmentShader("shaders/justTexture.frag") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
 
   SHADER_UNIFORM_SAMPLER2D(texture, 0);
 };
@@ -79,7 +123,12 @@ public:
 class DepthShadowVert: public VertexShader {
 public:
   DepthShadowVert(): VertexShader("shaders/depthShadow.vert") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
+
+  SHADER_IN_VBO_VEC3(vertexPositionModelspace, 0);
+  SHADER_DRAW_TRIANGLE_ELEMENTS();
+  SHADER_DRAW_TRIANGLE_ARRAYS();
+
   SHADER_UNIFORM_MAT4(depthMVP);
 };
 
@@ -87,19 +136,71 @@ public:
 class DepthShadowFrag: public FragmentShader {
 public:
   DepthShadowFrag(): FragmentShader("shaders/depthShadow.frag") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
+};
+
+// Distance from the light and its square, for variance shadow maps.
+class DepthMomentsFrag: public FragmentShader {
+public:
+  DepthMomentsFrag(): FragmentShader("shaders/depthMoments.frag") {}
+  SHADER_MEMBERS();
+
+  SHADER_OUT_COLOR_ATTACHMENT(moments, 0);
+};
+
+// One direction of a separable blur of a moments texture.
+class VarianceBlurFrag: public FragmentShader {
+public:
+  VarianceBlurFrag(): FragmentShader("shaders/varianceBlur.frag") {}
+  SHADER_MEMBERS();
+
+  SHADER_UNIFORM_SAMPLER2D(moments, 0);
+  SHADER_UNIFORM_VEC2(blurStep);
+  SHADER_UNIFORM_FLOAT(uvScale);
+  SHADER_OUT_COLOR_ATTACHMENT(blurredMoments, 0);
+};
+
+// Copies each triangle to the cube faces it touches, for drawing a point
+// light's whole shadow cube map in one pass. depthMVP is then the model matrix.
+class DepthCubeGeom: public GeometryShader {
+public:
+  DepthCubeGeom(): GeometryShader("shaders/depthCube.geom") {}
+  SHADER_MEMBERS();
+  SHADER_UNIFORM_MAT4_ARRAY(cubeFaceVP, 6);
+  SHADER_UNIFORM_INT(cubeFaceMask);
+  SHADER_UNIFORM_INT(cubeFirstLayer);
+};
+
+// Warps light space onto a paraboloid, for one half of a dual-paraboloid shadow map.
+class DepthParaboloidVert: public VertexShader {
+public:
+  DepthParaboloidVert(): VertexShader("shaders/depthParaboloid.vert") {}
+  SHADER_MEMBERS();
+
+  SHADER_IN_VBO_VEC3(vertexPositionModelspace, 0);
+  SHADER_DRAW_TRIANGLE_ELEMENTS();
+
+  SHADER_UNIFORM_MAT4(depthMVP);
+  SHADER_UNIFORM_FLOAT(paraboloidNear);
 };
 
 class DeferredShadingVert: public VertexShader {
 public:
   DeferredShadingVert(): VertexShader("shaders/deferredShading.vert") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
+
+  // The shader's quadPositionModelspace, named like the other programs' positions.
+  SHADER_IN_VBO_VEC3(vertexPositionModelspace, 0);
+  SHADER_DRAW_TRIANGLE_ELEMENTS();
+  SHADER_DRAW_TRIANGLE_ARRAYS();
+
+  SHADER_UNIFORM_MAT4(lightVolumeMVP);
 };
 
 class DeferredShadingFrag: public FragmentShader {
 public:
   DeferredShadingFrag(): FragmentShader("shaders/deferredShading.frag") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
 
   SHADER_UNIFORM_SAMPLER2D(diffuseTexture, 0);
   SHADER_UNIFORM_SAMPLER2D(specularTexture, 1);
@@ -109,30 +210,27 @@ public:
   SHADER_UNIFORM_SAMPLER2D(shadowMap, 5);
   SHADER_UNIFORM_SAMPLER_CUBE(shadowMapCube, 6);
   SHADER_UNIFORM_SAMPLER2D(ssaoNoiseTexture, 7);
+  SHADER_UNIFORM_SAMPLER2D(tileLightMasks, 8);
+  SHADER_UNIFORM_SAMPLER2D(shadowMoments, 9);
+  SHADER_UNIFORM_SAMPLER_CUBE_ARRAY(shadowMapCubeArray, 10);
 
-  SHADER_UNIFORM_VEC3(lightPositionWorldspace);
-  SHADER_UNIFORM_VEC3(lightDirectionWorldspace);
-  SHADER_UNIFORM_INT(lightType);
-  SHADER_UNIFORM_VEC3(lightColour);
+  SHADER_UNIFORM_BLOCK(ViewBlock, VIEW_BLOCK_BINDING);
+  SHADER_UNIFORM_BLOCK(LightBlock, LIGHT_BLOCK_BINDING);
+  SHADER_UNIFORM_INT(lightIndex);
   SHADER_UNIFORM_VEC3(lightAmbience);
-  SHADER_UNIFORM_VEC3(lightFalloff);
-  SHADER_UNIFORM_FLOAT(lightSpreadDegrees);
 
-  SHADER_UNIFORM_MAT4(P);
-  SHADER_UNIFORM_MAT4(V);
   SHADER_UNIFORM_MAT4(shadowmapDepthBiasVP);
+  SHADER_UNIFORM_VEC4(shadowAtlasRegion);
+  SHADER_UNIFORM_MAT4_ARRAY(shadowCascadeVP, SHADOW_CASCADES);
+  SHADER_UNIFORM_VEC4(shadowCascadeEnds);
 
-  SHADER_UNIFORM_BOOL(useDiffuse);
-  SHADER_UNIFORM_BOOL(useSpecular);
-  SHADER_UNIFORM_BOOL(useShadow);
-  SHADER_UNIFORM_BOOL(useSSAO);
-  SHADER_UNIFORM_VEC3_ARRAY(ssaoKernel);
+  SHADER_UNIFORM_VEC3_ARRAY(ssaoKernel, 4);
 };
 
 class PostProcessFrag: public FragmentShader {
 public:
   PostProcessFrag(): FragmentShader("shaders/postProcess.frag") {}
-  static std::vector<const GLchar*> shaderFieldNames;
+  SHADER_MEMBERS();
 
   SHADER_UNIFORM_SAMPLER2D(tex, 0);
   SHADER_UNIFORM_SAMPLER2D(depthTexture, 1);
@@ -147,6 +245,41 @@ public:
   SHADER_UNIFORM_INT(selectedMeshId);
 };
 
+typedef ShaderProgram<GeomTexturesVertShader, GeomTexturesFragShader> GeomTexturesProgram;
+typedef ShaderProgram<DeferredShadingVert, DeferredShadingFrag> DeferredShadingProgram;
+typedef ShaderProgram<DepthShadowVert, DepthShadowFrag, DepthCubeGeom> DepthCubeProgram;
+typedef ShaderProgram<DepthParaboloidVert, DepthShadowFrag> DepthParaboloidProgram;
+typedef ShaderProgram<DepthShadowVert, DepthMomentsFrag> DepthMomentsProgram;
+typedef ShaderProgram<PassThroughVert, VarianceBlurFrag> VarianceBlurProgram;
+
+// Permutation key bits, in the order of the define name tables below.
+enum GeomTexturesPermutation {
+  GEOM_DIFFUSE_TEXTURE = 1 << 0,
+  GEOM_NORMAL_TEXTURE = 1 << 1,
+  GEOM_NUM_PERMUTATIONS = 1 << 2
+};
+
+enum DeferredShadingPermutation {
+  DEFERRED_DIFFUSE = 1 << 0,
+  DEFERRED_SPECULAR = 1 << 1,
+  DEFERRED_SHADOW = 1 << 2,
+  DEFERRED_SSAO = 1 << 3,
+  DEFERRED_DIRECTIONAL_LIGHT = 1 << 4,
+  DEFERRED_SPOT_LIGHT = 1 << 5,
+  DEFERRED_POINT_LIGHT = 1 << 6,
+  DEFERRED_TILED_LIGHTS = 1 << 7,
+  DEFERRED_LIGHT_VOLUME = 1 << 8,
+  DEFERRED_BASE_PASS = 1 << 9,
+  DEFERRED_PARABOLOID_SHADOW = 1 << 10,
+  DEFERRED_VARIANCE_SHADOW = 1 << 11,
+  DEFERRED_SHADOW_CUBE_ARRAY = 1 << 12
+};
+
+extern const char* const geomTexturesDefines[];
+extern const unsigned int numGeomTexturesDefines;
+extern const char* const deferredShadingDefines[];
+extern const unsigned int numDeferredShadingDefines;
+
 } // namespace shaders
 
 #endif
@@ -1,79 +1,448 @@
 
 #include <FreeImage.h>
 #include <iostream>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include "gl_backend.hpp"
 #include "texture.hpp"
+#include "worker_pool.hpp"
+#include "shader.hpp"
 
 std::map<std::string, Texture*> Texture::loadedTextures;
+std::mutex Texture::cacheMutex;
+std::condition_variable Texture::decodeFinished;
+WorkerPool* Texture::decodePool = NULL;
+size_t Texture::memoryBudget = DEFAULT_TEXTURE_MEMORY_BUDGET;
+size_t Texture::residentBytes = 0;
+unsigned long Texture::cacheHits = 0;
+unsigned long Texture::cacheMisses = 0;
+unsigned long Texture::currentFrame = 0;
 
-static bool fiError = false;
+// FreeImage reports errors through one global callback, so route messages to
+// whichever decode is running on the calling thread.
+static thread_local std::string* decodeErrorOutput = NULL;
 
 void fiMessageFunction(FREE_IMAGE_FORMAT fif, const char *msg) {
-  std::cerr << (int)fif << ": " << msg << std::endl;
-  fiError = true;
+  if (decodeErrorOutput != NULL) {
+    if (!decodeErrorOutput->empty()) {
+      *decodeErrorOutput += "; ";
+    }
+    *decodeErrorOutput += msg;
+  } else {
+    std::cerr << (int)fif << ": " << msg << std::endl;
+  }
+}
+
+static bool compareLastUsed(const std::pair<unsigned long, Texture*>& a, const std::pair<unsigned long, Texture*>& b) {
+  return a.first < b.first;
 }
 
 void Texture::initialize() {
   FreeImage_SetOutputMessage(fiMessageFunction);
+  if (decodePool == NULL) {
+    decodePool = new WorkerPool();
+    std::cout << "Decoding textures with " << decodePool->getNumThreads() << " threads" << std::endl;
+  }
 }
 
-Texture* Texture::loadOrGet(std::string fname, bool useMipmaps) {
-  if (loadedTextures.find(fname) != loadedTextures.end()) {
-    return loadedTextures[fname];
-  }
+bool Texture::decodeFile(const std::string& fname, DecodedImage* image) {
+  decodeErrorOutput = &image->error;
 
   FIBITMAP* bitmap = FreeImage_Load(FreeImage_GetFileType(fname.c_str(), 0), fname.c_str());
-  FIBITMAP *pImage = FreeImage_ConvertTo24Bits(bitmap);
-
-  const int texWidth = FreeImage_GetWidth(bitmap);
-  const int texHeight = FreeImage_GetHeight(bitmap);
+  FIBITMAP* pImage = NULL;
+  if (bitmap != NULL) {
+    pImage = FreeImage_ConvertTo24Bits(bitmap);
+    FreeImage_Unload(bitmap);
+  }
 
-  /*
-  //unsigned char raw[32*texWidth*texHeight];
-  BYTE* raw = (BYTE*)malloc(32*texWidth*texHeight*sizeof(BYTE));
-  FreeImage_ConvertToRawBits(raw, pImage, texWidth*texHeight, 32, 1, 1, 1, false);
-  */
+  decodeErrorOutput = NULL;
 
-  Texture* texture = new Texture(fname, texWidth, texHeight, (void*) FreeImage_GetBits(pImage), useMipmaps);
+  if (pImage == NULL || !image->error.empty()) {
+    if (pImage != NULL) {
+      FreeImage_Unload(pImage);
+    }
+    if (image->error.empty()) {
+      image->error = "could not decode file";
+    }
+    return false;
+  }
 
-  //free(raw);
+  image->width = FreeImage_GetWidth(pImage);
+  image->height = FreeImage_GetHeight(pImage);
+  image->level = 0;
+  // FreeImage pads rows to 4 bytes, same as the default GL_UNPACK_ALIGNMENT.
+  size_t numBytes = FreeImage_GetPitch(pImage) * image->height;
+  image->pixels.resize(numBytes);
+  memcpy(&image->pixels[0], FreeImage_GetBits(pImage), numBytes);
   FreeImage_Unload(pImage);
-  FreeImage_Unload(bitmap);
+  return true;
+}
+
+// Box filter down to the next mip level.
+void Texture::halveImage(DecodedImage* image) {
+  const int newWidth = std::max(1, image->width / 2);
+  const int newHeight = std::max(1, image->height / 2);
+  const int pitch = (3 * image->width + 3) & ~3;
+  const int newPitch = (3 * newWidth + 3) & ~3;
+
+  std::vector<unsigned char> pixels(newPitch * newHeight);
+  for (int y = 0; y < newHeight; y++) {
+    const int y0 = std::min(2 * y, image->height - 1);
+    const int y1 = std::min(2 * y + 1, image->height - 1);
+    for (int x = 0; x < newWidth; x++) {
+      const int x0 = std::min(2 * x, image->width - 1);
+      const int x1 = std::min(2 * x + 1, image->width - 1);
+      for (int c = 0; c < 3; c++) {
+        int sum = image->pixels[y0 * pitch + 3 * x0 + c]
+          + image->pixels[y0 * pitch + 3 * x1 + c]
+          + image->pixels[y1 * pitch + 3 * x0 + c]
+          + image->pixels[y1 * pitch + 3 * x1 + c];
+        pixels[y * newPitch + 3 * x + c] = (unsigned char) ((sum + 2) / 4);
+      }
+    }
+  }
 
-  if (fiError) {
-    fiError = false;
-    return 0;
+  image->pixels.swap(pixels);
+  image->width = newWidth;
+  image->height = newHeight;
+  image->level++;
+}
+
+Texture* Texture::loadOrGet(std::string fname, bool useMipmaps) {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+
+  std::map<std::string, Texture*>::iterator existing = loadedTextures.find(fname);
+  if (existing != loadedTextures.end()) {
+    cacheHits++;
+    return existing->second;
   }
+  cacheMisses++;
 
+  // Register before decoding so other requests for this file share the decode.
+  Texture* texture = new Texture(fname, useMipmaps);
   loadedTextures[fname] = texture;
-  std::cout << "Loaded Texture " << fname << std::endl;
+  texture->status = PENDING;
+  texture->requestDecode(TEXTURE_STREAMING_INITIAL_LEVEL);
 
   return texture;
 }
 
+int Texture::finishPendingLoads() {
+  std::unique_lock<std::mutex> lock(cacheMutex);
+  int numFailed = 0;
+  for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+    Texture* texture = it->second;
+    texture->waitForDecode(lock);
+    if (texture->status == DECODED) {
+      texture->uploadDecoded();
+    }
+    if (texture->status == FAILED) {
+      numFailed++;
+    }
+  }
+  enforceBudget(false);
+  return numFailed;
+}
+
 void Texture::freeLoadedTextures() {
+  std::unique_lock<std::mutex> lock(cacheMutex);
   for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+    it->second->waitForDecode(lock);
     delete it->second;
   }
   loadedTextures.clear();
+  residentBytes = 0;
 }
 
-Texture::Texture(std::string fname, int width, int height, void* data, bool useMipmaps): name(fname), width(width), height(height) {
-  texId = 0;
-  glGenTextures(1, &texId);
-  glBindTexture(GL_TEXTURE_2D, texId);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, useMipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  // Note: Assuming texture was BGR.
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-  if (useMipmaps) {
-    glGenerateMipmap(GL_TEXTURE_2D);
+void Texture::shutdown() {
+  freeLoadedTextures();
+  // Joins the workers, which are idle once no decode is in flight.
+  delete decodePool;
+  decodePool = NULL;
+}
+
+void Texture::setMemoryBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  memoryBudget = bytes;
+  enforceBudget(true);
+}
+
+size_t Texture::getMemoryBudget() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return memoryBudget;
+}
+
+size_t Texture::getResidentBytes() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return residentBytes;
+}
+
+unsigned long Texture::getCacheHits() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return cacheHits;
+}
+
+unsigned long Texture::getCacheMisses() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return cacheMisses;
+}
+
+void Texture::printCacheStats() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  unsigned long lookups = cacheHits + cacheMisses;
+  double hitRate = lookups == 0 ? 1.0 : (double) cacheHits / lookups;
+  std::cout << "Textures: " << residentBytes / (1024 * 1024) << "MB resident / "
+            << memoryBudget / (1024 * 1024) << "MB budget, "
+            << cacheHits << " hits, " << cacheMisses << " misses ("
+            << hitRate * 100.0 << "% hit rate)" << std::endl;
+}
+
+void Texture::endFrame() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+    it->second->updateStreaming();
+  }
+  enforceBudget(false);
+  currentFrame++;
+}
+
+void Texture::enforceBudget(bool keepCurrentFrame) {
+  if (residentBytes <= memoryBudget) {
+    return;
+  }
+
+  // Least recently used first.
+  std::vector<std::pair<unsigned long, Texture*> > candidates;
+  for (std::map<std::string, Texture*>::iterator it = loadedTextures.begin(); it != loadedTextures.end(); it++) {
+    Texture* texture = it->second;
+    if (texture->status != RESIDENT) continue;
+    // Textures used this frame may still be bound for drawing.
+    if (keepCurrentFrame && texture->lastUsedFrame >= currentFrame) continue;
+    candidates.push_back(std::make_pair(texture->lastUsedFrame, texture));
+  }
+  std::sort(candidates.begin(), candidates.end(), compareLastUsed);
+
+  for (unsigned int i = 0; i < candidates.size() && residentBytes > memoryBudget; i++) {
+    std::cout << "Evicting Texture " << candidates[i].second->name << std::endl;
+    candidates[i].second->evict();
+  }
+}
+
+void Texture::requestDecode(int level) {
+  decodeInFlight = true;
+  decodeLevel = level;
+  loadError = "";
+  decodePool->submit(std::bind(&Texture::decodeJob, this));
+}
+
+// Runs on the worker pool, without cacheMutex.
+void Texture::decodeJob() {
+  int level;
+  {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    level = decodeLevel;
   }
+
+  DecodedImage* image = new DecodedImage();
+  bool ok = decodeFile(name, image);
+  const int fullWidth = image->width;
+  const int fullHeight = image->height;
+  while (ok && image->level < level && (image->width > 1 || image->height > 1)) {
+    halveImage(image);
+  }
+
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  decodeInFlight = false;
+  if (ok) {
+    width = fullWidth;
+    height = fullHeight;
+  }
+  if (!ok) {
+    loadError = image->error;
+    delete image;
+    if (status == PENDING) {
+      status = FAILED;
+    }
+    std::cerr << "Failed to load texture " << name << ": " << loadError << std::endl;
+  } else if (status == EVICTED) {
+    // Evicted while streaming, reloads on next use.
+    delete image;
+  } else {
+    delete decoded;
+    decoded = image;
+    if (status == PENDING) {
+      status = DECODED;
+    }
+  }
+  decodeFinished.notify_all();
+}
+
+void Texture::waitForDecode(std::unique_lock<std::mutex>& lock) {
+  while (decodeInFlight) {
+    decodeFinished.wait(lock);
+  }
+}
+
+void Texture::uploadDecoded() {
+  // Replacing a streamed texture.
+  if (texId != 0) {
+    gl::DeleteTextures(1, &texId);
+    texId = 0;
+    residentBytes -= sizeBytes;
+  }
+
+  upload(decoded->width, decoded->height, &decoded->pixels[0]);
+  residentLevel = decoded->level;
+  delete decoded;
+  decoded = NULL;
+
+  status = RESIDENT;
+  residentBytes += sizeBytes;
+  std::cout << "Loaded Texture " << name << " at mip level " << residentLevel << std::endl;
+
+  enforceBudget(true);
+}
+
+void Texture::updateStreaming() {
+  // Finished decoding a different level.
+  if (status == RESIDENT && decoded != NULL) {
+    uploadDecoded();
+  }
+
+  const int wantedLevel = requestedLevel;
+  requestedLevel = INT_MAX;
+  if (status != RESIDENT || decodeInFlight || wantedLevel == INT_MAX) {
+    return;
+  }
+
+  const int clampedLevel = std::min(wantedLevel, getNumLevels() - 1);
+  if (clampedLevel < residentLevel) {
+    // Stream in finer levels straight away.
+    requestDecode(clampedLevel);
+    framesOverResident = 0;
+    recentFinestLevel = INT_MAX;
+  } else if (clampedLevel > residentLevel) {
+    // Only drop fine levels once they've gone unused for a while.
+    recentFinestLevel = std::min(recentFinestLevel, clampedLevel);
+    if (++framesOverResident > TEXTURE_STREAMING_DROP_FRAMES) {
+      requestDecode(recentFinestLevel);
+      framesOverResident = 0;
+      recentFinestLevel = INT_MAX;
+    }
+  } else {
+    framesOverResident = 0;
+    recentFinestLevel = INT_MAX;
+  }
+}
+
+int Texture::getNumLevels() {
+  int levels = 1;
+  int size = std::max(width.load(), height.load());
+  while (size > 1) {
+    size /= 2;
+    levels++;
+  }
+  return levels;
+}
+
+void Texture::touch() {
+  // Only the first use each frame counts, later draws of a resident texture
+  // skip the lock. texId and currentFrame only change on the GL thread.
+  if (touchedFrame == currentFrame && texId != 0) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(cacheMutex);
+  touchedFrame = currentFrame;
+  lastUsedFrame = currentFrame;
+  if (status == RESIDENT) {
+    cacheHits++;
+    return;
+  }
+
+  // Reload on demand.
+  if (status == EVICTED) {
+    cacheMisses++;
+    status = PENDING;
+    if (!decodeInFlight) {
+      requestDecode(residentLevel);
+    }
+  }
+  waitForDecode(lock);
+  if (status == DECODED) {
+    uploadDecoded();
+  }
+}
+
+bool Texture::isValid() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return status != FAILED;
+}
+
+Texture::Status Texture::getStatus() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return status;
+}
+
+std::string Texture::getLoadError() {
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  return loadError;
+}
+
+Texture::Texture(std::string fname, bool useMipmaps)
+  : texId(0), name(fname), width(0), height(0), useMipmaps(useMipmaps), cached(true), sizeBytes(0), lastUsedFrame(0), touchedFrame(ULONG_MAX), status(PENDING), decoded(NULL), decodeInFlight(false), decodeLevel(0),
+    residentLevel(0), requestedLevel(INT_MAX), recentFinestLevel(INT_MAX), framesOverResident(0) {}
+
+Texture::Texture(std::string fname, int width, int height, void* data, bool useMipmaps)
+  : texId(0), name(fname), width(width), height(height), useMipmaps(useMipmaps), cached(false), sizeBytes(0), lastUsedFrame(0), touchedFrame(ULONG_MAX), status(RESIDENT), decoded(NULL), decodeInFlight(false), decodeLevel(0),
+    residentLevel(0), requestedLevel(INT_MAX), recentFinestLevel(INT_MAX), framesOverResident(0) {
+  upload(width, height, data);
 }
 
-Texture::Texture(GLuint texId, int width, int height): texId(texId), name(""), width(width), height(height) {}
+Texture::Texture(GLuint texId, int width, int height)
+  : texId(texId), name(""), width(width), height(height), useMipmaps(false), cached(false), sizeBytes(0), lastUsedFrame(0), touchedFrame(ULONG_MAX), status(RESIDENT), decoded(NULL), decodeInFlight(false), decodeLevel(0),
+    residentLevel(0), requestedLevel(INT_MAX), recentFinestLevel(INT_MAX), framesOverResident(0) {}
 
 Texture::~Texture() {
-  glDeleteTextures(1, &texId);
+  gl::DeleteTextures(1, &texId);
+  shaders::Shader::invalidateTextureBindings();
+  delete decoded;
+}
+
+void Texture::upload(int width, int height, void* data) {
+  gl::GenTextures(1, &texId);
+  // Bypasses the shader texture unit cache, and may reuse a deleted id.
+  shaders::Shader::invalidateTextureBindings();
+  gl::BindTexture(GL_TEXTURE_2D, texId);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, useMipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // Note: Assuming texture was BGR.
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
+  if (useMipmaps) {
+    gl::GenerateMipmap(GL_TEXTURE_2D);
+  }
+
+  // Drivers pad RGB8 texels to 4 bytes.
+  sizeBytes = 0;
+  int levelWidth = width;
+  int levelHeight = height;
+  while (true) {
+    sizeBytes += 4 * levelWidth * levelHeight;
+    if (!useMipmaps || (levelWidth == 1 && levelHeight == 1)) break;
+    levelWidth = std::max(1, levelWidth / 2);
+    levelHeight = std::max(1, levelHeight / 2);
+  }
+}
+
+void Texture::evict() {
+  gl::DeleteTextures(1, &texId);
+  shaders::Shader::invalidateTextureBindings();
+  texId = 0;
+  delete decoded;
+  decoded = NULL;
+  residentBytes -= sizeBytes;
+  status = EVICTED;
 }
 
 void Texture::saveTextureToFile(unsigned char* pixels, int width, int height, std::string filename) {
@@ -81,4 +450,3 @@ void Texture::saveTextureToFile(unsigned char* pixels, int width, int height, st
   FreeImage_Save(FIF_PNG, img, filename.c_str(), 0);
   FreeImage_Unload(img);
 }
-
@@ -5,30 +5,177 @@
 #include <GL/gl.h>
 #include <map>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+// Default GPU memory budget for textures loaded from files.
+#define DEFAULT_TEXTURE_MEMORY_BUDGET (256 * 1024 * 1024)
+// Mip level cached textures are first uploaded at, before any demand is known.
+#define TEXTURE_STREAMING_INITIAL_LEVEL 4
+// Frames a texture has to be finer than needed before its fine mips are dropped.
+#define TEXTURE_STREAMING_DROP_FRAMES 120
+
+class WorkerPool;
 
 class Texture {
 public:
+  enum Status {
+    PENDING,  // Decode in flight on the worker pool.
+    DECODED,  // Pixels decoded, waiting for upload on the GL thread.
+    RESIDENT,
+    EVICTED,
+    FAILED
+  };
+
   static void initialize();
+
+  /**
+   * Safe to call from any thread. Decoding is done on the worker pool and
+   * concurrent requests for the same file share one decode. The GL upload
+   * happens on the GL thread on first use or in finishPendingLoads().
+   */
   static Texture* loadOrGet(std::string fname, bool useMipmaps);
+
+  /**
+   * Wait for all in-flight decodes and upload them. GL thread only.
+   * Returns the number of textures that failed to load.
+   */
+  static int finishPendingLoads();
   static void freeLoadedTextures();
+  // Frees the cached textures and stops the decode workers. GL thread only.
+  static void shutdown();
+
+  /**
+   * Cached textures are evicted least-recently-used first once their
+   * resident bytes exceed the budget, and reloaded on their next use.
+   */
+  static void setMemoryBudget(size_t bytes);
+  static size_t getMemoryBudget();
+  static size_t getResidentBytes();
+  // Lookups, plus each texture's first use in a frame.
+  static unsigned long getCacheHits();
+  static unsigned long getCacheMisses();
+  static void printCacheStats();
+
+  /**
+   * Call once per frame after drawing. Streams mip levels according to this
+   * frame's requests, then evicts textures that weren't used this frame until
+   * the budget is met.
+   */
+  static void endFrame();
 
   Texture(std::string fname, int width, int height, void* data, bool useMipmaps);
   Texture(GLuint texId, int width, int height);
   ~Texture();
 
   GLuint getTextureId() {
+    if (cached) {
+      touch();
+    }
     return texId;
   }
 
+  bool isResident() {
+    return texId != 0;
+  }
+
+  /**
+   * Mip streaming: report the finest mip level a draw needs this frame. Only
+   * that level and coarser ones are kept resident. GL thread only.
+   */
+  void requestLevel(int level) {
+    if (level < requestedLevel) {
+      requestedLevel = level;
+    }
+  }
+
+  int getResidentLevel() {
+    return residentLevel;
+  }
+
+  int getNumLevels();
+
+  int getWidth() {
+    return width;
+  }
+
+  int getHeight() {
+    return height;
+  }
+
+  // False once loading has failed.
+  bool isValid();
+  Status getStatus();
+  std::string getLoadError();
+
+  size_t getSizeBytes() {
+    return sizeBytes;
+  }
+
   static void saveTextureToFile(unsigned char* pixels, int width, int height, std::string filename);
 
 private:
+  struct DecodedImage {
+    std::vector<unsigned char> pixels; // BGR, rows 4 byte aligned.
+    int width;
+    int height;
+    int level; // Mip level of the full image these pixels are.
+    std::string error;
+
+    DecodedImage(): width(0), height(0), level(0) {}
+  };
+
   static std::map<std::string, Texture*> loadedTextures;
+  static std::mutex cacheMutex;
+  static std::condition_variable decodeFinished;
+  static WorkerPool* decodePool;
+  static size_t memoryBudget;
+  static size_t residentBytes;
+  static unsigned long cacheHits;
+  static unsigned long cacheMisses;
+  static unsigned long currentFrame;
+
+  static bool decodeFile(const std::string& fname, DecodedImage* image);
+  static void halveImage(DecodedImage* image);
+  static void enforceBudget(bool keepCurrentFrame);
+
+  Texture(std::string fname, bool useMipmaps);
+
+  void decodeJob();
+
+  // These expect cacheMutex to be held.
+  void requestDecode(int level);
+  void waitForDecode(std::unique_lock<std::mutex>& lock);
+  void uploadDecoded();
+  void upload(int width, int height, void* data);
+  void updateStreaming();
+  void evict();
+
+  void touch();
 
   GLuint texId;
   std::string name;
-  int width;
-  int height;
+  // Full resolution, not necessarily resident. Set by the decode workers
+  // and read by the renderer without cacheMutex.
+  std::atomic<int> width;
+  std::atomic<int> height;
+  bool useMipmaps;
+  bool cached;
+  size_t sizeBytes;
+  unsigned long lastUsedFrame;
+  unsigned long touchedFrame; // Frame of the last use, GL thread only.
+  Status status;
+  DecodedImage* decoded;
+  bool decodeInFlight;
+  int decodeLevel;
+  std::string loadError;
+
+  int residentLevel;
+  int requestedLevel;
+  int recentFinestLevel;
+  int framesOverResident;
 };
 
 #endif
@@ -5,12 +5,17 @@
 #include <iomanip>
 #include <ctime>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "gl_backend.hpp"
 #include "texture.hpp"
 #include "shader.hpp"
+#include "render_state.hpp"
 #include "mesh.hpp"
 #include "mirror.hpp"
 #include "sound.hpp"
@@ -21,11 +26,17 @@
 #define MIN_REQUIRED_COLOUR_ATTACHMENTS 6
 #define RENDER_DEBUG_IMAGES false
 #define RENDER_LIGHTS_AS_SPHERES false
-#define SHADOWMAP_WIDTH 2048
-#define SHADOWMAP_HEIGHT 2048
+#define SHADOW_ATLAS_SIZE 4096
+#define SPOT_SHADOW_FAR_PLANE 100.0f
 #define TARGET_FPS 60
 #define TARGET_FRAME_DELTA 0.01666667
 #define FPS_SAMPLE_RATE 20
+// Surfaces closer than this always get the base mip level.
+#define MIP_STREAMING_PIN_DISTANCE 2.0f
+// Settings each kind of lighting pass depends on.
+#define BASE_PASS_SETTINGS (shaders::DEFERRED_DIFFUSE | shaders::DEFERRED_SSAO)
+#define TILED_PASS_SETTINGS (shaders::DEFERRED_DIFFUSE | shaders::DEFERRED_SPECULAR)
+#define LIGHT_PASS_SETTINGS (shaders::DEFERRED_DIFFUSE | shaders::DEFERRED_SPECULAR | shaders::DEFERRED_SHADOW)
 
 void window_size_callback(GLFWwindow* window, int width, int height) {
   Viewer* viewer = (Viewer*)glfwGetWindowUserPointer(window);
@@ -41,7 +52,7 @@ void window_focus_callback(GLFWwindow* window, int focused) {
 }
 
 bool checkGLErrors(std::string msg) {
-  GLenum error = glGetError();
+  GLenum error = gl::GetError();
   if (error != GL_NO_ERROR) {
     std::cerr << "OpenGL error " << msg << ": " << error << " - " << glewGetErrorString(error) << std::endl;
     return false;
@@ -50,7 +61,7 @@ bool checkGLErrors(std::string msg) {
 }
 
 bool checkGLFramebuffer() {
-  GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  GLenum frameBufferStatus = gl::CheckFramebufferStatus(GL_FRAMEBUFFER);
   if(frameBufferStatus != GL_FRAMEBUFFER_COMPLETE) {
     std::cerr << "Framebuffer check failed! " << frameBufferStatus << " = " << glewGetErrorString(frameBufferStatus) << std::endl;
     return false;
@@ -58,7 +69,57 @@ bool checkGLFramebuffer() {
   return true;
 }
 
-Viewer::Viewer(): width(DEFAULT_WIDTH), height(DEFAULT_HEIGHT) {
+// An RG32F texture for variance shadow map moments, with linear filtering.
+GLuint createMomentsTexture(int size, bool mipmapped) {
+  GLuint texture;
+  gl::GenTextures(1, &texture);
+  gl::BindTexture(GL_TEXTURE_2D, texture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, size, size, 0, GL_RG, GL_FLOAT, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  if (mipmapped) {
+    gl::GenerateMipmap(GL_TEXTURE_2D);
+  }
+  return texture;
+}
+
+/**
+ * Whether a sphere swept from one point to another is entirely outside one
+ * of the frustum planes of matrix, which are row 3 plus or minus row 0, 1 or 2.
+ */
+bool outsideFrustum(const glm::mat4& matrix, const glm::vec3& from, const glm::vec3& to, float radius) {
+  for (int plane = 0; plane < 6; plane++) {
+    int row = plane / 2;
+    float sign = plane % 2 == 0 ? 1.0f : -1.0f;
+    glm::vec3 normal(
+      matrix[0][3] + sign * matrix[0][row],
+      matrix[1][3] + sign * matrix[1][row],
+      matrix[2][3] + sign * matrix[2][row]);
+    float distance = matrix[3][3] + sign * matrix[3][row];
+    float limit = -radius * glm::length(normal);
+    if (glm::dot(normal, from) + distance < limit && glm::dot(normal, to) + distance < limit) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Viewer::Viewer(bool headless)
+  : width(DEFAULT_WIDTH), height(DEFAULT_HEIGHT), headless(headless), window(NULL),
+    settings(NULL), controller(NULL), thunderSound(NULL), backgroundMusic(NULL), getItemSound(NULL),
+    staticGeometryVersion(0), shadowFrame(0), shadowFrameTime(-1), shadowTexels(0),
+    geomTexturesPrograms(shaders::geomTexturesDefines, shaders::numGeomTexturesDefines),
+    deferredShadingPrograms(shaders::deferredShadingDefines, shaders::numDeferredShadingDefines),
+    viewBlock(shaders::VIEW_BLOCK_BINDING),
+    lightBlock(shaders::LIGHT_BLOCK_BINDING), uploadedLightBatch(0), materialBlock(shaders::MATERIAL_BLOCK_BINDING),
+    cubeShadowArray(false), shadowCubeArrayTexture(0),
+    varianceSize(0), varianceMomentsTexture(0), varianceBlurTexture(0), varianceDepthRenderbuffer(0), varianceFramebuffer(0) {
+
+  if (headless) {
+    return;
+  }
 
   glfwWindowHint(GLFW_SAMPLES, 4);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -89,30 +150,36 @@ void Viewer::updateSize(int width, int height) {
   this->width = width;
   this->height = height;
 
-  glBindTexture(GL_TEXTURE_2D, deferredDiffuseTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, deferredDiffuseTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
 
-  glBindTexture(GL_TEXTURE_2D, deferredSpecularTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, deferredSpecularTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_FLOAT, 0);
 
-  glBindTexture(GL_TEXTURE_2D, deferredEmissiveTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, deferredEmissiveTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
 
-  glBindTexture(GL_TEXTURE_2D, deferredNormalTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, deferredNormalTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
 
-  glBindTexture(GL_TEXTURE_2D, pickingTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, width, height, 0, GL_RED, GL_INT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, pickingTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_R16, width, height, 0, GL_RED, GL_INT, 0);
 
-  glBindTexture(GL_TEXTURE_2D, deferredDepthTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, deferredDepthTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH32F_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_FLOAT_32_UNSIGNED_INT_24_8_REV, 0);
 
-  glBindTexture(GL_TEXTURE_2D, accumRenderTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::BindTexture(GL_TEXTURE_2D, accumRenderTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+
+  tilesX = (width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+  tilesY = (height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+  lightTileMasks.resize(tilesX * tilesY * 2);
+  gl::BindTexture(GL_TEXTURE_2D, lightTileTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, tilesX, tilesY, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, 0);
 
   for (int i = 0; i < 2; i++) {
-    glBindRenderbuffer(GL_RENDERBUFFER, depthRenderBuffers[0]);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+    gl::BindRenderbuffer(GL_RENDERBUFFER, depthRenderBuffers[0]);
+    gl::RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH32F_STENCIL8, width, height);
   }
 
   // Update Mirror textures, which are of screen size.
@@ -122,6 +189,8 @@ void Viewer::updateSize(int width, int height) {
     Mirror* mirror = static_cast<Mirror*>(material);
     mirror->updateSize(width, height);
   }
+
+  shaders::Shader::invalidateTextureBindings();
 }
 
 bool Viewer::initializeSound() {
@@ -157,23 +226,125 @@ bool Viewer::initializeSound() {
 }
 
 bool Viewer::initializeShaders() {
-  // Compile GLSL programs.
-  if (!geomTexturesProgram.initialize()) return false;
-  if (!quadProgram.initialize()) return false;
-  if (!deferredShadingProgram.initialize()) return false;
-  if (!deferredShadingProgram.initialize()) return false;
-  if (!depthProgram.initialize()) return false;
-  if (!postProcessProgram.initialize()) return false;
+  shaders::Shader::initializeCompiler();
+  cubeShadowArray = GLEW_ARB_texture_cube_map_array;
+  std::cout << "Shadow cube map array " << (cubeShadowArray ? "enabled" : "not supported") << std::endl;
+
+  // Submit GLSL programs. Their status is only checked in finishShaders(),
+  // so the driver compiles them while the scene loads.
+  if (!quadProgram.submit()) return false;
+  if (!depthProgram.submit()) return false;
+  if (!cubeDepthProgram.submit()) return false;
+  if (!paraboloidDepthProgram.submit()) return false;
+  if (!depthMomentsProgram.submit()) return false;
+  if (!varianceBlurProgram.submit()) return false;
+  if (!postProcessProgram.submit()) return false;
+
+  // Default permutations are needed on the first frame.
+  geomTexturesPrograms.submit(shaders::GEOM_DIFFUSE_TEXTURE | shaders::GEOM_NORMAL_TEXTURE);
+  geomTexturesPrograms.submit(0);
+  std::vector<unsigned int> shadingKeys = defaultShadingKeys();
+  for (unsigned int i = 0; i < shadingKeys.size(); i++) {
+    deferredShadingPrograms.submit(shadingKeys[i]);
+  }
+
+  // The rest are only used once a setting is toggled. Compile them in the
+  // background if the driver can, otherwise each one costs a hitch on first
+  // use, which beats stalling every frame until they're all built.
+  if (shaders::Shader::isParallelCompileSupported()) {
+    prefetchShaders();
+  }
+
+  viewBlock.initialize();
+  lightBlock.initialize();
+  materialBlock.initialize();
+  return true;
+}
+
+void Viewer::prefetchShaders() {
+  for (unsigned int key = 0; key < shaders::GEOM_NUM_PERMUTATIONS; key++) {
+    geomTexturesPrograms.prefetch(key);
+  }
+  unsigned int allSettings = shaders::DEFERRED_DIFFUSE | shaders::DEFERRED_SPECULAR | shaders::DEFERRED_SHADOW | shaders::DEFERRED_SSAO;
+  unsigned int lightTypes[] = {shaders::DEFERRED_DIRECTIONAL_LIGHT, shaders::DEFERRED_SPOT_LIGHT, shaders::DEFERRED_POINT_LIGHT};
+  for (unsigned int settingsKey = 0; settingsKey <= allSettings; settingsKey++) {
+    if ((settingsKey & ~BASE_PASS_SETTINGS) == 0) {
+      deferredShadingPrograms.prefetch(settingsKey | shaders::DEFERRED_BASE_PASS);
+    }
+    if ((settingsKey & ~TILED_PASS_SETTINGS) == 0) {
+      deferredShadingPrograms.prefetch(settingsKey | shaders::DEFERRED_TILED_LIGHTS);
+      if (cubeShadowArray) {
+        deferredShadingPrograms.prefetch(settingsKey | shaders::DEFERRED_TILED_LIGHTS | shaders::DEFERRED_SHADOW_CUBE_ARRAY);
+      }
+    }
+    if ((settingsKey & ~LIGHT_PASS_SETTINGS) != 0) continue;
+    for (unsigned int i = 0; i < sizeof(lightTypes) / sizeof(lightTypes[0]); i++) {
+      deferredShadingPrograms.prefetch(settingsKey | lightTypes[i]);
+      if (lightTypes[i] != shaders::DEFERRED_DIRECTIONAL_LIGHT) {
+        deferredShadingPrograms.prefetch(settingsKey | lightTypes[i] | shaders::DEFERRED_LIGHT_VOLUME);
+      }
+    }
+    if (settingsKey & shaders::DEFERRED_SHADOW) {
+      unsigned int paraboloidKey = settingsKey | shaders::DEFERRED_POINT_LIGHT | shaders::DEFERRED_PARABOLOID_SHADOW;
+      deferredShadingPrograms.prefetch(paraboloidKey);
+      deferredShadingPrograms.prefetch(paraboloidKey | shaders::DEFERRED_LIGHT_VOLUME);
+      unsigned int varianceKey = settingsKey | shaders::DEFERRED_SPOT_LIGHT | shaders::DEFERRED_VARIANCE_SHADOW;
+      deferredShadingPrograms.prefetch(varianceKey);
+      deferredShadingPrograms.prefetch(varianceKey | shaders::DEFERRED_LIGHT_VOLUME);
+    }
+  }
+}
+
+std::vector<unsigned int> Viewer::defaultShadingKeys() {
+  std::vector<unsigned int> keys;
+  keys.push_back(BASE_PASS_SETTINGS | shaders::DEFERRED_BASE_PASS);
+  keys.push_back(TILED_PASS_SETTINGS | shaders::DEFERRED_TILED_LIGHTS);
+  if (cubeShadowArray) {
+    keys.push_back(TILED_PASS_SETTINGS | shaders::DEFERRED_TILED_LIGHTS | shaders::DEFERRED_SHADOW_CUBE_ARRAY);
+  }
+  keys.push_back(LIGHT_PASS_SETTINGS | shaders::DEFERRED_DIRECTIONAL_LIGHT);
+  keys.push_back(LIGHT_PASS_SETTINGS | shaders::DEFERRED_SPOT_LIGHT);
+  keys.push_back(LIGHT_PASS_SETTINGS | shaders::DEFERRED_SPOT_LIGHT | shaders::DEFERRED_LIGHT_VOLUME);
+  keys.push_back(LIGHT_PASS_SETTINGS | shaders::DEFERRED_POINT_LIGHT);
+  keys.push_back(LIGHT_PASS_SETTINGS | shaders::DEFERRED_POINT_LIGHT | shaders::DEFERRED_LIGHT_VOLUME);
+  return keys;
+}
+
+bool Viewer::finishShaders() {
+  if (!depthProgram.finish()) return false;
+  if (!cubeDepthProgram.finish()) return false;
+  if (!paraboloidDepthProgram.finish()) return false;
+  if (!depthMomentsProgram.finish()) return false;
+  if (!varianceBlurProgram.finish()) return false;
+  if (!postProcessProgram.finish()) return false;
+
+  // Catch broken shaders at startup.
+  if (geomTexturesPrograms.get(shaders::GEOM_DIFFUSE_TEXTURE | shaders::GEOM_NORMAL_TEXTURE) == NULL) return false;
+  if (geomTexturesPrograms.get(0) == NULL) return false;
+  std::vector<unsigned int> shadingKeys = defaultShadingKeys();
+  for (unsigned int i = 0; i < shadingKeys.size(); i++) {
+    if (deferredShadingPrograms.get(shadingKeys[i]) == NULL) return false;
+  }
   return true;
 }
 
+void Viewer::updateShaders() {
+  geomTexturesPrograms.update();
+  deferredShadingPrograms.update();
+  if (!quadProgram.isFinished() && quadProgram.isReady()) {
+    quadProgram.finish();
+  }
+}
+
 bool Viewer::initialize() {
-  if (!initializeSound()) {
+  if (!headless && !initializeSound()) {
     return false;
   }
 
   settings = new Settings();
-  controller = new Controller(this, settings);
+  if (!headless) {
+    controller = new Controller(this, settings);
+  }
   startCharAnimTime = 0;
 
   // Initial settings (all start on).
@@ -181,20 +352,22 @@ bool Viewer::initialize() {
   settings->set(Settings::BLUR, true);
   settings->set(Settings::HIGHLIGHT_PICK, false);
 
-  glfwMakeContextCurrent(window);
+  if (!headless) {
+    glfwMakeContextCurrent(window);
 
-  // Initialize GLEW
-  glewExperimental = true; // Needed for core profile
-  if (glewInit() != GLEW_OK) {
-    std::cerr << "Failed to initialize GLEW" << std::endl;
-    return false;
+    // Initialize GLEW
+    glewExperimental = true; // Needed for core profile
+    if (glewInit() != GLEW_OK) {
+      std::cerr << "Failed to initialize GLEW" << std::endl;
+      return false;
+    }
   }
 
   // Ignore invalid enum error from glew call.
-  glGetError();
+  gl::GetError();
 
   GLint maxAttachments;
-  glGetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &maxAttachments);
+  gl::GetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &maxAttachments);
   if (maxAttachments < MIN_REQUIRED_COLOUR_ATTACHMENTS) {
     std::cerr << "Only " << maxAttachments << " supported FBO Colour Attachments, but this program requires " << MIN_REQUIRED_COLOUR_ATTACHMENTS << std::endl;
   }
@@ -206,8 +379,8 @@ bool Viewer::initialize() {
   // Initialize textures.
   Texture::initialize();
 
-  glGenVertexArrays(1, &vertexArrayId);
-  glBindVertexArray(vertexArrayId);
+  gl::GenVertexArrays(1, &vertexArrayId);
+  gl::BindVertexArray(vertexArrayId);
 
   meshes = loadScene("models/shadowhouse_large.obj", false);
   std::vector<Mesh*> pointLightMeshes = loadScene("models/sphere.obj", false);
@@ -216,11 +389,15 @@ bool Viewer::initialize() {
     fname << "models/minecraft_rigs/steve_animate_";
     fname << std::setfill('0') << std::setw(6) << i << ".obj";
     characterMeshes.push_back(loadScene(fname.str()));
+    for (std::vector<Mesh*>::iterator it = characterMeshes.back().begin(); it != characterMeshes.back().end(); it++) {
+      (*it)->setDynamic(true);
+    }
   }
 
   flashlightMeshes = loadScene("models/flashlight.obj");
   for (std::vector<Mesh*>::iterator it = flashlightMeshes.begin(); it != flashlightMeshes.end(); it++) {
     Mesh* mesh = *it;
+    // Items stay put until picked up, so their shadows can be cached with the level's.
     mesh->getModelMatrix() = glm::rotate(glm::translate(glm::mat4(1.0), glm::vec3(21, 2, -11)), 180.0f, glm::vec3(0, 1, 0));
   }
   meshes.insert(meshes.end(), flashlightMeshes.begin(), flashlightMeshes.end());
@@ -232,6 +409,17 @@ bool Viewer::initialize() {
   }
   meshes.insert(meshes.end(), gunMeshes.begin(), gunMeshes.end());
 
+  // Textures were decoding in the background while meshes loaded.
+  int numFailedTextures = Texture::finishPendingLoads();
+  if (numFailedTextures > 0) {
+    std::cerr << numFailedTextures << " textures failed to load" << std::endl;
+  }
+
+  // Shaders were compiling in the meantime as well.
+  if (!finishShaders()) {
+    return false;
+  }
+
   if (pointLightMeshes.size() == 1) {
     pointLightMesh = pointLightMeshes[0];
     pointLightMesh->getModelMatrix() = glm::scale(glm::mat4(1.0), glm::vec3(0.1, 0.1, 0.1));
@@ -242,136 +430,130 @@ bool Viewer::initialize() {
 
   // Framebuffer for deferred shading.
   deferredShadingFramebuffer = 0;
-  glGenFramebuffers(1, &deferredShadingFramebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, deferredShadingFramebuffer);
+  gl::GenFramebuffers(1, &deferredShadingFramebuffer);
+  gl::BindFramebuffer(GL_FRAMEBUFFER, deferredShadingFramebuffer);
 
   // Deferred rendering texture targets.
-  glGenTextures(1, &deferredDiffuseTexture);
-  glBindTexture(GL_TEXTURE_2D, deferredDiffuseTexture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
-
-  glGenTextures(1, &deferredSpecularTexture);
-  glBindTexture(GL_TEXTURE_2D, deferredSpecularTexture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_FLOAT, 0);
-
-  glGenTextures(1, &deferredEmissiveTexture);
-  glBindTexture(GL_TEXTURE_2D, deferredEmissiveTexture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
-
-  glGenTextures(1, &deferredNormalTexture);
-  glBindTexture(GL_TEXTURE_2D, deferredNormalTexture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::GenTextures(1, &deferredDiffuseTexture);
+  gl::BindTexture(GL_TEXTURE_2D, deferredDiffuseTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
+
+  gl::GenTextures(1, &deferredSpecularTexture);
+  gl::BindTexture(GL_TEXTURE_2D, deferredSpecularTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+
+  gl::GenTextures(1, &deferredEmissiveTexture);
+  gl::BindTexture(GL_TEXTURE_2D, deferredEmissiveTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_FLOAT, 0);
+
+  gl::GenTextures(1, &deferredNormalTexture);
+  gl::BindTexture(GL_TEXTURE_2D, deferredNormalTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
 
   // Picking texture.
-  glGenTextures(1, &pickingTexture);
-  glBindTexture(GL_TEXTURE_2D, pickingTexture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, width, height, 0, GL_RED, GL_INT, 0);
-
-  glGenTextures(1, &deferredDepthTexture);
-  glBindTexture(GL_TEXTURE_2D, deferredDepthTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  gl::GenTextures(1, &pickingTexture);
+  gl::BindTexture(GL_TEXTURE_2D, pickingTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_R16, width, height, 0, GL_RED, GL_INT, 0);
+
+  gl::GenTextures(1, &deferredDepthTexture);
+  gl::BindTexture(GL_TEXTURE_2D, deferredDepthTexture);
+  // Same format as the light accumulation depth buffer, so depth can be blitted over to it.
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH32F_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_FLOAT_32_UNSIGNED_INT_24_8_REV, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
   // This is necessary.
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
-
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, deferredDepthTexture, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, deferredDiffuseTexture, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, deferredSpecularTexture, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, deferredEmissiveTexture, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, deferredNormalTexture, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, pickingTexture, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, deferredDepthTexture, 0);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, deferredDiffuseTexture, 0);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, deferredSpecularTexture, 0);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, deferredEmissiveTexture, 0);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, deferredNormalTexture, 0);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, pickingTexture, 0);
   // Note: Adding here? Make sure to add to glDrawBuffers.
 
   if (!checkGLFramebuffer()) return false;
 
   // Framebuffer for accumulating rendering.
   accumRenderFramebuffer = 0;
-  glGenFramebuffers(1, &accumRenderFramebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, accumRenderFramebuffer);
+  gl::GenFramebuffers(1, &accumRenderFramebuffer);
+  gl::BindFramebuffer(GL_FRAMEBUFFER, accumRenderFramebuffer);
 
   // Main texture for accumulating deferred shading light passes.
-  glGenTextures(1, &accumRenderTexture);
-  glBindTexture(GL_TEXTURE_2D, accumRenderTexture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumRenderTexture, 0);
-
-  // Depth render buffer.
-  glGenRenderbuffers(2, &depthRenderBuffers[0]);
-  glBindRenderbuffer(GL_RENDERBUFFER, depthRenderBuffers[0]);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderBuffers[0]);
+  gl::GenTextures(1, &accumRenderTexture);
+  gl::BindTexture(GL_TEXTURE_2D, accumRenderTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  //gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB16, width, height, 0, GL_RGB, GL_FLOAT, 0);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumRenderTexture, 0);
+
+  // Depth and stencil render buffer, for masking light volumes against the scene's depth.
+  gl::GenRenderbuffers(2, &depthRenderBuffers[0]);
+  gl::BindRenderbuffer(GL_RENDERBUFFER, depthRenderBuffers[0]);
+  gl::RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH32F_STENCIL8, width, height);
+  gl::FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthRenderBuffers[0]);
 
   if (!checkGLFramebuffer()) return false;
 
 
   // SSAO Noise texture.
-  glGenTextures(1, &ssaoNoiseTexture);
-  glBindTexture(GL_TEXTURE_2D, ssaoNoiseTexture);
-  //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, SSAO_NOISE_TEXTURE_WIDTH, SSAO_NOISE_TEXTURE_WIDTH, 0, GL_RGB, GL_FLOAT, 0);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-  //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-
-  // Shadow mapping setup.
+  gl::GenTextures(1, &ssaoNoiseTexture);
+  gl::BindTexture(GL_TEXTURE_2D, ssaoNoiseTexture);
+  //gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, SSAO_NOISE_TEXTURE_WIDTH, SSAO_NOISE_TEXTURE_WIDTH, 0, GL_RGB, GL_FLOAT, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  //gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  //gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+
+  // Light masks for tiled lighting, one texel per screen tile.
+  tilesX = (width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+  tilesY = (height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+  lightTileMasks.resize(tilesX * tilesY * 2);
+  gl::GenTextures(1, &lightTileTexture);
+  gl::BindTexture(GL_TEXTURE_2D, lightTileTexture);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, tilesX, tilesY, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, 0);
+
+  // Shadow mapping setup. Spot and directional lights get regions of one
+  // atlas, see allocateShadowSlots().
   shadowMapFramebuffer = 0;
-  glGenFramebuffers(1, &shadowMapFramebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFramebuffer);
-
-  glGenTextures(1, &shadowmapDepthTexture);
-  glBindTexture(GL_TEXTURE_2D, shadowmapDepthTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, SHADOWMAP_WIDTH, SHADOWMAP_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowmapDepthTexture, 0);
+  gl::GenFramebuffers(1, &shadowMapFramebuffer);
+  gl::BindFramebuffer(GL_FRAMEBUFFER, shadowMapFramebuffer);
+
+  gl::GenTextures(1, &shadowAtlasTexture);
+  gl::BindTexture(GL_TEXTURE_2D, shadowAtlasTexture);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+  gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowAtlasTexture, 0);
 
   if (!checkGLFramebuffer()) return false;
 
 
-  // Shadow cube map for point lights.
+  // Point lights' cube maps are attached a face at a time.
   shadowCubeMapFramebuffer = 0;
-  glGenFramebuffers(1, &shadowCubeMapFramebuffer);
-  glBindFramebuffer(GL_FRAMEBUFFER, shadowCubeMapFramebuffer);
-
-  glGenTextures(1, &shadowmapCubeDepthTexture);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, shadowmapCubeDepthTexture);
-  for (int i = 0; i < 6; i++) {
-    glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, SHADOWMAP_WIDTH, SHADOWMAP_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0); // TODO: GL_DEPTH_COMPONENT16/32?
-  }
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-  for (int i = 0; i < 6; i++) {
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, shadowmapCubeDepthTexture, 0);
-  }
-
-  if (!checkGLFramebuffer()) return false;
+  gl::GenFramebuffers(1, &shadowCubeMapFramebuffer);
 
 
   // Quad for drawing textures.
@@ -384,9 +566,32 @@ bool Viewer::initialize() {
     1.0f,  1.0f, 0.0f,
   };
 
-  glGenBuffers(1, &quadVertexBuffer);
-  glBindBuffer(GL_ARRAY_BUFFER, quadVertexBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(quadVBuffer), quadVBuffer, GL_STATIC_DRAW);
+  gl::GenBuffers(1, &quadVertexBuffer);
+  gl::BindBuffer(GL_ARRAY_BUFFER, quadVertexBuffer);
+  gl::BufferData(GL_ARRAY_BUFFER, sizeof(quadVBuffer), quadVBuffer, GL_STATIC_DRAW);
+
+  // Cone around spot lights. Apex at the origin, opening down -Z to a base of
+  // radius 1 at z = -1, widened so the flat sides still contain the round cone.
+  std::vector<glm::vec3> coneVertices;
+  float coneRadius = 1.0f / std::cos(M_PI / LIGHT_CONE_SEGMENTS);
+  for (int i = 0; i < LIGHT_CONE_SEGMENTS; i++) {
+    float angle0 = 2 * M_PI * i / LIGHT_CONE_SEGMENTS;
+    float angle1 = 2 * M_PI * (i + 1) / LIGHT_CONE_SEGMENTS;
+    glm::vec3 base0(coneRadius * std::cos(angle0), coneRadius * std::sin(angle0), -1);
+    glm::vec3 base1(coneRadius * std::cos(angle1), coneRadius * std::sin(angle1), -1);
+    // Side.
+    coneVertices.push_back(glm::vec3(0, 0, 0));
+    coneVertices.push_back(base0);
+    coneVertices.push_back(base1);
+    // Cap.
+    coneVertices.push_back(glm::vec3(0, 0, -1));
+    coneVertices.push_back(base1);
+    coneVertices.push_back(base0);
+  }
+
+  gl::GenBuffers(1, &lightConeVertexBuffer);
+  gl::BindBuffer(GL_ARRAY_BUFFER, lightConeVertexBuffer);
+  gl::BufferData(GL_ARRAY_BUFFER, coneVertices.size() * sizeof(glm::vec3), &coneVertices[0], GL_STATIC_DRAW);
 
 
   // Set up constant data.
@@ -416,34 +621,42 @@ bool Viewer::initialize() {
       0.0f);
     ssaoNoise[i] = glm::normalize(ssaoNoise[i]);
   }
-  glBindTexture(GL_TEXTURE_2D, ssaoNoiseTexture);
+  gl::BindTexture(GL_TEXTURE_2D, ssaoNoiseTexture);
   // Required or data won't show up!
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, SSAO_NOISE_TEXTURE_WIDTH, SSAO_NOISE_TEXTURE_WIDTH, 0, GL_RGB, GL_FLOAT, ssaoNoise);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, SSAO_NOISE_TEXTURE_WIDTH, SSAO_NOISE_TEXTURE_WIDTH, 0, GL_RGB, GL_FLOAT, ssaoNoise);
 
 
   // Scene-specific setup:
-  glm::vec3 startPosition(0, 3.5, -40);
-  controller->setHorizontalAngle(0);
-  controller->setPosition(startPosition);
-  controller->setHasFlashlight(false);
-  controller->setHasGun(false);
+  if (controller != NULL) {
+    glm::vec3 startPosition(0, 3.5, -40);
+    controller->setHorizontalAngle(0);
+    controller->setPosition(startPosition);
+    controller->setHasFlashlight(false);
+    controller->setHasGun(false);
+  }
 
   // Flashlight.
   lights.push_back(Light::spotLight(glm::vec3(1.0, 1.0, 1.0), glm::vec3(0, 0, 0), glm::vec3(0.0, 0.0, -1.0), 18.0));
   //lights.push_back(Light::pointLight(glm::vec3(1.0, 1.0, 1.0), glm::vec3(0, 3, 0)));
   lights.back()->getFalloff() = glm::vec3(1.0, 0.01, 0.0005);
   lights.back()->getAmbience() = glm::vec3(0.1, 0.1, 0.1);
+  lights.back()->setShadowMapSize(2048);
+  lights.back()->setShadowFilter(Light::VARIANCE_SHADOW_FILTER);
 
   // "Sun"
   lights.push_back(Light::directionalLight(glm::vec3(0.7, 0.7, 0.7), glm::vec3(0.1, -1.0, 0.0)));
   //lights.back()->getAmbience() = glm::vec3(0.1, 0.1, 0.1);
   lights.back()->setEnabled(false);
+  lights.back()->setShadowMapSize(1024); // Per cascade.
 
   // Lamp
   moveLamp = Light::pointLight(glm::vec3(0.8, 0.8, 0.8), glm::vec3(0.0, 6.0, 0.0));
   moveLamp->getFalloff() = glm::vec3(1.0, 0.01, 0.01);
+  // It moves every frame, so it never gets a static shadow cache, and two
+  // atlas squares are cheaper to redraw than six cube faces.
+  moveLamp->setShadowMode(Light::DUAL_PARABOLOID_SHADOW);
   lights.push_back(moveLamp);
   moveLamp->setEnabled(false);
 
@@ -469,11 +682,38 @@ bool Viewer::initialize() {
       lights.push_back(Light::pointLight(candleColour, vecs[0]));
       lights.back()->getAmbience() = glm::vec3(0.03, 0.03, 0.03);
       lights.back()->getFalloff() = glm::vec3(1.0, 0.002, 0.008);
+      // Shadowed candles still share the tiled pass when their cube maps go
+      // in the array. Otherwise each gets its own pass, so a small
+      // dual-paraboloid map keeps that pass cheap: two atlas squares instead
+      // of six cube faces.
+      lights.back()->setShadowMapSize(256);
+      if (!cubeShadowArray) {
+        lights.back()->setShadowMode(Light::DUAL_PARABOLOID_SHADOW);
+      }
     } else if (mesh->getName().substr(0, 9) == "Lightbulb") {
       mesh->getMaterial()->getEmissive() = glm::vec3(1, 1, 1);
     }
   }
 
+  allocateShadowSlots();
+  if (lights.size() > MAX_LIGHTS) {
+    std::cout << lights.size() << " lights, those past the first " << MAX_LIGHTS << " are shaded one pass each" << std::endl;
+  }
+
+  // Light spheres are drawn with the light's colour as emissive material.
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    glm::vec3 emissiveLight = lights[i]->getColour();
+    emissiveLight *= 5.0;
+    lightSphereMaterials.push_back(new Material(glm::vec3(0), glm::vec3(0), glm::vec3(0), emissiveLight, 0));
+  }
+  if (!uploadMaterials()) return false;
+
+  gl::Enable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+  // Setup above bound textures and framebuffers behind the trackers' back.
+  shaders::Shader::invalidateTextureBindings();
+  RenderStateTracker::invalidate();
+
   return true;
 }
 
@@ -482,375 +722,1270 @@ void Viewer::drawQuad() {
   quadProgram.drawTriangles(2*3);
 }
 
-void Viewer::bindRenderTarget(GLuint renderTargetFBO) {
+int Viewer::requiredMipLevel(Mesh* mesh, Texture* texture, const glm::vec3& cameraPosition, const glm::mat4& projectionMatrix) {
+  if (mesh->getUVWorldScale() <= 0 || mesh->getBoundingSphereRadius() <= 0) {
+    return 0;
+  }
+
+  glm::vec3 center;
+  float radius;
+  mesh->getWorldBoundingSphere(center, radius);
+  float distance = glm::length(center - cameraPosition) - radius;
+  if (distance <= MIP_STREAMING_PIN_DISTANCE) {
+    return 0;
+  }
+
+  // Texels vs pixels covered by one world unit at the closest point.
+  float modelScale = radius / mesh->getBoundingSphereRadius();
+  float texelsPerUnit = std::max(texture->getWidth(), texture->getHeight()) / (mesh->getUVWorldScale() * modelScale);
+  float pixelsPerUnit = projectionMatrix[1][1] * height * 0.5f / distance;
+  float level = std::log(texelsPerUnit / pixelsPerUnit) / std::log(2.0f);
+  return std::max(0, (int) std::floor(level));
+}
+
+void Viewer::uploadLights(unsigned int batch) {
+  unsigned int firstLight = batch * MAX_LIGHTS;
+  unsigned int numLights = std::min((unsigned int) lights.size() - firstLight, (unsigned int) MAX_LIGHTS);
+  for (unsigned int i = 0; i < numLights; i++) {
+    unsigned int lightId = firstLight + i;
+    Light* light = lights[lightId];
+    shaders::LightData& data = lightBlock.get().lights[i];
+    data.positionType = glm::vec4(light->getPosition(), (float) light->getType());
+    data.directionSpread = glm::vec4(light->getDirection(), light->getSpread());
+    data.colour = glm::vec4(light->getColour(), 0);
+    data.ambience = glm::vec4(light->getAmbience(), 0);
+    int cubeLayer = lightId < shadowSlots.size() && light->getCastsShadows() ? shadowSlots[lightId].cubeLayer : -1;
+    data.falloff = glm::vec4(light->getFalloff(), (float) cubeLayer);
+  }
+  lightBlock.upload(numLights * sizeof(shaders::LightData));
+  uploadedLightBatch = batch;
+}
+
+bool Viewer::uploadMaterials() {
+  const std::vector<Material*>& materials = Material::getAllMaterials();
+  // Draws index the table by material id, so every id has to fit.
+  if (materials.size() > MAX_MATERIALS) {
+    std::cerr << "Too many materials: " << materials.size() << ", the material table holds " << MAX_MATERIALS << std::endl;
+    return false;
+  }
+  unsigned int numMaterials = materials.size();
+  for (unsigned int i = 0; i < numMaterials; i++) {
+    Material* material = materials[i];
+    if (material == NULL) continue;
+    shaders::MaterialData& data = materialBlock.get().materials[i];
+    data.diffuseShininess = glm::vec4(material->getDiffuse(), material->getShininess());
+    data.specular = glm::vec4(material->getSpecular(), 0);
+    data.emissive = glm::vec4(material->getEmissive(), 0);
+  }
+  materialBlock.upload(numMaterials * sizeof(shaders::MaterialData));
+  return true;
+}
+
+unsigned int Viewer::geomTexturesKey(Material* material) {
+  unsigned int key = 0;
+  if (material == NULL) {
+    return key;
+  }
+  if (material->hasDiffuseTexture() && settings->isSet(Settings::TEXTURE_MAP)) {
+    key |= shaders::GEOM_DIFFUSE_TEXTURE;
+  }
+  if (material->hasNormalTexture() && settings->isSet(Settings::NORMAL_MAP)) {
+    key |= shaders::GEOM_NORMAL_TEXTURE;
+  }
+  return key;
+}
+
+unsigned int Viewer::deferredShadingKey(Light* light) {
+  unsigned int key = 0;
+  if (settings->isSet(Settings::LIGHT_DIFFUSE)) key |= shaders::DEFERRED_DIFFUSE;
+  if (settings->isSet(Settings::LIGHT_SPECULAR)) key |= shaders::DEFERRED_SPECULAR;
+  if (settings->isSet(Settings::SHADOW_MAP)) key |= shaders::DEFERRED_SHADOW;
+  switch (light->getType()) {
+    case Light::DIRECTIONAL:
+      key |= shaders::DEFERRED_DIRECTIONAL_LIGHT;
+      break;
+    case Light::SPOT:
+      key |= shaders::DEFERRED_SPOT_LIGHT;
+      if ((key & shaders::DEFERRED_SHADOW) && hasVarianceShadow(light)) {
+        key |= shaders::DEFERRED_VARIANCE_SHADOW;
+      }
+      break;
+    case Light::POINT:
+      key |= shaders::DEFERRED_POINT_LIGHT;
+      if ((key & shaders::DEFERRED_SHADOW) && hasParaboloidShadow(light)) {
+        key |= shaders::DEFERRED_PARABOLOID_SHADOW;
+      }
+      break;
+  }
+  return key;
+}
+
+unsigned int Viewer::baseShadingKey() {
+  unsigned int key = shaders::DEFERRED_BASE_PASS;
+  if (settings->isSet(Settings::LIGHT_DIFFUSE)) key |= shaders::DEFERRED_DIFFUSE;
+  if (settings->isSet(Settings::SSAO)) key |= shaders::DEFERRED_SSAO;
+  return key;
+}
+
+unsigned int Viewer::tiledShadingKey() {
+  unsigned int key = shaders::DEFERRED_TILED_LIGHTS;
+  if (settings->isSet(Settings::LIGHT_DIFFUSE)) key |= shaders::DEFERRED_DIFFUSE;
+  if (settings->isSet(Settings::LIGHT_SPECULAR)) key |= shaders::DEFERRED_SPECULAR;
+  if (cubeShadowArray && settings->isSet(Settings::SHADOW_MAP)) key |= shaders::DEFERRED_SHADOW_CUBE_ARRAY;
+  return key;
+}
+
+bool Viewer::isTiledLight(unsigned int lightId) {
+  Light* light = lights[lightId];
+  return lightId < MAX_LIGHTS && (!light->getCastsShadows() || !settings->isSet(Settings::SHADOW_MAP) || hasCubeArrayShadow(light));
+}
+
+bool Viewer::hasCubeArrayShadow(Light* light) {
+  return cubeShadowArray && light->getType() == Light::POINT && !hasParaboloidShadow(light);
+}
+
+bool Viewer::lightScreenRect(Light* light, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, int rect[4]) {
+  rect[0] = 0;
+  rect[1] = 0;
+  rect[2] = width;
+  rect[3] = height;
+
+  float radius = light->getInfluenceRadius();
+  if (radius == std::numeric_limits<float>::infinity()) {
+    return true;
+  }
+  glm::vec3 center = glm::vec3(viewMatrix * glm::vec4(light->getPosition(), 1.0));
+  if (outsideFrustum(projectionMatrix, center, center, radius)) {
+    return false;
+  }
+
+  // Spheres crossing the near plane may cover the whole screen.
+  float nearPlane = projectionMatrix[3][2] / (projectionMatrix[2][2] - 1.0f);
+  if (center.z + radius >= -nearPlane) {
+    return true;
+  }
+
+  // Project the corners of the bounding box.
+  glm::vec2 ndcMin(1, 1), ndcMax(-1, -1);
+  for (int corner = 0; corner < 8; corner++) {
+    glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius, (corner & 4) ? radius : -radius);
+    glm::vec4 clip = projectionMatrix * glm::vec4(center + offset, 1.0);
+    glm::vec2 ndc = glm::vec2(clip.x, clip.y) / clip.w;
+    ndcMin = glm::min(ndcMin, ndc);
+    ndcMax = glm::max(ndcMax, ndc);
+  }
+  ndcMin = glm::max(ndcMin, glm::vec2(-1, -1));
+  ndcMax = glm::min(ndcMax, glm::vec2(1, 1));
+
+  int minX = (int) std::floor((ndcMin.x * 0.5f + 0.5f) * width);
+  int minY = (int) std::floor((ndcMin.y * 0.5f + 0.5f) * height);
+  int maxX = (int) std::ceil((ndcMax.x * 0.5f + 0.5f) * width);
+  int maxY = (int) std::ceil((ndcMax.y * 0.5f + 0.5f) * height);
+  if (maxX <= minX || maxY <= minY) {
+    return false;
+  }
+  rect[0] = minX;
+  rect[1] = minY;
+  rect[2] = maxX - minX;
+  rect[3] = maxY - minY;
+  return true;
+}
+
+float Viewer::lightScreenCoverage(Light* light, const glm::mat4& VP) {
+  float radius = light->getInfluenceRadius();
+  if (radius == std::numeric_limits<float>::infinity()) {
+    return 1.0f;
+  }
+  glm::vec3 center = light->getPosition();
+  if (outsideFrustum(VP, center, center, radius)) {
+    return 0.0f;
+  }
+
+  glm::vec2 ndcMin(1, 1), ndcMax(-1, -1);
+  for (int corner = 0; corner < 8; corner++) {
+    glm::vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius, (corner & 4) ? radius : -radius);
+    glm::vec4 clip = VP * glm::vec4(center + offset, 1.0);
+    // Boxes reaching behind the camera may cover the whole screen.
+    if (clip.w <= 0.0f) {
+      return 1.0f;
+    }
+    glm::vec2 ndc = glm::vec2(clip.x, clip.y) / clip.w;
+    ndcMin = glm::min(ndcMin, ndc);
+    ndcMax = glm::max(ndcMax, ndc);
+  }
+  ndcMin = glm::max(ndcMin, glm::vec2(-1, -1));
+  ndcMax = glm::min(ndcMax, glm::vec2(1, 1));
+  return std::max(ndcMax.x - ndcMin.x, 0.0f) * std::max(ndcMax.y - ndcMin.y, 0.0f) / 4.0f;
+}
+
+void Viewer::buildLightTiles(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix) {
+  std::fill(lightTileMasks.begin(), lightTileMasks.end(), 0);
+
+  for (unsigned int lightId = 0; lightId < lights.size(); lightId++) {
+    Light* light = lights[lightId];
+    if (!light->isEnabled() || !isTiledLight(lightId)) continue;
+
+    int rect[4];
+    if (!lightScreenRect(light, viewMatrix, projectionMatrix, rect)) continue;
+
+    GLuint bit = 1u << (lightId % 32);
+    for (int y = rect[1] / LIGHT_TILE_SIZE; y <= (rect[1] + rect[3] - 1) / LIGHT_TILE_SIZE; y++) {
+      for (int x = rect[0] / LIGHT_TILE_SIZE; x <= (rect[0] + rect[2] - 1) / LIGHT_TILE_SIZE; x++) {
+        lightTileMasks[(y * tilesX + x) * 2 + lightId / 32] |= bit;
+      }
+    }
+  }
+
+  // Bound on the unit the tiled pass samples it from, so the bind cache stays valid.
+  shaders::Shader::bindTexture(8, GL_TEXTURE_2D, lightTileTexture);
+  gl::TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tilesX, tilesY, GL_RG_INTEGER, GL_UNSIGNED_INT, &lightTileMasks[0]);
+}
+
+bool Viewer::hasLightVolume(Light* light) {
+  return light->getType() != Light::DIRECTIONAL && pointLightMesh != NULL &&
+    light->getInfluenceRadius() < std::numeric_limits<float>::infinity();
+}
+
+bool Viewer::hasLightCone(Light* light) {
+  // Past about 63 degrees the cone is bigger than the sphere.
+  return light->getType() == Light::SPOT && light->getSpread() < 60.0f;
+}
+
+bool Viewer::hasVarianceShadow(Light* light) {
+  return light->getType() == Light::SPOT && light->getShadowFilter() == Light::VARIANCE_SHADOW_FILTER;
+}
+
+bool Viewer::hasParaboloidShadow(Light* light) {
+  return light->getType() == Light::POINT && light->getShadowMode() == Light::DUAL_PARABOLOID_SHADOW;
+}
+
+float Viewer::paraboloidShadowFar(Light* light) {
+  // Same range as the cube maps, less if the light fades out before that.
+  return std::min(light->getInfluenceRadius(), 500.0f);
+}
+
+glm::mat4 Viewer::lightVolumeMatrix(Light* light) {
+  float radius = light->getInfluenceRadius();
+  if (hasLightCone(light)) {
+    glm::vec3 position = light->getPosition();
+    glm::vec3 direction = glm::normalize(light->getDirection());
+    glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+    float baseRadius = radius * std::tan(light->getSpread() * M_PI / 180.0);
+    return glm::inverse(glm::lookAt(position, position + direction, up)) * glm::scale(glm::mat4(1.0), glm::vec3(baseRadius, baseRadius, radius));
+  }
+  // A little bigger, as the faces of the unit sphere lie inside it.
+  return glm::translate(glm::mat4(1.0), light->getPosition()) * glm::scale(glm::mat4(1.0), glm::vec3(radius * 1.05f));
+}
+
+template<class PROGRAM>
+void Viewer::drawLightVolume(PROGRAM* program, Light* light) {
+  if (hasLightCone(light)) {
+    program->vbo_vertexPositionModelspace(lightConeVertexBuffer);
+    program->drawTriangles(LIGHT_CONE_SEGMENTS * 2 * 3);
+  } else {
+    program->vbo_vertexPositionModelspace(pointLightMesh->getBuffer(Mesh::POSITION_BUF));
+    program->drawTriangleElements(pointLightMesh->getBuffer(Mesh::POSITION_ELEMENT_BUF), pointLightMesh->getNumIndices());
+  }
+}
+
+void Viewer::allocateShadowSlots() {
+  std::vector<std::pair<int, unsigned int> > atlasLights; // Size, light index.
+  std::vector<unsigned int> arrayLights;
+  int arraySize = 0;
+  shadowSlots.resize(lights.size());
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    ShadowSlot& slot = shadowSlots[i];
+    slot.size = 0;
+    slot.width = 0;
+    slot.renderSize = 0;
+    slot.renderWidth = 0;
+    slot.atlasX = 0;
+    slot.atlasY = 0;
+    slot.cubeTexture = 0;
+    slot.cubeLayer = -1;
+    slot.momentsTexture = 0;
+    slot.cascadeEnds = glm::vec4(0, 0, 0, 0);
+    slot.scheduledTime = -1;
+    slot.updatedFrame = -1;
+    slot.nextFace = 0;
+    slot.casterDraws = 0;
+    if (!lights[i]->getCastsShadows()) continue;
+
+    if (hasVarianceShadow(lights[i])) {
+      slot.size = lights[i]->getShadowMapSize();
+      slot.width = slot.size;
+      slot.renderSize = slot.size;
+      slot.renderWidth = slot.width;
+      slot.momentsTexture = createMomentsTexture(slot.size / 2, true);
+      varianceSize = std::max(varianceSize, slot.size);
+      continue;
+    }
+    if (lights[i]->getType() != Light::POINT || hasParaboloidShadow(lights[i])) {
+      atlasLights.push_back(std::make_pair(lights[i]->getShadowMapSize(), i));
+      continue;
+    }
+    // The tiled pass is the only one that reads the array.
+    if (i < MAX_LIGHTS && hasCubeArrayShadow(lights[i])) {
+      slot.cubeLayer = arrayLights.size();
+      arrayLights.push_back(i);
+      arraySize = std::max(arraySize, lights[i]->getShadowMapSize());
+      continue;
+    }
+
+    slot.size = lights[i]->getShadowMapSize();
+    slot.width = slot.size;
+    slot.renderSize = slot.size;
+    slot.renderWidth = slot.width;
+    gl::GenTextures(1, &slot.cubeTexture);
+    gl::BindTexture(GL_TEXTURE_CUBE_MAP, slot.cubeTexture);
+    for (int face = 0; face < 6; face++) {
+      gl::TexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT, slot.size, slot.size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0); // TODO: GL_DEPTH_COMPONENT16/32?
+    }
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+  }
+  if (!arrayLights.empty()) {
+    // Layers of an array all have the same size, the largest any of its lights asked for.
+    gl::GenTextures(1, &shadowCubeArrayTexture);
+    gl::BindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, shadowCubeArrayTexture);
+    gl::TexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT, arraySize, arraySize, 6 * arrayLights.size(), 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    for (unsigned int i = 0; i < arrayLights.size(); i++) {
+      ShadowSlot& slot = shadowSlots[arrayLights[i]];
+      slot.size = arraySize;
+      slot.width = arraySize;
+      slot.renderSize = arraySize;
+      slot.renderWidth = arraySize;
+      slot.cubeTexture = shadowCubeArrayTexture;
+    }
+  }
+  if (varianceSize > 0) {
+    varianceMomentsTexture = createMomentsTexture(varianceSize, false);
+    varianceBlurTexture = createMomentsTexture(varianceSize / 2, false);
+    gl::GenRenderbuffers(1, &varianceDepthRenderbuffer);
+    gl::BindRenderbuffer(GL_RENDERBUFFER, varianceDepthRenderbuffer);
+    gl::RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, varianceSize, varianceSize);
+    gl::GenFramebuffers(1, &varianceFramebuffer);
+    RenderStateTracker::bindFramebuffer(varianceFramebuffer);
+    gl::FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, varianceDepthRenderbuffer);
+  }
+  shaders::Shader::invalidateTextureBindings();
+
+  // Fill rows left to right, largest first, each row as tall as its first map.
+  // Dual-paraboloid and cascaded maps are squares side by side.
+  std::sort(atlasLights.begin(), atlasLights.end());
+  int x = 0, y = 0, rowHeight = 0;
+  for (int i = atlasLights.size() - 1; i >= 0; i--) {
+    Light* light = lights[atlasLights[i].second];
+    int size = atlasLights[i].first;
+    int width = size;
+    if (hasParaboloidShadow(light)) {
+      width = 2 * size;
+    } else if (light->getType() == Light::DIRECTIONAL) {
+      width = SHADOW_CASCADES * size;
+    }
+    if (x + width > SHADOW_ATLAS_SIZE) {
+      x = 0;
+      y += rowHeight;
+      rowHeight = 0;
+    }
+    if (width > SHADOW_ATLAS_SIZE || y + size > SHADOW_ATLAS_SIZE) {
+      std::cerr << "No room in the shadow atlas for a " << width << "x" << size << " shadow map, disabling its shadows." << std::endl;
+      light->setCastsShadows(false);
+      continue;
+    }
+    ShadowSlot& slot = shadowSlots[atlasLights[i].second];
+    slot.size = size;
+    slot.width = width;
+    slot.renderSize = size;
+    slot.renderWidth = width;
+    slot.atlasX = x;
+    slot.atlasY = y;
+    x += width;
+    rowHeight = std::max(rowHeight, size);
+  }
+}
+
+void Viewer::renderShadows(std::vector<Mesh*>& thisFrameMeshes, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, double currentTime) {
+  if (currentTime != shadowFrameTime) {
+    shadowFrameTime = currentTime;
+    shadowFrame++;
+    shadowTexels = 0;
+  }
+  if (!settings->isSet(Settings::SHADOW_MAP)) return;
+
+  // The first view rendered this frame schedules every light any of the
+  // frame's views can see. With mirrors that's a mirror view, so lights are
+  // ranked by the player's view, the first of shadowReceiverVPs.
+  std::vector<glm::mat4> views(shadowReceiverVPs);
+  if (views.empty()) {
+    views.push_back(projectionMatrix * viewMatrix);
+  }
+  std::vector<std::pair<float, unsigned int> > visibleLights; // Priority, light index.
+  for (unsigned int lightId = 0; lightId < lights.size(); lightId++) {
+    Light* light = lights[lightId];
+    ShadowSlot& slot = shadowSlots[lightId];
+    if (!light->isEnabled() || !light->getCastsShadows() || slot.size == 0) continue;
+
+    if (light->getType() == Light::DIRECTIONAL) {
+      renderCascadedShadow(light, slot, thisFrameMeshes, viewMatrix, projectionMatrix);
+      shadowTexels += SHADOW_CASCADES * slot.size * slot.size;
+      continue;
+    }
+    if (slot.scheduledTime == currentTime) continue;
+
+    float coverage = lightScreenCoverage(light, views[0]);
+    bool visible = coverage > 0.0f;
+    for (unsigned int i = 1; i < views.size() && !visible; i++) {
+      visible = lightScreenCoverage(light, views[i]) > 0.0f;
+    }
+    if (!visible) continue;
+    slot.scheduledTime = currentTime;
+
+    // Screen coverage weighted by brightness.
+    glm::vec3 colour = light->getColour();
+    visibleLights.push_back(std::make_pair(coverage * std::max(colour.x, std::max(colour.y, colour.z)), lightId));
+  }
+
+  // Highest priority first, each at its resolution tier while the budget
+  // lasts. Past it, only the map updated longest ago gets to update.
+  std::sort(visibleLights.begin(), visibleLights.end());
+  int stalestLight = -1;
+  int stalestSize = 0;
+  for (int i = visibleLights.size() - 1; i >= 0; i--) {
+    Light* light = lights[visibleLights[i].second];
+    ShadowSlot& slot = shadowSlots[visibleLights[i].second];
+    int renderSize = shadowMapTier(slot, visibleLights[i].first);
+    if (slot.updatedFrame < 0 || shadowTexels + shadowMapCost(light, renderSize, ALL_CUBE_FACES) <= SHADOW_TEXEL_BUDGET) {
+      updateShadow(light, slot, thisFrameMeshes, renderSize, ALL_CUBE_FACES, true);
+    } else if (stalestLight < 0 || slot.updatedFrame < shadowSlots[stalestLight].updatedFrame) {
+      stalestLight = visibleLights[i].second;
+      stalestSize = renderSize;
+    }
+  }
+  if (stalestLight < 0) return;
+
+  // Cube maps update a few faces at a time, the others at most every SHADOW_REDUCED_RATE frames.
+  // They can go several frames without an update, so they keep every caster
+  // that could shadow something once the camera turns.
+  Light* light = lights[stalestLight];
+  ShadowSlot& slot = shadowSlots[stalestLight];
+  if (slot.cubeTexture != 0) {
+    unsigned int faces = 0;
+    for (int i = 0; i < 6 / SHADOW_REDUCED_RATE; i++) {
+      faces |= 1 << slot.nextFace;
+      slot.nextFace = (slot.nextFace + 1) % 6;
+    }
+    updateShadow(light, slot, thisFrameMeshes, stalestSize, faces, false);
+  } else if (shadowFrame - slot.updatedFrame >= SHADOW_REDUCED_RATE) {
+    updateShadow(light, slot, thisFrameMeshes, stalestSize, ALL_CUBE_FACES, false);
+  }
+}
+
+int Viewer::shadowMapTier(const ShadowSlot& slot, float priority) {
+  // Cube faces can't be rendered smaller, they're sampled by direction.
+  // Moments are already filtered down to half resolution.
+  if (slot.cubeTexture != 0 || slot.momentsTexture != 0) return slot.size;
+
+  // Half the resolution for each quartering of priority below a quarter.
+  int renderSize = slot.size;
+  for (float threshold = 0.25f; priority < threshold && renderSize / 2 >= MIN_SHADOW_MAP_SIZE; threshold /= 4.0f) {
+    renderSize /= 2;
+  }
+  return renderSize;
+}
+
+long Viewer::shadowMapCost(Light* light, int renderSize, unsigned int faces) {
+  int numFaces = 1;
+  if (hasParaboloidShadow(light)) {
+    numFaces = 2;
+  } else if (light->getType() == Light::POINT) {
+    numFaces = 0;
+    for (int face = 0; face < 6; face++) {
+      if (faces & (1 << face)) numFaces++;
+    }
+  }
+  return (long)numFaces * renderSize * renderSize;
+}
+
+void Viewer::updateShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, int renderSize, unsigned int faces, bool receiverCulling) {
+  slot.casterDraws = 0;
+  slot.renderSize = renderSize;
+  slot.renderWidth = slot.width / slot.size * renderSize;
+  renderShadow(light, slot, thisFrameMeshes, faces, receiverCulling);
+  shadowTexels += shadowMapCost(light, renderSize, faces);
+  slot.updatedFrame = shadowFrame;
+}
+
+void Viewer::shadowViewProjections(Light* light, glm::mat4 faceVP[6]) {
+  glm::vec3 lightPos = light->getPosition();
+  glm::vec3 lightDir = light->getDirection();
+
+  // Compute the VP matrix from the light's point of view.
+  glm::mat4 depthProjectionMatrix;
+  glm::mat4 depthViewMatrix;
+  switch (light->getType()) {
+    case Light::DIRECTIONAL:
+      // Fitted to the view, see renderCascadedShadow().
+      break;
+    case Light::SPOT:
+      depthProjectionMatrix = glm::perspective(light->getSpread() + 15.0f, 1.0f, 2.0f, SPOT_SHADOW_FAR_PLANE);
+      depthViewMatrix = glm::lookAt(lightPos, lightPos + lightDir, glm::vec3(0, 1, 0));
+      faceVP[0] = depthProjectionMatrix * depthViewMatrix;
+      break;
+    case Light::POINT:
+      if (hasParaboloidShadow(light)) {
+        // Hemispheres facing -Z and +Z, in units of the far distance.
+        glm::mat4 scale = glm::scale(glm::mat4(1.0), glm::vec3(1.0f / paraboloidShadowFar(light)));
+        faceVP[0] = scale * glm::lookAt(lightPos, lightPos + glm::vec3(0, 0, -1), glm::vec3(0, 1, 0));
+        faceVP[1] = scale * glm::lookAt(lightPos, lightPos + glm::vec3(0, 0, 1), glm::vec3(0, 1, 0));
+        break;
+      }
+      depthProjectionMatrix = glm::perspective(90.0f, 1.0f, 1.0f, 500.0f);
+      // +X, -X, +Y, -Y, +Z, -Z.
+      faceVP[0] = depthProjectionMatrix * glm::lookAt(lightPos, lightPos + glm::vec3(1, 0, 0), glm::vec3(0, -1, 0));
+      faceVP[1] = depthProjectionMatrix * glm::lookAt(lightPos, lightPos + glm::vec3(-1, 0, 0), glm::vec3(0, -1, 0));
+      faceVP[2] = depthProjectionMatrix * glm::lookAt(lightPos, lightPos + glm::vec3(0, 1, 0), glm::vec3(0, 0, 1));
+      faceVP[3] = depthProjectionMatrix * glm::lookAt(lightPos, lightPos + glm::vec3(0, -1, 0), glm::vec3(0, 0, -1));
+      faceVP[4] = depthProjectionMatrix * glm::lookAt(lightPos, lightPos + glm::vec3(0, 0, 1), glm::vec3(0, -1, 0));
+      faceVP[5] = depthProjectionMatrix * glm::lookAt(lightPos, lightPos + glm::vec3(0, 0, -1), glm::vec3(0, -1, 0));
+      break;
+  }
+}
+
+unsigned int Viewer::shadowCasterFaces(Light* light, const glm::mat4 faceVP[6], Mesh* mesh, bool receiverCulling) {
+  if (mesh->getBoundingSphereRadius() <= 0) return ALL_CUBE_FACES;
+  glm::vec3 center;
+  float radius;
+  mesh->getWorldBoundingSphere(center, radius);
+
+  // Outside the light's reach.
+  glm::vec3 lightPos = light->getPosition();
+  float influence = light->getInfluenceRadius();
+  glm::vec3 toMesh = center - lightPos;
+  float distance = glm::length(toMesh);
+  if (distance > influence + radius) return 0;
+
+  unsigned int faces = 0;
+  if (hasParaboloidShadow(light)) {
+    // Each hemisphere's view looks down -Z, in units of the far distance.
+    float scaledRadius = radius / paraboloidShadowFar(light);
+    for (int hemisphere = 0; hemisphere < 2; hemisphere++) {
+      if ((faceVP[hemisphere] * glm::vec4(center, 1.0)).z <= scaledRadius) faces |= 1 << hemisphere;
+    }
+  } else {
+    for (int face = 0; face < (light->getType() == Light::POINT ? 6 : 1); face++) {
+      if (!outsideFrustum(faceVP[face], center, center, radius)) faces |= 1 << face;
+    }
+  }
+  if (faces == 0 || !receiverCulling || shadowReceiverVPs.empty() ||
+      influence == std::numeric_limits<float>::infinity() || distance <= radius) {
+    return faces;
+  }
+
+  // The shadow runs from the mesh away from the light, widening, until the
+  // light runs out. Bound it by the mesh's sphere swept to the end at its widest.
+  glm::vec3 shadowEnd = lightPos + toMesh * std::max(influence / distance, 1.0f);
+  float shadowRadius = radius * std::max(influence / distance, 1.0f);
+  for (unsigned int i = 0; i < shadowReceiverVPs.size(); i++) {
+    if (!outsideFrustum(shadowReceiverVPs[i], center, shadowEnd, shadowRadius)) return faces;
+  }
+  return 0;
+}
+
+template<class PROGRAM>
+int Viewer::drawShadowCasters(PROGRAM* program, const glm::mat4& depthVP, std::vector<Mesh*>& thisFrameMeshes, ShadowCasters casters) {
+  int draws = 0;
+  for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
+    if ((casters == STATIC_CASTERS && (*it)->isDynamic()) || (casters == DYNAMIC_CASTERS && !(*it)->isDynamic())) continue;
+    glm::mat4 depthMVP = depthVP * (*it)->getModelMatrix();
+    program->set_depthMVP(depthMVP);
+
+    // Only positions are read, from the smaller deduplicated stream.
+    program->vbo_vertexPositionModelspace((*it)->getBuffer(Mesh::POSITION_BUF));
+    program->drawTriangleElements((*it)->getBuffer(Mesh::POSITION_ELEMENT_BUF), (*it)->getNumIndices());
+    draws++;
+  }
+  return draws;
+}
+
+void Viewer::renderShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, unsigned int faces, bool receiverCulling) {
+  if (slot.momentsTexture != 0) {
+    renderVarianceShadow(light, slot, thisFrameMeshes, receiverCulling);
+    return;
+  }
+
+  bool paraboloid = hasParaboloidShadow(light);
+  bool cube = slot.cubeTexture != 0;
+  glm::mat4 faceVP[6];
+  shadowViewProjections(light, faceVP);
+
+  // Atlas regions are scissored too, so clears and blits stay inside them.
+  GLuint shadowFramebuffer = cube ? shadowCubeMapFramebuffer : shadowMapFramebuffer;
+  RenderState shadowState = RenderState(shadowFramebuffer, slot.size, slot.size);
+  if (!cube) {
+    shadowState = RenderState(shadowFramebuffer, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE)
+      .withViewport(slot.atlasX, slot.atlasY, slot.renderSize, slot.renderSize)
+      .withScissor(slot.atlasX, slot.atlasY, slot.renderWidth, slot.renderSize);
+  }
+  shadowState = shadowState
+    .withDrawBuffer(GL_NONE) // No colour output.
+    .withDepthTest(true)
+    .withCullFace(GL_BACK);
+  int targetX = cube ? 0 : slot.atlasX;
+  int targetY = cube ? 0 : slot.atlasY;
+
+  // Still lights only redraw the dynamic meshes over a copy of the rest.
+  StaticShadow* staticShadow = updateStaticShadow(light, slot);
+  if (staticShadow != NULL && !staticShadow->valid) {
+    RenderState staticState = RenderState(staticShadow->framebuffer, slot.width, slot.size)
+      .withViewport(0, 0, slot.renderSize, slot.renderSize)
+      .withDrawBuffer(GL_NONE)
+      .withDepthTest(true)
+      .withCullFace(GL_BACK);
+    RenderStateTracker::apply(staticState);
+    if (cube) {
+      gl::FramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticShadow->texture, 0);
+    } else {
+      gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, staticShadow->texture, 0);
+    }
+    gl::Clear(GL_DEPTH_BUFFER_BIT);
+    // The static cache outlives the views, so it isn't culled by what they can see.
+    slot.casterDraws += drawShadowPasses(light, faceVP, staticState, 0, 0, slot.renderSize, thisFrameMeshes, STATIC_CASTERS, ALL_CUBE_FACES, 0, false);
+    staticShadow->valid = true;
+  }
+
+  RenderStateTracker::apply(shadowState);
+  if (staticShadow != NULL) {
+    // Blits can't be layered, so cube maps are copied a face at a time.
+    gl::BindFramebuffer(GL_READ_FRAMEBUFFER, staticShadow->framebuffer);
+    for (int face = 0; face < (cube ? 6 : 1); face++) {
+      if (cube) {
+        if ((faces & (1 << face)) == 0) continue;
+        gl::FramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, staticShadow->texture, 0);
+        attachCubeFace(GL_DRAW_FRAMEBUFFER, slot, face);
+      }
+      gl::BlitFramebuffer(0, 0, slot.renderWidth, slot.renderSize, targetX, targetY, targetX + slot.renderWidth, targetY + slot.renderSize, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    }
+    gl::BindFramebuffer(GL_READ_FRAMEBUFFER, shadowFramebuffer);
+  } else if (cube && (faces != ALL_CUBE_FACES || slot.cubeLayer >= 0)) {
+    // Clearing the layered attachment would clear the faces not being
+    // updated too, and the other lights' cubes in an array.
+    for (int face = 0; face < 6; face++) {
+      if ((faces & (1 << face)) == 0) continue;
+      attachCubeFace(GL_FRAMEBUFFER, slot, face);
+      gl::Clear(GL_DEPTH_BUFFER_BIT);
+    }
+  }
+
+  // The atlas stays attached to its framebuffer.
+  if (cube) {
+    gl::FramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, slot.cubeTexture, 0);
+  }
+  if (staticShadow == NULL && (!cube || (faces == ALL_CUBE_FACES && slot.cubeLayer < 0))) {
+    gl::Clear(GL_DEPTH_BUFFER_BIT);
+  }
+  slot.casterDraws += drawShadowPasses(light, faceVP, shadowState, targetX, targetY, slot.renderSize, thisFrameMeshes, staticShadow != NULL ? DYNAMIC_CASTERS : ALL_CASTERS, faces, 6 * std::max(slot.cubeLayer, 0), receiverCulling);
+
+  if (cube) {
+    // TODO: Figure out why we need to shift by -1 here.
+    glm::vec3 lightPos = light->getPosition();
+    slot.depthBiasVP = shadowmapBiasMatrix * glm::translate(glm::mat4(1.0), glm::vec3(-lightPos.x - 1, -lightPos.y - 1, -lightPos.z - 1));
+  } else if (paraboloid) {
+    // The shader does the projection, and finds the region from shadowAtlasRegion.
+    slot.depthBiasVP = faceVP[0];
+  } else {
+    slot.depthBiasVP = atlasRegionMatrix(slot.atlasX, slot.atlasY, slot.renderSize) * shadowmapBiasMatrix * faceVP[0];
+  }
+}
+
+void Viewer::renderCascadedShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix) {
+  // Camera near and far planes, and the slopes of its frustum's sides.
+  float nearPlane = projectionMatrix[3][2] / (projectionMatrix[2][2] - 1.0f);
+  float farPlane = projectionMatrix[3][2] / (projectionMatrix[2][2] + 1.0f);
+  float tanX = 1.0f / projectionMatrix[0][0];
+  float tanY = 1.0f / projectionMatrix[1][1];
+  glm::mat4 lightView = glm::lookAt(glm::vec3(0, 0, 0), light->getDirection(), glm::vec3(0, 1, 0));
+  glm::mat4 viewToLight = lightView * glm::inverse(viewMatrix);
+  slot.casterDraws = 0;
+
+  RenderState shadowState = RenderState(shadowMapFramebuffer, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE)
+    .withScissor(slot.atlasX, slot.atlasY, slot.width, slot.size)
+    .withDrawBuffer(GL_NONE)
+    .withDepthTest(true)
+    .withCullFace(GL_BACK);
+  RenderStateTracker::apply(shadowState);
+  gl::Clear(GL_DEPTH_BUFFER_BIT);
+  gl::UseProgram(depthProgram.getProgramId());
+
+  float splitNear = nearPlane;
+  std::vector<Mesh*> casters;
+  for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++) {
+    float t = (cascade + 1) / (float)SHADOW_CASCADES;
+    float uniformSplit = nearPlane + (farPlane - nearPlane) * t;
+    float logSplit = nearPlane * std::pow(farPlane / nearPlane, t);
+    float splitFar = uniformSplit + (logSplit - uniformSplit) * SHADOW_CASCADE_LOG_WEIGHT;
+
+    // Bound the slice with a sphere in light space. Unlike a box around it,
+    // its size doesn't change as the camera turns.
+    glm::vec3 corners[8];
+    glm::vec3 center(0, 0, 0);
+    for (int corner = 0; corner < 8; corner++) {
+      float d = (corner & 4) ? splitFar : splitNear;
+      glm::vec4 cornerView((corner & 1) ? d * tanX : -d * tanX, (corner & 2) ? d * tanY : -d * tanY, -d, 1);
+      corners[corner] = glm::vec3(viewToLight * cornerView);
+      center += corners[corner] / 8.0f;
+    }
+    float radius = 0;
+    for (int corner = 0; corner < 8; corner++) {
+      radius = std::max(radius, glm::length(corners[corner] - center));
+    }
+    radius = std::ceil(radius * 16.0f) / 16.0f;
+
+    // Snap to whole texels, so the map moves in texel steps with the camera.
+    float texel = 2.0f * radius / slot.size;
+    center.x = std::floor(center.x / texel) * texel;
+    center.y = std::floor(center.y / texel) * texel;
+
+    // Meshes that can shadow the slice: inside its square, and not entirely
+    // behind it. The near plane is pulled back to the furthest of them.
+    float nearZ = center.z + radius;
+    casters.clear();
+    for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
+      if ((*it)->getBoundingSphereRadius() > 0) {
+        glm::vec3 meshCenter;
+        float meshRadius;
+        (*it)->getWorldBoundingSphere(meshCenter, meshRadius);
+        meshCenter = glm::vec3(lightView * glm::vec4(meshCenter, 1.0));
+        if (std::abs(meshCenter.x - center.x) > radius + meshRadius || std::abs(meshCenter.y - center.y) > radius + meshRadius ||
+            meshCenter.z + meshRadius < center.z - radius) {
+          continue;
+        }
+        nearZ = std::max(nearZ, meshCenter.z + meshRadius);
+      }
+      casters.push_back(*it);
+    }
+
+    glm::mat4 depthProjectionMatrix = glm::ortho(center.x - radius, center.x + radius, center.y - radius, center.y + radius, -nearZ, radius - center.z);
+    glm::mat4 cascadeVP = depthProjectionMatrix * lightView;
+    int x = slot.atlasX + cascade * slot.size;
+    RenderStateTracker::apply(shadowState.withViewport(x, slot.atlasY, slot.size, slot.size));
+    slot.casterDraws += drawShadowCasters(&depthProgram, cascadeVP, casters, ALL_CASTERS);
+
+    slot.cascadeVP[cascade] = atlasRegionMatrix(x, slot.atlasY, slot.size) * shadowmapBiasMatrix * cascadeVP;
+    slot.cascadeEnds[cascade] = splitFar;
+    splitNear = splitFar;
+  }
+  slot.depthBiasVP = slot.cascadeVP[0];
+}
+
+void Viewer::renderVarianceShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, bool receiverCulling) {
+  glm::mat4 faceVP[6];
+  shadowViewProjections(light, faceVP);
+
+  RenderStateTracker::bindFramebuffer(varianceFramebuffer);
+  depthMomentsProgram.attach_moments(varianceMomentsTexture);
+  RenderStateTracker::apply(RenderState(varianceFramebuffer, slot.size, slot.size)
+    .withDrawBuffers(depthMomentsProgram.shaders::FragmentShader::getDrawBuffers())
+    .withDepthTest(true)
+    .withCullFace(GL_BACK));
+  // Nothing in the way up to the far plane.
+  gl::ClearColor(SPOT_SHADOW_FAR_PLANE, SPOT_SHADOW_FAR_PLANE * SPOT_SHADOW_FAR_PLANE, 0.0f, 0.0f);
+  gl::Clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  gl::UseProgram(depthMomentsProgram.getProgramId());
+  std::vector<Mesh*> casters;
+  for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
+    if (shadowCasterFaces(light, faceVP, *it, receiverCulling) != 0) casters.push_back(*it);
+  }
+  slot.casterDraws += drawShadowCasters(&depthMomentsProgram, faceVP[0], casters, ALL_CASTERS);
+
+  // Both passes step one output texel, two texels of the full resolution moments.
+  int blurSize = slot.size / 2;
+  gl::UseProgram(varianceBlurProgram.getProgramId());
+  varianceBlurProgram.set_uvScale(slot.size / (float)varianceSize);
+
+  varianceBlurProgram.attach_blurredMoments(varianceBlurTexture);
+  RenderStateTracker::apply(RenderState(varianceFramebuffer, blurSize, blurSize)
+    .withDrawBuffers(varianceBlurProgram.shaders::FragmentShader::getDrawBuffers()));
+  varianceBlurProgram.set_moments(varianceMomentsTexture);
+  varianceBlurProgram.set_blurStep(glm::vec2(2.0f / varianceSize, 0.0f));
+  drawQuad();
+
+  varianceBlurProgram.attach_blurredMoments(slot.momentsTexture);
+  varianceBlurProgram.set_moments(varianceBlurTexture);
+  varianceBlurProgram.set_blurStep(glm::vec2(0.0f, 2.0f / varianceSize));
+  drawQuad();
+
+  gl::BindTexture(GL_TEXTURE_2D, slot.momentsTexture);
+  gl::GenerateMipmap(GL_TEXTURE_2D);
+  shaders::Shader::invalidateTextureBindings();
+
+  slot.depthBiasVP = shadowmapBiasMatrix * faceVP[0];
+}
+
+glm::mat4 Viewer::atlasRegionMatrix(int x, int y, int size) {
+  float scale = size / (float)SHADOW_ATLAS_SIZE;
+  return glm::scale(glm::translate(glm::mat4(1.0), glm::vec3(x / (float)SHADOW_ATLAS_SIZE, y / (float)SHADOW_ATLAS_SIZE, 0)), glm::vec3(scale, scale, 1));
+}
 
-  checkGLErrors("bindRenderTarget start");
-  // Render to target.
-  if (renderTargetFBO == 0) {
-    // Render to screen.
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDrawBuffer(GL_FRONT_LEFT);
+void Viewer::attachCubeFace(GLenum target, const ShadowSlot& slot, int face) {
+  if (slot.cubeLayer >= 0) {
+    gl::FramebufferTextureLayer(target, GL_DEPTH_ATTACHMENT, slot.cubeTexture, 0, 6 * slot.cubeLayer + face);
+  } else {
+    gl::FramebufferTexture2D(target, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, slot.cubeTexture, 0);
+  }
+}
+
+int Viewer::drawShadowPasses(Light* light, const glm::mat4 faceVP[6], const RenderState& state, int x, int y, int size, std::vector<Mesh*>& thisFrameMeshes, ShadowCasters casters, unsigned int faces, int firstLayer, bool receiverCulling) {
+  std::vector<Mesh*> faceCasters[6];
+  std::map<unsigned int, std::vector<Mesh*> > cubeCasters; // By the faces they reach.
+  bool cube = light->getType() == Light::POINT && !hasParaboloidShadow(light);
+  for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
+    unsigned int meshFaces = faces & shadowCasterFaces(light, faceVP, *it, receiverCulling);
+    if (meshFaces == 0) continue;
+    if (cube) {
+      cubeCasters[meshFaces].push_back(*it);
+      continue;
+    }
+    for (int face = 0; face < 2; face++) {
+      if (meshFaces & (1 << face)) faceCasters[face].push_back(*it);
+    }
+  }
+
+  int draws = 0;
+  if (cube) {
+    // All six faces of a cube map are drawn in one pass, the geometry shader
+    // routes triangles to their faces. Its depthMVP is just the model matrix.
+    // Meshes only go to the faces they can be seen from.
+    gl::UseProgram(cubeDepthProgram.getProgramId());
+    cubeDepthProgram.set_cubeFaceVP(faceVP);
+    cubeDepthProgram.set_cubeFirstLayer(firstLayer);
+    for (std::map<unsigned int, std::vector<Mesh*> >::iterator it = cubeCasters.begin(); it != cubeCasters.end(); it++) {
+      cubeDepthProgram.set_cubeFaceMask(it->first);
+      draws += drawShadowCasters(&cubeDepthProgram, glm::mat4(1.0), it->second, casters);
+    }
+  } else if (light->getType() == Light::POINT) {
+    // One pass per hemisphere, into the left and right halves of the region.
+    gl::UseProgram(paraboloidDepthProgram.getProgramId());
+    paraboloidDepthProgram.set_paraboloidNear(1.0f / paraboloidShadowFar(light));
+    for (int hemisphere = 0; hemisphere < 2; hemisphere++) {
+      RenderStateTracker::apply(state.withViewport(x + hemisphere * size, y, size, size).withClipDistances(2));
+      draws += drawShadowCasters(&paraboloidDepthProgram, faceVP[hemisphere], faceCasters[hemisphere], casters);
+    }
   } else {
-    glBindFramebuffer(GL_FRAMEBUFFER, renderTargetFBO);
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    gl::UseProgram(depthProgram.getProgramId());
+    draws += drawShadowCasters(&depthProgram, faceVP[0], faceCasters[0], casters);
   }
-  checkGLErrors("bindRenderTarget end");
+  return draws;
 }
 
-void Viewer::renderMesh(Mesh* mesh, bool onlyVerts) {
-  geomTexturesProgram.vbo_vertexPositionModelspace(mesh->getBuffer(Mesh::VERTEX_BUF));
+Viewer::StaticShadow* Viewer::updateStaticShadow(Light* light, const ShadowSlot& slot) {
+  std::map<Light*, StaticShadow>::iterator found = staticShadows.find(light);
+  if (found == staticShadows.end()) {
+    StaticShadow staticShadow;
+    staticShadow.position = light->getPosition();
+    staticShadow.direction = light->getDirection();
+    staticShadow.spread = light->getSpread();
+    staticShadow.stillFrames = 0;
+    staticShadow.framebuffer = 0;
+    staticShadow.texture = 0;
+    staticShadow.geometryVersion = staticGeometryVersion;
+    staticShadow.renderSize = slot.renderSize;
+    staticShadow.valid = false;
+    staticShadows[light] = staticShadow;
+    return NULL;
+  }
+  StaticShadow& staticShadow = found->second;
+
+  if (staticShadow.position != light->getPosition() || staticShadow.direction != light->getDirection() ||
+      staticShadow.spread != light->getSpread()) {
+    deleteStaticShadow(staticShadow);
+    staticShadow.position = light->getPosition();
+    staticShadow.direction = light->getDirection();
+    staticShadow.spread = light->getSpread();
+    staticShadow.stillFrames = 0;
+    return NULL;
+  }
+  if (++staticShadow.stillFrames < STATIC_SHADOW_STILL_FRAMES) return NULL;
+
+  if (staticShadow.texture == 0) {
+    // Same format and size as the shadow map it's blitted into.
+    gl::GenTextures(1, &staticShadow.texture);
+    if (slot.cubeTexture != 0) {
+      gl::BindTexture(GL_TEXTURE_CUBE_MAP, staticShadow.texture);
+      for (int i = 0; i < 6; i++) {
+        gl::TexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, slot.size, slot.size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+      }
+      gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    } else {
+      gl::BindTexture(GL_TEXTURE_2D, staticShadow.texture);
+      gl::TexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, slot.width, slot.size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+      gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    }
+    shaders::Shader::invalidateTextureBindings();
+    gl::GenFramebuffers(1, &staticShadow.framebuffer);
+    RenderStateTracker::bindFramebuffer(staticShadow.framebuffer);
+    gl::ReadBuffer(GL_NONE); // Depth only, for blitting from.
+    staticShadow.valid = false;
+  }
+  if (staticShadow.geometryVersion != staticGeometryVersion || staticShadow.renderSize != slot.renderSize) {
+    staticShadow.geometryVersion = staticGeometryVersion;
+    staticShadow.renderSize = slot.renderSize;
+    staticShadow.valid = false;
+  }
+  return &staticShadow;
+}
+
+void Viewer::deleteStaticShadow(StaticShadow& staticShadow) {
+  if (staticShadow.texture == 0) return;
+  gl::DeleteFramebuffers(1, &staticShadow.framebuffer);
+  gl::DeleteTextures(1, &staticShadow.texture);
+  shaders::Shader::invalidateTextureBindings();
+  staticShadow.framebuffer = 0;
+  staticShadow.texture = 0;
+  staticShadow.valid = false;
+}
+
+void Viewer::renderMesh(shaders::GeomTexturesProgram* program, Mesh* mesh, bool onlyVerts) {
+  program->vbo_vertexPositionModelspace(mesh->getBuffer(Mesh::VERTEX_BUF));
   if (!onlyVerts) {
-    geomTexturesProgram.vbo_vertexUV(mesh->getBuffer(Mesh::UV_BUF));
-    geomTexturesProgram.vbo_vertexNormalModelspace(mesh->getBuffer(Mesh::NORMAL_BUF));
-    geomTexturesProgram.vbo_vertexTangentModelspace(mesh->getBuffer(Mesh::TANGENT_BUF));
-    geomTexturesProgram.vbo_vertexBitangentModelspace(mesh->getBuffer(Mesh::BITANGENT_BUF));
+    program->vbo_vertexUV(mesh->getBuffer(Mesh::UV_BUF));
+    program->vbo_vertexNormalModelspace(mesh->getBuffer(Mesh::NORMAL_BUF));
+    program->vbo_vertexTangentModelspace(mesh->getBuffer(Mesh::TANGENT_BUF));
+    program->vbo_vertexBitangentModelspace(mesh->getBuffer(Mesh::BITANGENT_BUF));
   }
-  geomTexturesProgram.drawTriangleElements(mesh->getBuffer(Mesh::ELEMENT_BUF), mesh->getNumIndices());
+  program->drawTriangleElements(mesh->getBuffer(Mesh::ELEMENT_BUF), mesh->getNumIndices());
 }
 
 void Viewer::renderScene(GLuint renderTargetFBO, std::vector<Mesh*>& thisFrameMeshes, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, const glm::vec3& cameraPosition, bool postProcess, double currentTime, double deltaTime, const glm::vec3& halfspacePosition, const glm::vec3& halfspaceNormal, bool doPicking) {
 
   static glm::mat4 lastVP = projectionMatrix * viewMatrix;
 
-  // ======= Deferred rendering stage 1: Render geometry into textures. ===========
+  renderShadows(thisFrameMeshes, viewMatrix, projectionMatrix, currentTime);
 
-  // TODO: Make using program implicit.
-  glUseProgram(geomTexturesProgram.getProgramId());
+  // ======= Deferred rendering stage 1: Render geometry into textures. ===========
 
-  // Render to framebuffer.
-  glBindFramebuffer(GL_FRAMEBUFFER, deferredShadingFramebuffer);
-  glViewport(0, 0, width, height);
-  glEnable(GL_DEPTH_TEST);
+  // All variants share the G-buffer layout, so any of them can set it up.
+  shaders::GeomTexturesProgram* baseGeomProgram = geomTexturesPrograms.get(0);
 
   // Bind textures to fbo as multiple render target.
-  geomTexturesProgram.attach_gl_FragDepth(deferredDepthTexture);
-  geomTexturesProgram.attach_outDiffuse(deferredDiffuseTexture);
-  geomTexturesProgram.attach_outSpecular(deferredSpecularTexture);
-  geomTexturesProgram.attach_outEmissive(deferredEmissiveTexture);
-  geomTexturesProgram.attach_outNormal(deferredNormalTexture);
-  geomTexturesProgram.attach_outPicking(pickingTexture);
-
-  // Setup attachments here so we can clear all of them.
-  geomTexturesProgram.shaders::FragmentShader::setupDrawBuffers();
-
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
+  RenderStateTracker::bindFramebuffer(deferredShadingFramebuffer);
+  baseGeomProgram->attach_gl_FragDepth(deferredDepthTexture);
+  baseGeomProgram->attach_outDiffuse(deferredDiffuseTexture);
+  baseGeomProgram->attach_outSpecular(deferredSpecularTexture);
+  baseGeomProgram->attach_outEmissive(deferredEmissiveTexture);
+  baseGeomProgram->attach_outNormal(deferredNormalTexture);
+  baseGeomProgram->attach_outPicking(pickingTexture);
+
+  // Render to framebuffer. Draw buffers are set up here so we can clear all of them.
+  const RenderState geometryState = RenderState(deferredShadingFramebuffer, width, height)
+    .withDrawBuffers(baseGeomProgram->shaders::FragmentShader::getDrawBuffers())
+    .withDepthTest(true)
+    .withCullFace(GL_BACK);
+  RenderStateTracker::apply(geometryState);
 
   if (lightningLight->isEnabled()) {
-    glClearColor(0.8f, 0.8f, 0.8f, 1.0f);
+    gl::ClearColor(0.8f, 0.8f, 0.8f, 1.0f);
   } else {
-    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    gl::ClearColor(0.0f, 0.0f, 0.0f, 0.0f);
   }
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  gl::Clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   const glm::mat4 VP = projectionMatrix * viewMatrix;
 
-  // Send MVP transformations to currently bound shader.
-  geomTexturesProgram.set_V(viewMatrix);
-  //geomTexturesProgram.set_P(projectionMatrix);
-  // TODO: Find a better solution for this.
-  geomTexturesProgram.shaders::GeomTexturesVertShader::set_halfspacePoint(halfspacePosition);
-  geomTexturesProgram.shaders::GeomTexturesVertShader::set_halfspaceNormal(halfspaceNormal);
+  // Camera constants for all passes of this view.
+  shaders::ViewBlock& view = viewBlock.get();
+  view.V = viewMatrix;
+  view.P = projectionMatrix;
+  view.VP = VP;
+  view.invV = glm::inverse(viewMatrix);
+  view.invP = glm::inverse(projectionMatrix);
+  viewBlock.upload();
+
+  // Group meshes by permutation, so each variant is bound once.
+  std::vector<Mesh*> meshesByPermutation[shaders::GEOM_NUM_PERMUTATIONS];
+  for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
+    meshesByPermutation[geomTexturesKey((*it)->getMaterial())].push_back(*it);
+  }
 
+  for (unsigned int key = 0; key < shaders::GEOM_NUM_PERMUTATIONS; key++) {
+    if (meshesByPermutation[key].empty()) continue;
+    shaders::GeomTexturesProgram* program = geomTexturesPrograms.get(key);
+    if (program == NULL) continue;
 
-  for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
-    Mesh* mesh = *it;
+    // TODO: Make using program implicit.
+    gl::UseProgram(program->getProgramId());
 
-    glm::mat4 modelMatrix = mesh->getModelMatrix();
-    glm::mat4 MVP = VP * modelMatrix;
-
-    geomTexturesProgram.set_M(modelMatrix);
-    geomTexturesProgram.set_MVP(MVP);
-
-    // Bind mesh id for picking.
-    geomTexturesProgram.set_meshId(mesh->getId());
-
-    Material* material = mesh->getMaterial();
-    if (material != NULL) {
-      //geomTexturesProgram.set_material_ka(material_ka);
-      geomTexturesProgram.set_material_kd(material->getDiffuse());
-      geomTexturesProgram.set_material_ks(material->getSpecular());
-      geomTexturesProgram.set_material_shininess(material->getShininess());
-      geomTexturesProgram.set_material_emissive(material->getEmissive());
-
-      // Bind diffuse texture if it exists.
-      if (material->hasDiffuseTexture() && settings->isSet(Settings::TEXTURE_MAP)) {
-        geomTexturesProgram.set_useDiffuseTexture(true);
-        geomTexturesProgram.set_diffuseTexture(material->getDiffuseTexture()->getTextureId());
-      } else {
-        geomTexturesProgram.set_useDiffuseTexture(false);
-      }
+    // TODO: Find a better solution for this.
+    program->shaders::GeomTexturesVertShader::set_halfspacePoint(halfspacePosition);
+    program->shaders::GeomTexturesVertShader::set_halfspaceNormal(halfspaceNormal);
+
+    for (std::vector<Mesh*>::const_iterator it = meshesByPermutation[key].begin(); it != meshesByPermutation[key].end(); it++) {
+      Mesh* mesh = *it;
+
+      program->set_M(mesh->getModelMatrix());
 
-      // Avoid hardware perspective divide if pre-divided for mirrors.
-      geomTexturesProgram.set_useNoPerspectiveUVs(material->isMirror() && settings->isSet(Settings::MIRRORS));
+      // Bind mesh id for picking.
+      program->set_meshId(mesh->getId());
 
-      // Bind normal texture if it exists.
-      if (material->hasNormalTexture() && settings->isSet(Settings::NORMAL_MAP)) {
-        geomTexturesProgram.set_useNormalTexture(true);
-        geomTexturesProgram.set_normalTexture(material->getNormalTexture()->getTextureId());
-      } else {
-        geomTexturesProgram.set_useNormalTexture(false);
+      Material* material = mesh->getMaterial();
+      if (material != NULL) {
+        program->set_materialIndex(material->getId());
+
+        // Bind diffuse texture if this variant uses it.
+        if (key & shaders::GEOM_DIFFUSE_TEXTURE) {
+          Texture* diffuseTexture = material->getDiffuseTexture();
+          diffuseTexture->requestLevel(requiredMipLevel(mesh, diffuseTexture, cameraPosition, projectionMatrix));
+          program->set_diffuseTexture(diffuseTexture->getTextureId());
+        }
+
+        // Avoid hardware perspective divide if pre-divided for mirrors.
+        program->set_useNoPerspectiveUVs(material->isMirror() && settings->isSet(Settings::MIRRORS));
+
+        // Bind normal texture if this variant uses it.
+        if (key & shaders::GEOM_NORMAL_TEXTURE) {
+          Texture* normalTexture = material->getNormalTexture();
+          normalTexture->requestLevel(requiredMipLevel(mesh, normalTexture, cameraPosition, projectionMatrix));
+          program->set_normalTexture(normalTexture->getTextureId());
+        }
       }
-    }
 
-    renderMesh(mesh);
+      renderMesh(program, mesh);
+    }
   }
 
   // Render point lights as spheres.
   if (RENDER_LIGHTS_AS_SPHERES) {
-    geomTexturesProgram.set_useDiffuseTexture(false);
-    geomTexturesProgram.set_useNormalTexture(false);
-    for (std::vector<Light*>::const_iterator lightIt = lights.begin(); lightIt != lights.end(); lightIt++) {
-      Light *light = *lightIt;
+    gl::UseProgram(baseGeomProgram->getProgramId());
+    for (unsigned int lightId = 0; lightId < lights.size(); lightId++) {
+      Light *light = lights[lightId];
       if (!light->isEnabled() || (light->getType() != Light::POINT && light->getType() != Light::SPOT)) continue;
 
       // Set model matrix to move model to point light's position.
       glm::mat4 sphereModelMatrix = glm::translate(glm::mat4(1.0), light->getPosition()) * pointLightMesh->getModelMatrix();
-      glm::mat4 MVP = VP * sphereModelMatrix;
-      geomTexturesProgram.set_M(sphereModelMatrix);
-      geomTexturesProgram.set_MVP(MVP);
+      baseGeomProgram->set_M(sphereModelMatrix);
 
       // Use light's diffuse as emissive material.
-      geomTexturesProgram.set_material_kd(glm::vec3(0));
-      geomTexturesProgram.set_material_ks(glm::vec3(0));
-      glm::vec3 emissiveLight = light->getColour();
-      emissiveLight *= 5.0;
-      geomTexturesProgram.set_material_emissive(emissiveLight);
+      baseGeomProgram->set_materialIndex(lightSphereMaterials[lightId]->getId());
 
-      renderMesh(pointLightMesh);
+      renderMesh(baseGeomProgram, pointLightMesh);
     }
   }
 
   // Picking - just get id of middle pixel!
   lastPickedMesh = 0;
   if (doPicking) {
-    glBindFramebuffer(GL_FRAMEBUFFER, deferredShadingFramebuffer);
-    glBindTexture(GL_TEXTURE_2D, pickingTexture);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pickingTexture, 0);
-    glReadPixels(width/2, height/2, 1, 1, GL_RED, GL_UNSIGNED_INT, &lastPickedMesh);
+    RenderStateTracker::bindFramebuffer(deferredShadingFramebuffer);
+    gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pickingTexture, 0);
+    gl::ReadPixels(width/2, height/2, 1, 1, GL_RED, GL_UNSIGNED_INT, &lastPickedMesh);
   }
 
 
   // ======= Shadow map and blend deferred shading for each light ======================
 
-  // Clear target first.
-  if (postProcess) {
-    // Render to texture.
-    glBindFramebuffer(GL_FRAMEBUFFER, accumRenderFramebuffer);
-    glBindTexture(GL_TEXTURE_2D, accumRenderTexture);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumRenderTexture, 0);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderBuffers[0]);
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
-  } else {
-    bindRenderTarget(renderTargetFBO);
-  }
+  // Lights accumulate into a texture for post-processing, otherwise straight into the target.
+  const RenderState lightTargetState = RenderState(postProcess ? accumRenderFramebuffer : renderTargetFBO, width, height)
+    .withCullFace(GL_BACK);
 
-  glViewport(0, 0, width, height);
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-  glEnable(GL_DEPTH_TEST);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  // Clear target first.
+  RenderStateTracker::apply(lightTargetState);
+  gl::ClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  gl::Clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   bool firstBlendPass = true;
 
-  for (std::vector<Light*>::const_iterator it = lights.begin(); it != lights.end(); it++) {
-    Light* light = *it;
+  // ======= Base pass: emissive and ambient light, once for all lights. ===========
+
+  glm::vec3 lightAmbience(0, 0, 0);
+  int numTiledLights = 0;
+  for (unsigned int lightId = 0; lightId < lights.size(); lightId++) {
+    Light* light = lights[lightId];
     if (!light->isEnabled()) continue;
+    lightAmbience += light->getAmbience();
+    if (isTiledLight(lightId)) numTiledLights++;
+  }
 
-    glm::vec3 lightPos = light->getPosition();
-    glm::vec3 lightDir = light->getDirection();
-    glm::mat4 shadowmapDepthBiasVP;
-
-    // ======= Shadow mapping =========
-    if (settings->isSet(Settings::SHADOW_MAP)) {
-      glUseProgram(depthProgram.getProgramId());
-      if (light->getType() == Light::POINT) {
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowCubeMapFramebuffer);
-      } else {
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFramebuffer);
-      }
+  shaders::DeferredShadingProgram* baseShadingProgram = deferredShadingPrograms.get(baseShadingKey());
+  if (baseShadingProgram != NULL) {
+    gl::UseProgram(baseShadingProgram->getProgramId());
+    firstBlendPass = false;
+    RenderStateTracker::apply(lightTargetState.withBlend(GL_ONE, GL_ZERO));
 
-      glDrawBuffer(GL_NONE); // No colour output.
-      glViewport(0, 0, SHADOWMAP_WIDTH, SHADOWMAP_HEIGHT);
-      glEnable(GL_DEPTH_TEST);
+    baseShadingProgram->set_diffuseTexture(deferredDiffuseTexture);
+    baseShadingProgram->set_emissiveTexture(deferredEmissiveTexture);
+    baseShadingProgram->set_normalTexture(deferredNormalTexture);
+    baseShadingProgram->set_depthTexture(deferredDepthTexture);
+    baseShadingProgram->set_ssaoNoiseTexture(ssaoNoiseTexture);
+    baseShadingProgram->set_lightAmbience(lightAmbience);
+    baseShadingProgram->set_ssaoKernel(ssaoKernel);
 
-      glm::mat4 depthVP;
+    drawQuad();
+  }
 
-      // Loop for all shadow maps that have to be generated for this light.
-      for (int shadowMapFace = 0; shadowMapFace < 6; shadowMapFace++) {
+  // ======= Tiled lighting: all lights without shadows in one pass. ===========
 
-        // Bind shadow map texture.
-        if (light->getType() == Light::POINT) {
-          // Shadow cube map.
-          glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + shadowMapFace, shadowmapCubeDepthTexture, 0);
-        } else {
-          glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowmapDepthTexture, 0);
-        }
+  shaders::DeferredShadingProgram* tiledShadingProgram = numTiledLights > 0 ? deferredShadingPrograms.get(tiledShadingKey()) : NULL;
+  if (tiledShadingProgram != NULL) {
+    buildLightTiles(viewMatrix, projectionMatrix);
 
-        glClear(GL_DEPTH_BUFFER_BIT);
-
-        // Compute the MVP matrix from the light's point of view.
-        glm::mat4 depthProjectionMatrix;
-        glm::mat4 depthViewMatrix;
-        glm::vec3 lightDirectionWorldspace;
-        switch (light->getType()) {
-          case Light::DIRECTIONAL:
-            // TODO: Need to adjust for scene size...
-            //depthProjectionMatrix = glm::ortho<float>(-10, 10, -10, 10, -10, 20);
-            depthProjectionMatrix = glm::ortho<float>(-40, 40, -40, 40, -10, 100);
-            depthViewMatrix = glm::lookAt(glm::vec3(0, 0, 0), lightDir, glm::vec3(0, 1, 0));
-            break;
-          case Light::SPOT:
-            depthProjectionMatrix = glm::perspective(light->getSpread() + 15.0f, 1.0f, 2.0f, 100.0f);
-            depthViewMatrix = glm::lookAt(lightPos, lightPos + lightDir, glm::vec3(0, 1, 0));
-            break;
-          case Light::POINT:
-            depthProjectionMatrix = glm::perspective(90.0f, 1.0f, 1.0f, 500.0f);
-            switch (shadowMapFace) {
-              case 0: // +X
-                depthViewMatrix = glm::lookAt(lightPos, lightPos + glm::vec3(1, 0, 0), glm::vec3(0, -1, 0));
-                break;
-              case 1: // -X
-                depthViewMatrix = glm::lookAt(lightPos, lightPos + glm::vec3(-1, 0, 0), glm::vec3(0, -1, 0));
-                break;
-              case 2:// +Y
-                depthViewMatrix = glm::lookAt(lightPos, lightPos + glm::vec3(0, 1, 0), glm::vec3(0, 0, 1));
-                break;
-              case 3: // -Y
-                depthViewMatrix = glm::lookAt(lightPos, lightPos + glm::vec3(0, -1, 0), glm::vec3(0, 0, -1));
-                break;
-              case 4:// +Z
-                depthViewMatrix = glm::lookAt(lightPos, lightPos + glm::vec3(0, 0, 1), glm::vec3(0, -1, 0));
-                break;
-              case 5: // -Z
-                depthViewMatrix = glm::lookAt(lightPos, lightPos + glm::vec3(0, 0, -1), glm::vec3(0, -1, 0));
-                break;
-            }
-            break;
-        }
-        depthVP = depthProjectionMatrix * depthViewMatrix;
+    gl::UseProgram(tiledShadingProgram->getProgramId());
+    if (firstBlendPass) {
+      firstBlendPass = false;
+      RenderStateTracker::apply(lightTargetState.withBlend(GL_ONE, GL_ZERO));
+    } else {
+      RenderStateTracker::apply(lightTargetState.withBlend(GL_ONE, GL_ONE));
+    }
 
-        for (std::vector<Mesh*>::const_iterator it = thisFrameMeshes.begin(); it != thisFrameMeshes.end(); it++) {
-          glm::mat4 depthMVP = depthVP * (*it)->getModelMatrix();
-          depthProgram.set_depthMVP(depthMVP);
+    tiledShadingProgram->set_diffuseTexture(deferredDiffuseTexture);
+    tiledShadingProgram->set_specularTexture(deferredSpecularTexture);
+    tiledShadingProgram->set_normalTexture(deferredNormalTexture);
+    tiledShadingProgram->set_depthTexture(deferredDepthTexture);
+    tiledShadingProgram->set_tileLightMasks(lightTileTexture);
+    tiledShadingProgram->set_shadowMapCubeArray(shadowCubeArrayTexture);
 
-          renderMesh(*it, true);
-        }
+    drawQuad();
+  }
 
-        if (light->getType() != Light::POINT) break;
-      }
+  // Light volumes are stencil tested against the scene's depth, which only
+  // the accumulation framebuffer has a buffer for.
+  bool useLightVolumes = postProcess;
+  if (useLightVolumes) {
+    gl::BindFramebuffer(GL_READ_FRAMEBUFFER, deferredShadingFramebuffer);
+    gl::BlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    gl::BindFramebuffer(GL_READ_FRAMEBUFFER, accumRenderFramebuffer);
+  }
 
-      if (light->getType() == Light::POINT) {
-        // TODO: Figure out why we need to shift by -1 here.
-        depthVP = glm::translate(glm::mat4(1.0), glm::vec3(-lightPos.x - 1, -lightPos.y - 1, -lightPos.z - 1));
-      }
+  for (unsigned int lightId = 0; lightId < lights.size(); lightId++) {
+    Light* light = lights[lightId];
+    if (!light->isEnabled() || isTiledLight(lightId)) continue;
 
-      shadowmapDepthBiasVP = shadowmapBiasMatrix * depthVP;
-    }
+    // Lights that can't reach the view aren't shaded, and renderShadows() skipped them too.
+    int scissorRect[4];
+    if (!lightScreenRect(light, viewMatrix, projectionMatrix, scissorRect)) continue;
 
-    // ======= Deferred rendering stage 2: Deferred rendering using textures. ===========
+    bool lightVolume = useLightVolumes && hasLightVolume(light);
+    shaders::DeferredShadingProgram* deferredShadingProgram = deferredShadingPrograms.get(deferredShadingKey(light) | (lightVolume ? shaders::DEFERRED_LIGHT_VOLUME : 0));
+    if (deferredShadingProgram == NULL) continue;
 
-    glUseProgram(deferredShadingProgram.getProgramId());
+    ShadowSlot& shadowSlot = shadowSlots[lightId];
 
-    if (postProcess) {
-      // Set output to accumulation texture.
-      glBindFramebuffer(GL_FRAMEBUFFER, accumRenderFramebuffer);
-      glBindTexture(GL_TEXTURE_2D, accumRenderTexture);
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumRenderTexture, 0);
-      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderBuffers[0]);
-      glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    } else {
-      bindRenderTarget(renderTargetFBO);
+    // ======= Deferred rendering stage 2: Deferred rendering using textures. ===========
+
+    glm::mat4 lightVolumeMVP;
+    if (lightVolume) {
+      lightVolumeMVP = projectionMatrix * viewMatrix * lightVolumeMatrix(light);
+
+      // Stencil in the pixels whose geometry is inside the volume: behind its
+      // front faces but in front of its back faces.
+      gl::UseProgram(depthProgram.getProgramId());
+      RenderStateTracker::apply(RenderState(accumRenderFramebuffer, width, height)
+        .withScissor(scissorRect[0], scissorRect[1], scissorRect[2], scissorRect[3])
+        .withDrawBuffer(GL_NONE)
+        .withDepthTest(true)
+        .withDepthWrite(false)
+        .withStencilTest(GL_ALWAYS, 0)
+        .withStencilOp(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP)
+        .withStencilOp(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP));
+      gl::Clear(GL_STENCIL_BUFFER_BIT);
+      depthProgram.set_depthMVP(lightVolumeMVP);
+      drawLightVolume(&depthProgram, light);
     }
 
-    glViewport(0, 0, width, height);
-    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    gl::UseProgram(deferredShadingProgram->getProgramId());
 
     // Blend in order to accumulate lights.
-    glEnablei(GL_BLEND, 0);
-    glDisable(GL_DEPTH_TEST);
+    RenderState lightState = lightTargetState.withScissor(scissorRect[0], scissorRect[1], scissorRect[2], scissorRect[3]);
     if (firstBlendPass) {
       firstBlendPass = false;
-      glBlendFunc(GL_ONE, GL_ZERO);
+      lightState = lightState.withBlend(GL_ONE, GL_ZERO);
     } else {
-      glBlendFunc(GL_ONE, GL_ONE);
+      lightState = lightState.withBlend(GL_ONE, GL_ONE);
     }
+    if (lightVolume) {
+      // Back faces, so the volume is still drawn with the camera inside it.
+      lightState = lightState.withCullFace(GL_FRONT).withStencilTest(GL_NOTEQUAL, 0);
+    }
+    RenderStateTracker::apply(lightState);
 
-    deferredShadingProgram.set_diffuseTexture(deferredDiffuseTexture);
-    deferredShadingProgram.set_specularTexture(deferredSpecularTexture);
-    deferredShadingProgram.set_emissiveTexture(deferredEmissiveTexture);
-    deferredShadingProgram.set_normalTexture(deferredNormalTexture);
-    deferredShadingProgram.set_depthTexture(deferredDepthTexture);
-    deferredShadingProgram.set_shadowMap(shadowmapDepthTexture);
+    deferredShadingProgram->set_diffuseTexture(deferredDiffuseTexture);
+    deferredShadingProgram->set_specularTexture(deferredSpecularTexture);
+    deferredShadingProgram->set_normalTexture(deferredNormalTexture);
+    deferredShadingProgram->set_depthTexture(deferredDepthTexture);
+    deferredShadingProgram->set_shadowMap(shadowAtlasTexture);
 
     /*
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     // Don't know if this is necessary - doesn't seem to do anything.
-    //glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE, GL_INTENSITY);
+    //gl::TexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE, GL_INTENSITY);
     */
 
-    deferredShadingProgram.set_shadowMapCube(shadowmapCubeDepthTexture);
+    deferredShadingProgram->set_shadowMapCube(shadowSlot.cubeTexture);
+    deferredShadingProgram->set_shadowMoments(shadowSlot.momentsTexture);
 
     // TODO: Do we need these?
     /*
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
     */
 
-    deferredShadingProgram.set_ssaoNoiseTexture(ssaoNoiseTexture);
-
     /*
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    //glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_DEPTH_TEXTURE_MODE, GL_INTENSITY);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    //gl::TexParameteri(GL_TEXTURE_CUBE_MAP, GL_DEPTH_TEXTURE_MODE, GL_INTENSITY);
     */
 
-    deferredShadingProgram.set_V(viewMatrix);
-    deferredShadingProgram.set_P(projectionMatrix);
-    deferredShadingProgram.set_shadowmapDepthBiasVP(shadowmapDepthBiasVP);
-    deferredShadingProgram.set_lightDirectionWorldspace(lightDir);
-    deferredShadingProgram.set_lightPositionWorldspace(lightPos);
-
-    deferredShadingProgram.set_useDiffuse(settings->isSet(Settings::LIGHT_DIFFUSE));
-    deferredShadingProgram.set_useSpecular(settings->isSet(Settings::LIGHT_SPECULAR));
-    deferredShadingProgram.set_useShadow(settings->isSet(Settings::SHADOW_MAP));
-    deferredShadingProgram.set_useSSAO(settings->isSet(Settings::SSAO));
-    deferredShadingProgram.set_ssaoKernel(ssaoKernel);
-
-    deferredShadingProgram.set_lightType((int) light->getType());
-    deferredShadingProgram.set_lightColour(light->getColour());
-    deferredShadingProgram.set_lightAmbience(light->getAmbience());
-    deferredShadingProgram.set_lightFalloff(light->getFalloff());
-    deferredShadingProgram.set_lightSpreadDegrees(light->getSpread());
-
-    drawQuad();
+    deferredShadingProgram->set_shadowmapDepthBiasVP(shadowSlot.depthBiasVP);
+    deferredShadingProgram->set_shadowCascadeVP(shadowSlot.cascadeVP);
+    deferredShadingProgram->set_shadowCascadeEnds(shadowSlot.cascadeEnds);
+    deferredShadingProgram->set_shadowAtlasRegion(glm::vec4(shadowSlot.atlasX, shadowSlot.atlasY, shadowSlot.renderWidth, shadowSlot.renderSize) / (float)SHADOW_ATLAS_SIZE);
+    if (lightId / MAX_LIGHTS != uploadedLightBatch) {
+      uploadLights(lightId / MAX_LIGHTS);
+    }
+    deferredShadingProgram->set_lightIndex(lightId % MAX_LIGHTS);
 
-    glDisablei(GL_BLEND, 0);
+    if (lightVolume) {
+      deferredShadingProgram->set_lightVolumeMVP(lightVolumeMVP);
+      drawLightVolume(deferredShadingProgram, light);
+    } else {
+      drawQuad();
+    }
+  }
+  // The next view's tiled pass reads the first batch.
+  if (uploadedLightBatch != 0) {
+    uploadLights(0);
   }
 
   // --------- Final pass - post-processing and rendering to screen ---------------
 
   if (postProcess) {
-    glUseProgram(postProcessProgram.getProgramId());
+    gl::UseProgram(postProcessProgram.getProgramId());
 
-    glViewport(0, 0, width, height);
     // TODO: Clear?
-
-    bindRenderTarget(renderTargetFBO);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
-    glDisable(GL_DEPTH_TEST);
+    RenderStateTracker::apply(RenderState(renderTargetFBO, width, height).withCullFace(GL_BACK));
 
     postProcessProgram.set_tex(accumRenderTexture);
     postProcessProgram.set_depthTexture(deferredDepthTexture);
@@ -881,7 +2016,7 @@ void Viewer::run() {
   backgroundMusic->loop();
   controller->reset();
 
-  glBindVertexArray(vertexArrayId);
+  gl::BindVertexArray(vertexArrayId);
 
   double lastTime = glfwGetTime();
   long fpsDisplayCounter = 0;
@@ -956,36 +2091,53 @@ void Viewer::run() {
       gunLight->setEnabled(false);
     }
 
+    // Shared by the mirror views and the main view.
+    uploadLights(0);
+
+    // Mirror views, found once for the shadow caster culling and their renders.
+    std::vector<Mesh*> mirrorMeshes;
+    std::vector<glm::mat4> mirroredViewMatrices;
     if (settings->isSet(Settings::MIRRORS)) {
-      // Note that this technique won't generally work for multiple mirrors without cube maps, because mirror view is only rendered one direction.
-      // Can probably get this to work with two mirrors facing each other.
       for (std::vector<Mesh*>::const_iterator it = meshes.begin(); it != meshes.end(); it++) {
-        Mesh* mesh = *it;
-        Material* material = mesh->getMaterial();
+        Material* material = (*it)->getMaterial();
         if (material == NULL || !material->isMirror()) continue;
+        mirrorMeshes.push_back(*it);
+        mirroredViewMatrices.push_back(controller->getMirroredViewMatrix((*it)->getFirstFourVertices()[0], (*it)->getFirstNormal()));
+      }
+    }
 
-        Mirror* mirror = static_cast<Mirror*>(material);
-
-        const glm::vec3 *mirrorQuad = mesh->getFirstFourVertices();
-        const glm::vec3 mirrorVertex = mirrorQuad[0];
-        const glm::vec3 mirrorNormal = mesh->getFirstNormal();
-        const glm::mat4 mirroredViewMatrix = controller->getMirroredViewMatrix(mirrorVertex, mirrorNormal);
-
-        // TODO: This is a hack - make it work generally by scaling using original UVs...
-        const glm::mat4 uvVP = projectionMatrix * mirroredViewMatrix * mesh->getModelMatrix();
-        std::vector<glm::vec2> newUVs;
-        for (int i = 0; i < 4; i++) {
-          glm::vec4 projUV = uvVP * glm::vec4(mirrorQuad[i], 1);
-          projUV = projUV / projUV[3];
-          // Important Note: These are now pre-computed as perspective-corrected, so hardware perspective correction needs to be turned off when interpolating these!
-          newUVs.push_back(glm::vec2(projUV[0] * 0.5f + 0.5f, projUV[1] * 0.5f + 0.5f));
-        }
-        mesh->setUVs(newUVs);
-
-        renderScene(mirror->getMirrorFBO(), thisFrameMeshes, mirroredViewMatrix, projectionMatrix, cameraPosition, false, currentTime, deltaTime, mirrorVertex, mirrorNormal, false);
+    // Shadows are rendered in the first view and reused in the rest, so casters are culled against all of them.
+    shadowReceiverVPs.clear();
+    shadowReceiverVPs.push_back(projectionMatrix * viewMatrix);
+    for (unsigned int i = 0; i < mirroredViewMatrices.size(); i++) {
+      shadowReceiverVPs.push_back(projectionMatrix * mirroredViewMatrices[i]);
+    }
 
-        mirror->update();
+    // Note that this technique won't generally work for multiple mirrors without cube maps, because mirror view is only rendered one direction.
+    // Can probably get this to work with two mirrors facing each other.
+    for (unsigned int mirrorIndex = 0; mirrorIndex < mirrorMeshes.size(); mirrorIndex++) {
+      Mesh* mesh = mirrorMeshes[mirrorIndex];
+      Mirror* mirror = static_cast<Mirror*>(mesh->getMaterial());
+
+      const glm::vec3 *mirrorQuad = mesh->getFirstFourVertices();
+      const glm::vec3 mirrorVertex = mirrorQuad[0];
+      const glm::vec3 mirrorNormal = mesh->getFirstNormal();
+      const glm::mat4& mirroredViewMatrix = mirroredViewMatrices[mirrorIndex];
+
+      // TODO: This is a hack - make it work generally by scaling using original UVs...
+      const glm::mat4 uvVP = projectionMatrix * mirroredViewMatrix * mesh->getModelMatrix();
+      std::vector<glm::vec2> newUVs;
+      for (int i = 0; i < 4; i++) {
+        glm::vec4 projUV = uvVP * glm::vec4(mirrorQuad[i], 1);
+        projUV = projUV / projUV[3];
+        // Important Note: These are now pre-computed as perspective-corrected, so hardware perspective correction needs to be turned off when interpolating these!
+        newUVs.push_back(glm::vec2(projUV[0] * 0.5f + 0.5f, projUV[1] * 0.5f + 0.5f));
       }
+      mesh->setUVs(newUVs);
+
+      renderScene(mirror->getMirrorFBO(), thisFrameMeshes, mirroredViewMatrix, projectionMatrix, cameraPosition, false, currentTime, deltaTime, mirrorVertex, mirrorNormal, false);
+
+      mirror->update();
     }
 
     // Main render of scene.
@@ -1011,6 +2163,7 @@ void Viewer::run() {
             newEnd = std::remove(meshes.begin(), newEnd, *it);
           }
           meshes.erase(newEnd, meshes.end());
+          invalidateStaticShadows();
         }
 
 
@@ -1030,22 +2183,18 @@ void Viewer::run() {
             newEnd = std::remove(meshes.begin(), newEnd, *it);
           }
           meshes.erase(newEnd, meshes.end());
+          invalidateStaticShadows();
         }
       }
     }
 
 
     // ============ Debug Rendering =============
-    if (RENDER_DEBUG_IMAGES) {
-      glUseProgram(quadProgram.getProgramId());
-
-      // Render to the screen
-      glBindFramebuffer(GL_FRAMEBUFFER, 0);
-      glDrawBuffer(GL_FRONT_LEFT);
+    if (RENDER_DEBUG_IMAGES && quadProgram.finish()) {
+      gl::UseProgram(quadProgram.getProgramId());
 
-      // Must be disabled to draw overtop.
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
-      glDisable(GL_DEPTH_TEST);
+      // Render to the screen, with depth test off.
+      const RenderState debugState(0, width, height);
 
       /*
       // Debug draw mirrors.
@@ -1059,52 +2208,57 @@ void Viewer::run() {
 
       // Draw mirror 1 ----------------
       if (allMirrors.size() >= 1) {
-        glViewport(0, 0, width/4, height/4);
-        glBindTexture(GL_TEXTURE_2D, static_cast<Mirror*>(allMirrors[0]->getMaterial())->getMirrorTexture()->getTextureId());
+        gl::Viewport(0, 0, width/4, height/4);
+        gl::BindTexture(GL_TEXTURE_2D, static_cast<Mirror*>(allMirrors[0]->getMaterial())->getMirrorTexture()->getTextureId());
         drawQuad();
       }
 
       // Draw mirror 2 ----------------
       if (allMirrors.size() >= 2) {
-        glViewport(width/4, 0, width/4, height/4);
-        glBindTexture(GL_TEXTURE_2D, static_cast<Mirror*>(allMirrors[1]->getMaterial())->getMirrorTexture()->getTextureId());
+        gl::Viewport(width/4, 0, width/4, height/4);
+        gl::BindTexture(GL_TEXTURE_2D, static_cast<Mirror*>(allMirrors[1]->getMaterial())->getMirrorTexture()->getTextureId());
         drawQuad();
       }
       */
 
       // Draw diffuse ----------------
-      glViewport(0, 0, height/4, height/4);
+      RenderStateTracker::apply(debugState.withViewport(0, 0, height/4, height/4));
       quadProgram.set_texture(deferredDiffuseTexture);
       drawQuad();
 
       // Draw normals ----------------
-      glViewport(height/4, 0, height/4, height/4);
+      RenderStateTracker::apply(debugState.withViewport(height/4, 0, height/4, height/4));
       quadProgram.set_texture(deferredNormalTexture);
       drawQuad();
 
       // Draw depth ----------------
-      glViewport(height/2, 0, height/4, height/4);
+      RenderStateTracker::apply(debugState.withViewport(height/2, 0, height/4, height/4));
       quadProgram.set_texture(deferredDepthTexture);
       drawQuad();
 
       // Draw noise --------------------
-      glViewport(height * 3 / 4, 0, height/4, height/4);
+      RenderStateTracker::apply(debugState.withViewport(height * 3 / 4, 0, height/4, height/4));
       quadProgram.set_texture(ssaoNoiseTexture);
       drawQuad();
 
       // Draw shadowmap ----------------
-      glViewport(0, height*3/4, height/4, height/4);
-      quadProgram.set_texture(shadowmapDepthTexture);
+      RenderStateTracker::apply(debugState.withViewport(0, height*3/4, height/4, height/4));
+      // Read as a colour, so depth compare is off just while it's drawn.
+      // Forcing the bind makes its unit the active one.
+      shaders::Shader::invalidateTextureBindings();
+      quadProgram.set_texture(shadowAtlasTexture);
+      gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
       drawQuad();
+      gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
 
       // Draw cube shadowmap ----------
-      //glViewport(height/4, height*3/4, height/4, height/4);
-      //glBindTexture(GL_TEXTURE_CUBE_MAP, shadowmapCubeDepthTexture);
+      //gl::Viewport(height/4, height*3/4, height/4, height/4);
+      //gl::BindTexture(GL_TEXTURE_CUBE_MAP, shadowSlots[0].cubeTexture);
       //drawQuad();
 
       // Draw picking texture ------------
-      //glViewport(0, 0, width/4, height/4);
-      //glBindTexture(GL_TEXTURE_2D, pickingTexture);
+      //gl::Viewport(0, 0, width/4, height/4);
+      //gl::BindTexture(GL_TEXTURE_2D, pickingTexture);
       //drawQuad();
     }
     // =========== End Debug =================
@@ -1112,12 +2266,28 @@ void Viewer::run() {
     // Swap buffers
     glfwSwapBuffers(window);
 
+    Texture::endFrame();
+    updateShaders();
+
     fpsDisplayCounter++;
     if (fpsDisplayCounter % FPS_SAMPLE_RATE == 0) {
       double fpsDeltaTime = float(currentTime - lastFPSTime);
       lastFPSTime = currentTime;
       std::cout << FPS_SAMPLE_RATE / fpsDeltaTime << "FPS" << std::endl;
+      Texture::printCacheStats();
+      std::cout << "GL calls last frame: " << shaders::Shader::getIssuedCalls() << " issued, "
+                << shaders::Shader::getSkippedCalls() << " skipped" << std::endl;
+      std::cout << "State changes last frame: " << RenderStateTracker::getIssuedChanges() << " issued, "
+                << RenderStateTracker::getSkippedChanges() << " skipped" << std::endl;
+      std::cout << "Shadow map texels last frame: " << shadowTexels << " / " << SHADOW_TEXEL_BUDGET << " budget" << std::endl;
+      std::cout << "Shadow caster draws by light:";
+      for (unsigned int i = 0; i < shadowSlots.size(); i++) {
+        if (shadowSlots[i].size > 0) std::cout << " " << i << ": " << shadowSlots[i].casterDraws;
+      }
+      std::cout << std::endl;
     }
+    shaders::Shader::resetCallCounters();
+    RenderStateTracker::resetCounters();
     //timespec ts;
     //ts.tv_sec = 0;
     //ts.tv_nsec = 30*1000;
@@ -1131,6 +2301,92 @@ void Viewer::run() {
       glfwWindowShouldClose(window) == 0 );
 }
 
+Viewer::BenchmarkResult Viewer::benchmarkFrames(gl::NullBackend* backend, int numFrames, bool mirrorsOnly) {
+  const glm::vec3 cameraPosition(0, 3.5, -40);
+  const glm::vec3 cameraDirection(0, 0, 1);
+  const glm::mat4 viewMatrix = glm::lookAt(cameraPosition, cameraPosition + cameraDirection, glm::vec3(0, 1, 0));
+  const glm::mat4 projectionMatrix = glm::perspective(45.0f, width/(float)height, 0.1f, 100.0f);
+  bool doPostProcessing = settings->isSet(Settings::BLUR) || settings->isSet(Settings::MOTION_BLUR);
+
+  std::vector<Mesh*> thisFrameMeshes(meshes);
+  thisFrameMeshes.insert(thisFrameMeshes.begin(), characterMeshes[0].begin(), characterMeshes[0].end());
+
+  BenchmarkResult result;
+  result.views = 0;
+  uploadLights(0);
+  backend->resetCounters();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (int frame = 0; frame < numFrames; frame++) {
+    double currentTime = frame * TARGET_FRAME_DELTA;
+    if (!mirrorsOnly) {
+      renderScene(0, thisFrameMeshes, viewMatrix, projectionMatrix, cameraPosition, doPostProcessing, currentTime, TARGET_FRAME_DELTA, glm::vec3(0), glm::vec3(0), true);
+      result.views++;
+      continue;
+    }
+
+    for (std::vector<Mesh*>::const_iterator it = meshes.begin(); it != meshes.end(); it++) {
+      Material* material = (*it)->getMaterial();
+      if (material == NULL || !material->isMirror()) continue;
+
+      // Same reflected camera as the controller builds.
+      const glm::vec3 mirrorVertex = (*it)->getFirstFourVertices()[0];
+      const glm::vec3 mirrorNormal = (*it)->getFirstNormal();
+      glm::vec3 eye = cameraPosition - 2 * glm::dot(mirrorNormal, cameraPosition - mirrorVertex) * mirrorNormal;
+      glm::vec3 target = cameraPosition + cameraDirection;
+      target = target - 2 * glm::dot(mirrorNormal, target - mirrorVertex) * mirrorNormal;
+      const glm::mat4 mirroredViewMatrix = glm::lookAt(eye, target, glm::vec3(0, 1, 0));
+
+      Mirror* mirror = static_cast<Mirror*>(material);
+      renderScene(mirror->getMirrorFBO(), thisFrameMeshes, mirroredViewMatrix, projectionMatrix, cameraPosition, false, currentTime, TARGET_FRAME_DELTA, mirrorVertex, mirrorNormal, false);
+      mirror->update();
+      result.views++;
+    }
+  }
+
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.drawCalls = backend->getDrawCalls();
+  result.glCalls = backend->getTotalCalls();
+  return result;
+}
+
+void Viewer::runBenchmark(gl::NullBackend* backend, int numFrames) {
+  std::vector<bool> wasEnabled;
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    wasEnabled.push_back(lights[i]->isEnabled());
+  }
+  unsigned int numLights = lights.size();
+
+  // Geometry, shadows and post-processing only.
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    lights[i]->setEnabled(false);
+  }
+  BenchmarkResult unlit = benchmarkFrames(backend, numFrames, false);
+
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    lights[i]->setEnabled(true);
+  }
+  BenchmarkResult lit = benchmarkFrames(backend, numFrames, false);
+
+  for (unsigned int i = 0; i < lights.size(); i++) {
+    lights[i]->setEnabled(wasEnabled[i]);
+  }
+  BenchmarkResult mirrored = benchmarkFrames(backend, numFrames, true);
+
+  double unlitFrame = unlit.seconds * 1e6 / numFrames;
+  double litFrame = lit.seconds * 1e6 / numFrames;
+  std::cout << "Benchmark over " << numFrames << " frames, null GL backend:" << std::endl;
+  std::cout << "  No lights: " << unlitFrame << " us/frame, " << unlit.drawCalls / numFrames << " draws/frame, "
+            << unlit.glCalls / numFrames << " GL calls/frame, "
+            << (unlit.drawCalls > 0 ? unlit.seconds * 1e6 / unlit.drawCalls : 0) << " us/draw" << std::endl;
+  std::cout << "  " << numLights << " lights: " << litFrame << " us/frame, " << lit.drawCalls / numFrames << " draws/frame, "
+            << lit.glCalls / numFrames << " GL calls/frame, "
+            << (numLights > 0 ? (litFrame - unlitFrame) / numLights : 0) << " us/light" << std::endl;
+  std::cout << "  " << mirrored.views / numFrames << " mirrors: " << mirrored.seconds * 1e6 / numFrames << " us/frame, "
+            << mirrored.drawCalls / numFrames << " draws/frame, " << mirrored.glCalls / numFrames << " GL calls/frame, "
+            << (mirrored.views > 0 ? mirrored.seconds * 1e6 / mirrored.views : 0) << " us/mirror" << std::endl;
+}
+
 Viewer::~Viewer() {
   delete controller;
   controller = NULL;
@@ -1141,23 +2397,39 @@ Viewer::~Viewer() {
   delete thunderSound;
   thunderSound = NULL;
 
-  glDeleteFramebuffers(1, &deferredShadingFramebuffer);
-  glDeleteFramebuffers(1, &shadowMapFramebuffer);
-  glDeleteFramebuffers(1, &shadowCubeMapFramebuffer);
+  gl::DeleteFramebuffers(1, &deferredShadingFramebuffer);
+  gl::DeleteFramebuffers(1, &shadowMapFramebuffer);
+  gl::DeleteFramebuffers(1, &shadowCubeMapFramebuffer);
 
-  glDeleteTextures(1, &shadowmapDepthTexture);
-  glDeleteTextures(1, &deferredDiffuseTexture);
-  glDeleteTextures(1, &deferredSpecularTexture);
-  glDeleteTextures(1, &deferredEmissiveTexture);
-  glDeleteTextures(1, &deferredNormalTexture);
-  glDeleteTextures(1, &deferredDepthTexture);
-  glDeleteTextures(1, &ssaoNoiseTexture);
-  glDeleteTextures(1, &accumRenderTexture);
-  glDeleteTextures(1, &pickingTexture);
+  gl::DeleteTextures(1, &shadowAtlasTexture);
+  gl::DeleteTextures(1, &shadowCubeArrayTexture);
+  for (std::vector<ShadowSlot>::iterator it = shadowSlots.begin(); it != shadowSlots.end(); it++) {
+    if (it->cubeLayer < 0) {
+      gl::DeleteTextures(1, &it->cubeTexture);
+    }
+    gl::DeleteTextures(1, &it->momentsTexture);
+  }
+  gl::DeleteTextures(1, &varianceMomentsTexture);
+  gl::DeleteTextures(1, &varianceBlurTexture);
+  gl::DeleteRenderbuffers(1, &varianceDepthRenderbuffer);
+  gl::DeleteFramebuffers(1, &varianceFramebuffer);
+  gl::DeleteTextures(1, &deferredDiffuseTexture);
+  gl::DeleteTextures(1, &deferredSpecularTexture);
+  gl::DeleteTextures(1, &deferredEmissiveTexture);
+  gl::DeleteTextures(1, &deferredNormalTexture);
+  gl::DeleteTextures(1, &deferredDepthTexture);
+  gl::DeleteTextures(1, &ssaoNoiseTexture);
+  gl::DeleteTextures(1, &accumRenderTexture);
+  gl::DeleteTextures(1, &pickingTexture);
+  gl::DeleteTextures(1, &lightTileTexture);
+  for (std::map<Light*, StaticShadow>::iterator it = staticShadows.begin(); it != staticShadows.end(); it++) {
+    deleteStaticShadow(it->second);
+  }
 
-  glDeleteBuffers(1, &quadVertexBuffer);
-  glDeleteVertexArrays(1, &vertexArrayId);
-  glDeleteRenderbuffers(2, &depthRenderBuffers[0]);
+  gl::DeleteBuffers(1, &quadVertexBuffer);
+  gl::DeleteBuffers(1, &lightConeVertexBuffer);
+  gl::DeleteVertexArrays(1, &vertexArrayId);
+  gl::DeleteRenderbuffers(2, &depthRenderBuffers[0]);
 
   for (std::vector<Mesh*>::const_iterator it = meshes.begin(); it != meshes.end(); it++) {
     delete *it;
@@ -1169,8 +2441,17 @@ Viewer::~Viewer() {
   }
   lights.clear();
 
-  // Cleans up and closes window.
-  glfwTerminate();
+  for (std::vector<Material*>::const_iterator it = lightSphereMaterials.begin(); it != lightSphereMaterials.end(); it++) {
+    delete *it;
+  }
+  lightSphereMaterials.clear();
+
+  Texture::shutdown();
+
+  // Cleans up and closes window. Headless runs never initialise GLFW.
+  if (!headless) {
+    glfwTerminate();
+  }
 }
 
 void Viewer::takeScreenshot() {
@@ -1181,17 +2462,16 @@ void Viewer::takeScreenshot() {
   const GLuint texes[] = {deferredDiffuseTexture, deferredSpecularTexture, deferredEmissiveTexture, deferredNormalTexture, pickingTexture, deferredDepthTexture, accumRenderTexture};
 
   for (int i = 0; i < 7; i++) {
-    glBindFramebuffer(GL_FRAMEBUFFER, deferredShadingFramebuffer);
-    glBindTexture(GL_TEXTURE_2D, texes[i]);
+    RenderStateTracker::bindFramebuffer(deferredShadingFramebuffer);
     if (i == 5) {
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texes[i], 0);
+      gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texes[i], 0);
     } else {
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texes[i], 0);
+      gl::FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texes[i], 0);
     }
 
 
     if (i == 4) {
-      glReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_INT, picks);
+      gl::ReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_INT, picks);
       for (int p = 0; p < width*height; p++) {
         uint16_t pick = picks[p];
         pick *= 1000;
@@ -1200,7 +2480,7 @@ void Viewer::takeScreenshot() {
         pixels[3*p+2] = static_cast<unsigned char>(pick & 0xff);
       }
     } else if (i == 5) {
-      glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, picks);
+      gl::ReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, picks);
       for (int p = 0; p < width*height; p++) {
         uint32_t pick = picks[p];
         unsigned char fpix = static_cast<unsigned char>(static_cast<float>(pick - 4190000000)/90000000.0f*256.0f);
@@ -1209,7 +2489,7 @@ void Viewer::takeScreenshot() {
         pixels[3*p+2] = fpix;
       }
     } else {
-      glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, pixels);
+      gl::ReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, pixels);
     }
 
     Texture::saveTextureToFile(pixels, width, height, "screenshots/screen_" + names[i] + ".png");
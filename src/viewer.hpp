@@ -4,11 +4,14 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <map>
 #include <vector>
 #include "controller.hpp"
 #include "mesh.hpp"
 #include "light.hpp"
 #include "sound.hpp"
+#include "gl_backend.hpp"
+#include "render_state.hpp"
 #include "shader.hpp"
 #include "shader_instances.hpp"
 
@@ -16,21 +19,50 @@
 #define DEFAULT_HEIGHT 768
 #define SSAO_NOISE_TEXTURE_WIDTH 4
 #define NOISE_SIZE (SSAO_NOISE_TEXTURE_WIDTH*SSAO_NOISE_TEXTURE_WIDTH)
+// Screen tile size in pixels for tiled lighting. Must match TILE_SIZE in deferredShading.frag.
+#define LIGHT_TILE_SIZE 16
+// Sides of the cone drawn around spot lights.
+#define LIGHT_CONE_SEGMENTS 16
+// Frames a shadowed light has to stay still for before its static shadow is cached.
+#define STATIC_SHADOW_STILL_FRAMES 8
+// How far cascade splits lean from uniform (0) to logarithmic (1) spacing.
+#define SHADOW_CASCADE_LOG_WEIGHT 0.75f
+// Shadow map texels rendered per frame before lights start updating less often.
+#define SHADOW_TEXEL_BUDGET (3 * 2048 * 2048)
+// Frames between updates of a map that didn't fit the budget. Cube maps
+// update 6 / SHADOW_REDUCED_RATE faces at a time instead.
+#define SHADOW_REDUCED_RATE 3
+// Lowest resolution tier, in texels per side.
+#define MIN_SHADOW_MAP_SIZE 128
+#define ALL_CUBE_FACES 0x3f
 
 class Controller;
 class Mirror;
 
 class Viewer {
 public:
-  Viewer();
+  /**
+   * A headless viewer has no window, sound or controller. Set a gl::NullBackend
+   * before initializing one, then use runBenchmark().
+   */
+  Viewer(bool headless = false);
   ~Viewer();
 
   bool initialize();
   bool initializeSound();
+  // Submits all programs. finishShaders() waits for the ones the first frame needs.
   bool initializeShaders();
+  bool finishShaders();
   void run();
 
-  void renderMesh(Mesh* mesh, bool onlyVerts=false);
+  /**
+   * Render numFrames from a fixed camera without lights, with all lights, and
+   * only the mirror views. Prints the engine's CPU time per draw, per light
+   * and per mirror, and how many GL calls backend received.
+   */
+  void runBenchmark(gl::NullBackend* backend, int numFrames);
+
+  void renderMesh(shaders::GeomTexturesProgram* program, Mesh* mesh, bool onlyVerts=false);
 
   /**
    * Render scene with deferred pipeline.
@@ -38,8 +70,6 @@ public:
    */
   void renderScene(GLuint renderTargetFBO, std::vector<Mesh*>& thisFrameMeshes, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, const glm::vec3& cameraPosition, bool postProcess, double currentTime, double deltaTime, const glm::vec3& halfspacePosition, const glm::vec3& halfspaceNormal, bool doPicking);
 
-  void bindRenderTarget(GLuint renderTargetFBO);
-
   GLFWwindow* getWindow() {
     return window;
   }
@@ -59,8 +89,208 @@ public:
   void drawTextureWithQuadProgram(GLuint tex);
   void drawQuad();
 
+  // Re-render cached static shadows. Call after moving or removing a mesh that isn't dynamic.
+  void invalidateStaticShadows() {
+    staticGeometryVersion++;
+  }
+
 private:
+  /**
+   * Analytic estimate of the finest mip level of texture needed to draw mesh,
+   * from the mesh's texel density and its closest distance to the camera.
+   */
+  int requiredMipLevel(Mesh* mesh, Texture* texture, const glm::vec3& cameraPosition, const glm::mat4& projectionMatrix);
+
+  // Shader permutation for drawing material, and for lighting with light, under the current settings.
+  unsigned int geomTexturesKey(Material* material);
+  unsigned int deferredShadingKey(Light* light);
+  unsigned int baseShadingKey();
+  unsigned int tiledShadingKey();
+
+  // Lighting permutations the first frame needs with the default settings.
+  std::vector<unsigned int> defaultShadingKeys();
+  // Queues every other permutation a setting toggle can switch to.
+  void prefetchShaders();
+
+  /**
+   * Lights without a shadow map to render are all shaded together in the
+   * tiled pass, and so are point lights whose cube map is in the array.
+   * Lights past the first MAX_LIGHTS aren't in the tile masks, so they always
+   * get their own pass.
+   */
+  bool isTiledLight(unsigned int lightId);
+  bool hasCubeArrayShadow(Light* light);
+
+  /**
+   * Pixel rectangle (x, y, width, height) that light's influence radius can
+   * reach in the given view. False if the radius is outside the view frustum.
+   */
+  bool lightScreenRect(Light* light, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, int rect[4]);
+  // Fraction of the screen light's influence radius covers in the view VP, 0 if outside it.
+  float lightScreenCoverage(Light* light, const glm::mat4& VP);
+
+  /**
+   * Bins the tiled lights into LIGHT_TILE_SIZE screen tiles by their
+   * lightScreenRect(), and uploads each tile's light mask.
+   */
+  void buildLightTiles(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix);
+
+  /**
+   * Whether light can be shaded over a mesh around its influence radius
+   * instead of a full screen quad: a cone for spot lights, otherwise a sphere.
+   */
+  bool hasLightVolume(Light* light);
+  bool hasLightCone(Light* light);
+  glm::mat4 lightVolumeMatrix(Light* light);
+  // Draws the volume with program, which must be in use, from position-only buffers.
+  template<class PROGRAM>
+  void drawLightVolume(PROGRAM* program, Light* light);
+
+  /**
+   * Where a light's shadow map lives: a region of shadowAtlasTexture, or for
+   * point lights a cube map, its own or six layers of shadowCubeArrayTexture.
+   * Dual-paraboloid maps take a region
+   * twice as wide as it's tall, one square per hemisphere, and directional
+   * lights one square per cascade.
+   */
+  struct ShadowSlot {
+    int size; // Texels per side, 0 if the light has no shadow map.
+    int width; // Of the atlas region.
+    int atlasX, atlasY;
+    // Resolution tier the map was last rendered at, in the corner of its region.
+    int renderSize, renderWidth;
+    GLuint cubeTexture;
+    int cubeLayer; // Index of the cube in shadowCubeArrayTexture, -1 if it has a texture of its own.
+    GLuint momentsTexture; // Blurred, mipmapped moments of a variance shadow map, at half resolution.
+    glm::mat4 depthBiasVP; // World space to shadow map coordinates.
+    glm::mat4 cascadeVP[SHADOW_CASCADES]; // Same for each cascade of a directional light.
+    glm::vec4 cascadeEnds; // View space distance each cascade reaches.
+    double scheduledTime; // currentTime of the frame it was last scheduled for.
+    long updatedFrame; // shadowFrame it was last rendered in, -1 before the first.
+    int nextFace; // Cube face to start from when updating only some.
+    int casterDraws; // Meshes drawn into the map at its last update.
+  };
+
+  /**
+   * Packs the maps of lights that cast shadows into the atlas, largest
+   * first, and creates their cube maps, as one cube map array if the
+   * driver supports them. Lights that don't fit lose their shadows.
+   */
+  void allocateShadowSlots();
+
+  /**
+   * Updates the shadow maps of the shadowed lights visible in any of this
+   * frame's views, unless an earlier view already scheduled them. Lights get
+   * a resolution tier and an update order from their brightness and their
+   * coverage of the player's view, whichever view renders first. Once SHADOW_TEXEL_BUDGET is spent, only the map updated
+   * longest ago is updated each frame, so the cost stays bounded however
+   * many lights there are. Cascades are fitted to the view, so directional
+   * lights are rendered for every view. Done before any light is shaded, so
+   * shading doesn't alternate with shadow rendering.
+   */
+  void renderShadows(std::vector<Mesh*>& thisFrameMeshes, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, double currentTime);
+  // Texels per side to render slot's map at, for a light of the given priority.
+  int shadowMapTier(const ShadowSlot& slot, float priority);
+  long shadowMapCost(Light* light, int renderSize, unsigned int faces);
+  void updateShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, int renderSize, unsigned int faces, bool receiverCulling);
+  /**
+   * Renders slot's map at slot.renderSize. faces is a mask of the cube faces
+   * to update. Only maps that will be rendered again next frame may leave out
+   * casters whose shadows no view can see, see shadowCasterFaces().
+   */
+  void renderShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, unsigned int faces, bool receiverCulling);
+  // Attaches one face of slot's cube map as target's depth buffer.
+  void attachCubeFace(GLenum target, const ShadowSlot& slot, int face);
+  /**
+   * Splits the view frustum into SHADOW_CASCADES slices and renders an
+   * orthographic map around each, drawing only the meshes that can shadow it.
+   * Maps are snapped to whole texels so they don't shimmer as the camera moves.
+   */
+  void renderCascadedShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix);
+  /**
+   * Renders depth moments at full resolution, blurs them across and then down
+   * into the light's half resolution moments texture, and builds its mips.
+   */
+  void renderVarianceShadow(Light* light, ShadowSlot& slot, std::vector<Mesh*>& thisFrameMeshes, bool receiverCulling);
+  // Scales shadow map coordinates down to a size x size square of the atlas.
+  glm::mat4 atlasRegionMatrix(int x, int y, int size);
+  /**
+   * View-projection of the shadow map of a spot or point light, of each cube
+   * face for point lights. Dual-paraboloid lights get the view of each
+   * hemisphere scaled to the far distance, the projection is done in the shaders.
+   */
+  void shadowViewProjections(Light* light, glm::mat4 faceVP[6]);
+  bool hasParaboloidShadow(Light* light);
+  bool hasVarianceShadow(Light* light);
+  float paraboloidShadowFar(Light* light);
+
+  enum ShadowCasters {
+    ALL_CASTERS,
+    STATIC_CASTERS,
+    DYNAMIC_CASTERS
+  };
+  /**
+   * Mask of the faces of light's shadow map mesh can cast into, as cube
+   * faces, hemispheres or bit 0 for a single map. 0 if it's beyond the
+   * light's reach, or with receiverCulling, if its shadow can't reach any
+   * of shadowReceiverVPs.
+   */
+  unsigned int shadowCasterFaces(Light* light, const glm::mat4 faceVP[6], Mesh* mesh, bool receiverCulling);
+  /**
+   * Draws casters into all faces of light's shadow map, the size x size
+   * square at x, y of state's target, each only into the faces it reaches.
+   * Cube faces go to layers firstLayer on. Returns the draws issued.
+   */
+  int drawShadowPasses(Light* light, const glm::mat4 faceVP[6], const RenderState& state, int x, int y, int size, std::vector<Mesh*>& thisFrameMeshes, ShadowCasters casters, unsigned int faces, int firstLayer, bool receiverCulling);
+  template<class PROGRAM>
+  int drawShadowCasters(PROGRAM* program, const glm::mat4& depthVP, std::vector<Mesh*>& thisFrameMeshes, ShadowCasters casters);
+
+  /**
+   * Depth of the non-dynamic meshes from a light that hasn't moved, blitted
+   * into the shadow map each frame before the dynamic meshes are drawn over it.
+   */
+  struct StaticShadow {
+    glm::vec3 position;
+    glm::vec3 direction;
+    float spread;
+    int stillFrames; // Shadow renders the light hasn't moved in.
+    GLuint framebuffer;
+    GLuint texture; // 0 until the light has been still for STATIC_SHADOW_STILL_FRAMES.
+    unsigned int geometryVersion; // staticGeometryVersion texture was rendered at.
+    int renderSize; // Resolution tier texture was rendered at.
+    bool valid;
+  };
+
+  /**
+   * The cached static shadow to start light's shadow map from, or NULL if the
+   * light is moving and all meshes have to be drawn. Frees the cache of a
+   * light that moved.
+   */
+  StaticShadow* updateStaticShadow(Light* light, const ShadowSlot& slot);
+  void deleteStaticShadow(StaticShadow& staticShadow);
+
+  /**
+   * Fill the light and material tables the shaders index into. The light
+   * table holds MAX_LIGHTS lights, batch n being lights n * MAX_LIGHTS
+   * onwards. Only batch 0 is tiled, per-light passes upload the others as
+   * they reach them. Fails if there are more materials than MAX_MATERIALS.
+   */
+  void uploadLights(unsigned int batch);
+  bool uploadMaterials();
+
+  // Finish background compiles that are done and submit more. Once per frame.
+  void updateShaders();
+
+  struct BenchmarkResult {
+    double seconds;
+    unsigned long drawCalls;
+    unsigned long glCalls;
+    unsigned int views; // renderScene calls.
+  };
+  BenchmarkResult benchmarkFrames(gl::NullBackend* backend, int numFrames, bool mirrorsOnly);
+
   int width, height;
+  bool headless;
   GLFWwindow* window;
 
   Settings* settings;
@@ -80,21 +310,38 @@ private:
   Light* lightningLight;
   Light* gunLight;
   Light* moveLamp;
+  std::vector<Material*> lightSphereMaterials; // Indexed like lights.
 
   uint16_t lastPickedMesh;
   double startCharAnimTime;
   double startShudderTime;
 
   glm::mat4 shadowmapBiasMatrix;
+  std::vector<ShadowSlot> shadowSlots; // Indexed like lights.
+  std::map<Light*, StaticShadow> staticShadows;
+  unsigned int staticGeometryVersion;
+  long shadowFrame; // Counts frames, for scheduling shadow updates.
+  double shadowFrameTime; // currentTime of shadowFrame.
+  long shadowTexels; // Shadow map texels rendered this frame.
+  std::vector<glm::mat4> shadowReceiverVPs; // Of every view rendered this frame. Empty to not cull by them.
   glm::vec3 ssaoKernel[4];
   glm::vec3 ssaoNoise[NOISE_SIZE];
 
-  shaders::ShaderProgram<shaders::GeomTexturesVertShader, shaders::GeomTexturesFragShader> geomTexturesProgram;
+  shaders::ShaderPermutations<shaders::GeomTexturesProgram> geomTexturesPrograms;
   shaders::ShaderProgram<shaders::PassThroughVert, shaders::JustTextureFrag> quadProgram;
-  shaders::ShaderProgram<shaders::DeferredShadingVert, shaders::DeferredShadingFrag> deferredShadingProgram;
+  shaders::ShaderPermutations<shaders::DeferredShadingProgram> deferredShadingPrograms;
   shaders::ShaderProgram<shaders::DepthShadowVert, shaders::DepthShadowFrag> depthProgram;
+  shaders::DepthCubeProgram cubeDepthProgram;
+  shaders::DepthParaboloidProgram paraboloidDepthProgram;
+  shaders::DepthMomentsProgram depthMomentsProgram;
+  shaders::VarianceBlurProgram varianceBlurProgram;
   shaders::ShaderProgram<shaders::PassThroughVert, shaders::PostProcessFrag> postProcessProgram;
 
+  shaders::UniformBuffer<shaders::ViewBlock> viewBlock;
+  shaders::UniformBuffer<shaders::LightBlock> lightBlock;
+  unsigned int uploadedLightBatch;
+  shaders::UniformBuffer<shaders::MaterialBlock> materialBlock;
+
   // Deferred Shading textures.
   GLuint deferredDiffuseTexture;
   GLuint deferredSpecularTexture;
@@ -103,11 +350,24 @@ private:
   GLuint deferredDepthTexture;
 
   // Other textures.
-  GLuint shadowmapDepthTexture;
-  GLuint shadowmapCubeDepthTexture;
+  GLuint shadowAtlasTexture;
+  // Cube maps of all shadowed point lights, when ARB_texture_cube_map_array is supported.
+  bool cubeShadowArray;
+  GLuint shadowCubeArrayTexture;
+  // Scratch space for variance shadow maps, as large as the largest of them.
+  int varianceSize;
+  GLuint varianceMomentsTexture;
+  GLuint varianceBlurTexture; // Half resolution.
+  GLuint varianceDepthRenderbuffer;
+  GLuint varianceFramebuffer;
   GLuint ssaoNoiseTexture;
   GLuint accumRenderTexture;
   GLuint pickingTexture;
+  GLuint lightTileTexture;
+
+  // Two words per tile, bit i set if light i reaches the tile.
+  int tilesX, tilesY;
+  std::vector<GLuint> lightTileMasks;
 
   GLuint vertexArrayId;
   GLuint deferredShadingFramebuffer;
@@ -115,6 +375,7 @@ private:
   GLuint shadowCubeMapFramebuffer;
   GLuint accumRenderFramebuffer;
   GLuint quadVertexBuffer;
+  GLuint lightConeVertexBuffer;
   GLuint depthRenderBuffers[2]; // TODO: Remove second one.
 
 };
@@ -0,0 +1,52 @@
+
+#include "worker_pool.hpp"
+
+WorkerPool::WorkerPool(unsigned int numThreads): stopping(false) {
+  if (numThreads == 0) {
+    numThreads = std::thread::hardware_concurrency();
+    if (numThreads == 0) {
+      numThreads = 2;
+    }
+  }
+  for (unsigned int i = 0; i < numThreads; i++) {
+    threads.push_back(std::thread(&WorkerPool::workerLoop, this));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    stopping = true;
+  }
+  jobsAvailable.notify_all();
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+void WorkerPool::submit(const std::function<void()>& job) {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    jobs.push_back(job);
+  }
+  jobsAvailable.notify_one();
+}
+
+void WorkerPool::workerLoop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(jobsMutex);
+      while (!stopping && jobs.empty()) {
+        jobsAvailable.wait(lock);
+      }
+      // Drain remaining jobs before stopping.
+      if (jobs.empty()) {
+        return;
+      }
+      job = jobs.front();
+      jobs.pop_front();
+    }
+    job();
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/**
+ * Fixed set of threads running submitted jobs in FIFO order.
+ * Jobs must not make GL calls - there is no context on the workers.
+ */
+class WorkerPool {
+public:
+  // numThreads=0 uses one thread per hardware core.
+  WorkerPool(unsigned int numThreads = 0);
+  ~WorkerPool();
+
+  void submit(const std::function<void()>& job);
+
+  unsigned int getNumThreads() {
+    return threads.size();
+  }
+
+private:
+  void workerLoop();
+
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()> > jobs;
+  std::mutex jobsMutex;
+  std::condition_variable jobsAvailable;
+  bool stopping;
+};
+
+#endif